@@ -0,0 +1,694 @@
+// Benchmarks for the parse and I/O paths, results are printed as JSON.
+//
+//   gcc -O2 bench.c -o bench -lpthread
+//   gcc -O2 -DHTTP_WITH_URING bench.c -o bench -lpthread    for loopback --client uring
+//   ./bench micro                  in-process benchmarks over a corpus of recorded responses
+//   ./bench loopback [options]     end-to-end requests against a loopback server in this process
+//   ./bench serve [options]        only run the loopback server, for other clients
+//
+// The library is included as a source file so that the internal parse functions can be measured directly.
+#include "http.c"
+#include <signal.h>
+#include <netinet/tcp.h>
+
+#define BENCH_READ_SIZE 16384 // bytes handed to the parser per simulated recv()
+
+static long long nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// Corpus
+
+// Headers of a recorded CDN response, the framing header is appended per corpus entry.
+static const char* recordedHeaders =
+    "HTTP/1.1 200 OK\r\n"
+    "Date: Mon, 01 Jan 2024 12:00:00 GMT\r\n"
+    "Content-Type: application/json; charset=utf-8\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: private, max-age=0, no-store, no-cache, must-revalidate\r\n"
+    "Set-Cookie: __cf_bm=Jd1nO5lq0sVhY2mQ7b8zXoWcR4tP3uKe6fAaGiLy9MN; path=/; expires=Mon, 01-Jan-24 12:30:00 GMT; domain=.example.com; HttpOnly; Secure; SameSite=None\r\n"
+    "Vary: Accept-Encoding\r\n"
+    "Strict-Transport-Security: max-age=31536000; includeSubDomains\r\n"
+    "X-Content-Type-Options: nosniff\r\n"
+    "X-Request-Id: 5f2b8c1e9a7d4e3fb6c0a1d2e3f4a5b6\r\n"
+    "Server: cloudflare\r\n"
+    "CF-RAY: 84a1b2c3d4e5f607-AMS\r\n";
+
+typedef struct {
+    const char* name;
+    char* data;
+    size_t size;
+    size_t headerSize;
+} BenchResponse;
+
+typedef struct {
+    char* data;
+    size_t size;
+    size_t capacity;
+} BenchBuffer;
+
+static void appendBench(BenchBuffer* buffer, const void* data, size_t size) {
+    if (buffer->size + size + 1 > buffer->capacity) {
+        buffer->capacity = (buffer->size + size + 1) * 2;
+        buffer->data = realloc(buffer->data, buffer->capacity);
+        if (!buffer->data) abort();
+    }
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+    buffer->data[buffer->size] = '\0';
+}
+
+static void appendBenchText(BenchBuffer* buffer, const char* text) {
+    appendBench(buffer, text, strlen(text));
+}
+
+// Deterministic printable body bytes.
+static void fillBody(char* body, size_t size) {
+    for (size_t i = 0; i < size; i++) body[i] = 'a' + (char)(i * 7 % 26);
+}
+
+static BenchResponse lengthResponse(const char* name, size_t bodySize, int extraHeaders) {
+    BenchBuffer buffer = {0};
+    char line[128];
+    appendBenchText(&buffer, recordedHeaders);
+    for (int i = 0; i < extraHeaders; i++) {
+        snprintf(line, sizeof(line), "X-Extra-Header-%d: value-%d-%08x\r\n", i, i, i * 2654435761u);
+        appendBenchText(&buffer, line);
+    }
+    snprintf(line, sizeof(line), "Content-Length: %zu\r\n\r\n", bodySize);
+    appendBenchText(&buffer, line);
+    size_t headerSize = buffer.size;
+
+    char* body = malloc(bodySize + 1);
+    if (!body) abort();
+    fillBody(body, bodySize);
+    appendBench(&buffer, body, bodySize);
+    free(body);
+    return (BenchResponse){ name, buffer.data, buffer.size, headerSize };
+}
+
+static BenchResponse chunkedResponse(const char* name, size_t chunkSize, int chunks) {
+    BenchBuffer buffer = {0};
+    char line[64];
+    appendBenchText(&buffer, recordedHeaders);
+    appendBenchText(&buffer, "Transfer-Encoding: chunked\r\n\r\n");
+    size_t headerSize = buffer.size;
+
+    char* chunk = malloc(chunkSize);
+    if (!chunk) abort();
+    fillBody(chunk, chunkSize);
+    for (int i = 0; i < chunks; i++) {
+        snprintf(line, sizeof(line), "%zx\r\n", chunkSize);
+        appendBenchText(&buffer, line);
+        appendBench(&buffer, chunk, chunkSize);
+        appendBenchText(&buffer, "\r\n");
+    }
+    appendBenchText(&buffer, "0\r\n\r\n");
+    free(chunk);
+    return (BenchResponse){ name, buffer.data, buffer.size, headerSize };
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// Microbenchmarks
+
+typedef struct {
+    int iterations;
+    double seconds;
+} BenchRun;
+
+static bool firstResult = true;
+
+static void printResult(const char* group, const BenchResponse* response, const BenchRun* run, size_t bytesPerOp) {
+    double ns = run->seconds * 1e9 / run->iterations;
+    printf("%s\n    {\"name\": \"%s/%s\", \"bytes\": %zu, \"iterations\": %d, \"ns_per_op\": %.1f, \"mb_per_s\": %.1f}",
+        firstResult ? "" : ",", group, response->name, bytesPerOp, run->iterations, ns, bytesPerOp / ns * 1e3);
+    firstResult = false;
+}
+
+// Runs op in growing batches until minMs have passed.
+static BenchRun measure(bool (*op)(const BenchResponse*, int), const BenchResponse* response, int minMs) {
+    if (!op(response, 1)) {
+        fprintf(stderr, "benchmark failed on %s\n", response->name);
+        exit(1);
+    }
+    BenchRun run = {0};
+    for (int batch = 1; run.seconds * 1000 < minMs; batch *= 2) {
+        long long start = nowNs();
+        if (!op(response, batch)) {
+            fprintf(stderr, "benchmark failed on %s\n", response->name);
+            exit(1);
+        }
+        run.seconds += (nowNs() - start) / 1e9;
+        run.iterations += batch;
+    }
+    return run;
+}
+
+// Status line and headers, parsed into the header index. Includes copying them, since parsing is destructive.
+static bool benchHeaders(const BenchResponse* response, int iterations) {
+    HTTPResponseInfo msg = {0};
+    msg.l4.buffer = malloc(response->headerSize + 1);
+    bool ok = msg.l4.buffer != NULL;
+    for (int i = 0; i < iterations && ok; i++) {
+        memcpy(msg.l4.buffer, response->data, response->headerSize);
+        msg.l7.content_length = -1;
+        ok = parseHTTPHeaders(&msg, response->headerSize);
+    }
+    free(msg.l4.buffer);
+    free(msg.headers.spans);
+    return ok;
+}
+
+// The whole buffered receive path (buffer sizing, framing, in-place chunk decoding) fed from memory
+// in BENCH_READ_SIZE slices instead of recv().
+static bool benchReceive(const BenchResponse* response, int iterations) {
+    for (int i = 0; i < iterations; i++) {
+        HTTPResponseInfo msg = {0};
+        HTTPReceiveState state;
+        msg.l7.content_length = -1;
+        if (!beginResponseBuffer(&msg, &state, NULL)) return false;
+        size_t offset = 0;
+        bool done = false;
+        while (!done) {
+            bool waitAll;
+            size_t readSize = reserveResponseBuffer(&msg, &state, &waitAll);
+            if (readSize > BENCH_READ_SIZE && !waitAll) readSize = BENCH_READ_SIZE;
+            if (readSize > response->size - offset) readSize = response->size - offset;
+            memcpy(msg.l4.buffer + msg.l4.totalSize, response->data + offset, readSize);
+            offset += readSize;
+            if (readSize == 0 || receivedResponseData(&msg, &state, readSize, &done) != 0) break;
+        }
+        bool ok = done && msg.error == 0 && msg.l7.content_length >= 0;
+        free(msg.l4.buffer);
+        free(msg.headers.spans);
+        if (!ok) return false;
+    }
+    return true;
+}
+
+typedef struct {
+    int sd;
+    const BenchResponse* response;
+    int count;
+} BenchWriter;
+
+static void* writeResponses(void* arg) {
+    BenchWriter* writer = arg;
+    for (int i = 0; i < writer->count; i++) {
+        struct iovec iov = { .iov_base = writer->response->data, .iov_len = writer->response->size };
+        if (!sendTCPRawData(writer->sd, NULL, &iov, 1, NULL, 0, 0)) break;
+    }
+    return NULL;
+}
+
+// readTCPRawData() over a Unix socket pair, with a thread writing the responses back to back.
+// If the reader fails, closing its end makes the writer fail too.
+static bool benchSocket(const BenchResponse* response, int iterations) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) return false;
+    BenchWriter writer = { sv[1], response, iterations };
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, writeResponses, &writer) != 0) {
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    }
+
+    // responses follow each other on the stream, so data read past one is carried to the next
+    bool ok = true;
+    char* carry = NULL;
+    size_t carrySize = 0;
+    for (int i = 0; i < iterations && ok; i++) {
+        HTTPResponseInfo msg = {0};
+        msg.l7.content_length = -1;
+        ok = readTCPRawData(sv[0], NULL, &msg, NULL, NULL, &carry, &carrySize) == 0;
+        free(msg.l4.buffer);
+        free(msg.headers.spans);
+    }
+    free(carry);
+    close(sv[0]);
+    pthread_join(thread, NULL);
+    close(sv[1]);
+    return ok;
+}
+
+static int runMicro(int minMs) {
+    BenchResponse corpus[] = {
+        lengthResponse("small", 256, 0),
+        lengthResponse("large", 1024 * 1024, 0),
+        lengthResponse("many_headers", 512, 64),
+        chunkedResponse("chunked_tiny", 8, 4096),
+        chunkedResponse("chunked_large", 16384, 64)
+    };
+    int count = sizeof(corpus) / sizeof(corpus[0]);
+
+    printf("{\n  \"benchmark\": \"micro\",\n  \"read_size\": %d,\n  \"results\": [", BENCH_READ_SIZE);
+    for (int i = 0; i < count; i++) {
+        BenchRun run = measure(benchHeaders, &corpus[i], minMs);
+        printResult("headers", &corpus[i], &run, corpus[i].headerSize);
+    }
+    for (int i = 0; i < count; i++) {
+        BenchRun run = measure(benchReceive, &corpus[i], minMs);
+        printResult("receive", &corpus[i], &run, corpus[i].size);
+    }
+    for (int i = 0; i < count; i++) {
+        BenchRun run = measure(benchSocket, &corpus[i], minMs);
+        printResult("socket", &corpus[i], &run, corpus[i].size);
+    }
+    printf("\n  ]\n}\n");
+    for (int i = 0; i < count; i++) free(corpus[i].data);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// Loopback server
+
+typedef enum {
+    FRAMING_LENGTH,  // Content-Length
+    FRAMING_CHUNKED, // Transfer-Encoding: chunked
+    FRAMING_CLOSE    // no framing, the connection is closed after the body
+} ServerFraming;
+
+typedef struct {
+    int port;
+    ServerFraming framing;
+    size_t bodySize;
+    size_t chunkSize;       // chunked: payload bytes per chunk
+    size_t trickleBytes;    // write the response in pieces of this size (0 = at once)
+    int trickleDelayUs;     // pause between the pieces
+    int maxRequests;        // close a connection after this many responses (0 = when the client does)
+    int closeDelayMs;       // wait before closing a connection the server ends
+} ServerOptions;
+
+typedef struct {
+    ServerOptions options;
+    int listener;
+    char* response;         // prepared response, shared by all connections
+    size_t responseSize;
+} BenchServer;
+
+typedef struct {
+    BenchServer* server;
+    int sd;
+} ServerConnection;
+
+static char* buildServerResponse(const ServerOptions* options, size_t* size) {
+    BenchBuffer buffer = {0};
+    char line[64];
+    appendBenchText(&buffer, "HTTP/1.1 200 OK\r\nServer: bench\r\nContent-Type: text/plain\r\n");
+    char* body = malloc(options->bodySize + 1);
+    if (!body) abort();
+    fillBody(body, options->bodySize);
+
+    if (options->framing == FRAMING_LENGTH) {
+        snprintf(line, sizeof(line), "Content-Length: %zu\r\n\r\n", options->bodySize);
+        appendBenchText(&buffer, line);
+        appendBench(&buffer, body, options->bodySize);
+    } else if (options->framing == FRAMING_CHUNKED) {
+        appendBenchText(&buffer, "Transfer-Encoding: chunked\r\n\r\n");
+        for (size_t offset = 0; offset < options->bodySize; offset += options->chunkSize) {
+            size_t length = options->bodySize - offset < options->chunkSize ? options->bodySize - offset : options->chunkSize;
+            snprintf(line, sizeof(line), "%zx\r\n", length);
+            appendBenchText(&buffer, line);
+            appendBench(&buffer, body + offset, length);
+            appendBenchText(&buffer, "\r\n");
+        }
+        appendBenchText(&buffer, "0\r\n\r\n");
+    } else {
+        appendBenchText(&buffer, "Connection: close\r\n\r\n");
+        appendBench(&buffer, body, options->bodySize);
+    }
+    free(body);
+    *size = buffer.size;
+    return buffer.data;
+}
+
+static bool writeAll(int sd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = send(sd, data, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool writeResponse(BenchServer* server, int sd) {
+    const ServerOptions* options = &server->options;
+    if (options->trickleBytes == 0) return writeAll(sd, server->response, server->responseSize);
+    for (size_t offset = 0; offset < server->responseSize; offset += options->trickleBytes) {
+        size_t length = server->responseSize - offset;
+        if (length > options->trickleBytes) length = options->trickleBytes;
+        if (!writeAll(sd, server->response + offset, length)) return false;
+        if (options->trickleDelayUs > 0) usleep(options->trickleDelayUs);
+    }
+    return true;
+}
+
+// Serves one connection: reads request heads (and Content-Length bodies) and answers each with the prepared response.
+static void* serveConnection(void* arg) {
+    ServerConnection* connection = arg;
+    BenchServer* server = connection->server;
+    int sd = connection->sd;
+    free(connection);
+    int one = 1;
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    char buffer[65536];
+    size_t used = 0;
+    int served = 0;
+    bool serverCloses = false;
+    for (;;) {
+        char* end = memmem(buffer, used, "\r\n\r\n", 4);
+        if (!end) {
+            if (used == sizeof(buffer)) break;
+            ssize_t n = recv(sd, buffer + used, sizeof(buffer) - used, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            used += n;
+            continue;
+        }
+        size_t headSize = end + 4 - buffer;
+        buffer[headSize - 2] = '\0';
+        size_t bodySize = 0;
+        const char* length = strcasestr(buffer, "\r\nContent-Length:");
+        if (length) bodySize = strtoul(length + 17, NULL, 10);
+        bool clientCloses = strcasestr(buffer, "\r\nConnection: close") != NULL;
+
+        // drop the request body
+        size_t consumed = headSize + bodySize;
+        if (used >= consumed) {
+            memmove(buffer, buffer + consumed, used - consumed);
+            used -= consumed;
+        } else {
+            size_t left = consumed - used;
+            used = 0;
+            while (left > 0) {
+                ssize_t n = recv(sd, buffer, left < sizeof(buffer) ? left : sizeof(buffer), 0);
+                if (n <= 0) goto done;
+                left -= n;
+            }
+        }
+
+        if (!writeResponse(server, sd)) break;
+        served++;
+        serverCloses = server->options.framing == FRAMING_CLOSE || (server->options.maxRequests > 0 && served >= server->options.maxRequests);
+        if (clientCloses || serverCloses) break;
+    }
+done:
+    if (serverCloses && server->options.closeDelayMs > 0) usleep(server->options.closeDelayMs * 1000);
+    close(sd);
+    return NULL;
+}
+
+static void* acceptConnections(void* arg) {
+    BenchServer* server = arg;
+    for (;;) {
+        int sd = accept(server->listener, NULL, NULL);
+        if (sd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE) continue;
+            return NULL;
+        }
+        ServerConnection* connection = malloc(sizeof(ServerConnection));
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (!connection || (connection->server = server, connection->sd = sd, pthread_create(&thread, &attr, serveConnection, connection)) != 0) {
+            free(connection);
+            close(sd);
+        }
+        pthread_attr_destroy(&attr);
+    }
+}
+
+// Listens on 127.0.0.1:options->port (0 = any free port, stored back) and serves in the background.
+static bool startServer(BenchServer* server, ServerOptions* options) {
+    server->options = *options;
+    server->response = buildServerResponse(options, &server->responseSize);
+    server->listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server->listener < 0) return false;
+    int one = 1;
+    setsockopt(server->listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(options->port) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(addr);
+    if (bind(server->listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(server->listener, 1024) < 0 ||
+        getsockname(server->listener, (struct sockaddr*)&addr, &length) < 0) return false;
+    options->port = server->options.port = ntohs(addr.sin_port);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, acceptConnections, server) != 0) return false;
+    pthread_detach(thread);
+    return true;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// Loopback load
+
+typedef struct {
+    int port;
+    int requests;         // per worker
+    bool keepAlive;       // take connections from a shared pool
+    bool reuseResponse;   // FetchHTTPResponseInto() one context instead of FetchHTTPResponse()
+    HTTPConnectionPool* pool;
+    long long* latencies; // ns, one per request
+    int errors;
+} LoadWorker;
+
+static void* runLoadWorker(void* arg) {
+    LoadWorker* worker = arg;
+    HTTPResponseContext context = {0};
+    for (int i = 0; i < worker->requests; i++) {
+        HTTPRequestInfo rq = { .ipaddr = "127.0.0.1", .host = "localhost", .port = worker->port, .sd = -1, .method = HTTP_GET,
+            .query = "/", .content_type = CONTENT_TYPE_TEXT_PLAIN, .cookie = "", .data_length = -1, .pool = worker->pool };
+        long long start = nowNs();
+        bool sent = SendHTTPRequest(&rq) == 0;
+        HTTPResponseInfo* msg = NULL;
+        if (sent && worker->reuseResponse) msg = FetchHTTPResponseInto(&rq, &context) == 0 ? &context.response : NULL;
+        else if (sent) msg = FetchHTTPResponse(&rq);
+        worker->latencies[i] = nowNs() - start;
+        if (!msg || msg->error != 0 || msg->l7.status_code != 200) worker->errors++;
+        if (!worker->reuseResponse) FreeHTTPResponseResource(msg);
+    }
+    ReleaseHTTPResponseContext(&context);
+    return NULL;
+}
+
+// The client under load: blocking calls on worker threads, or the event loop client on the calling thread.
+typedef enum {
+    CLIENT_BLOCKING,
+    CLIENT_EPOLL,
+    CLIENT_URING
+} LoadClient;
+
+typedef struct {
+    HTTPClient* client;
+    int port;
+    HTTPConnectionPool* pool;
+    int requests;
+    int submitted;
+    int completed;
+    int errors;
+    long long* latencies; // ns, in completion order
+} EngineLoad;
+
+// One of the requests the event loop client keeps in flight, resubmitted as soon as it completes.
+typedef struct {
+    EngineLoad* load;
+    HTTPRequestInfo rq;
+    long long start;
+} EngineSlot;
+
+static void submitEngineRequest(EngineSlot* slot);
+
+static void engineRequestDone(HTTPRequestInfo* rq, HTTPResponseInfo* msg, void* ctx) {
+    (void)rq;
+    EngineSlot* slot = ctx;
+    EngineLoad* load = slot->load;
+    load->latencies[load->completed++] = nowNs() - slot->start;
+    if (msg->error != 0 || msg->l7.status_code != 200) load->errors++;
+    FreeHTTPResponseResource(msg);
+    if (load->submitted < load->requests) submitEngineRequest(slot);
+}
+
+static void submitEngineRequest(EngineSlot* slot) {
+    EngineLoad* load = slot->load;
+    load->submitted++;
+    slot->rq = (HTTPRequestInfo){ .ipaddr = "127.0.0.1", .host = "localhost", .port = load->port, .sd = -1, .method = HTTP_GET,
+        .query = "/", .content_type = CONTENT_TYPE_TEXT_PLAIN, .cookie = "", .data_length = -1, .pool = load->pool };
+    slot->start = nowNs();
+    if (SubmitHTTPRequest(load->client, &slot->rq, engineRequestDone, slot) < 0) {
+        load->latencies[load->completed++] = 0;
+        load->errors++;
+    }
+}
+
+// Runs the requests through one event loop client, concurrency of them in flight. Returns the error count.
+static int runEngineLoad(EngineLoad* load, int concurrency) {
+    EngineSlot* slots = calloc(concurrency, sizeof(EngineSlot));
+    if (!slots) return load->requests;
+    for (int i = 0; i < concurrency; i++) {
+        slots[i].load = load;
+        submitEngineRequest(&slots[i]);
+    }
+    if (RunHTTPClient(load->client, -1) != 0) load->errors += load->requests - load->completed;
+    free(slots);
+    return load->errors;
+}
+
+static int compareLatency(const void* a, const void* b) {
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentileUs(const long long* sorted, int count, double p) {
+    int index = (int)(p / 100 * (count - 1) + 0.5);
+    return sorted[index] / 1e3;
+}
+
+static const char* framingName(ServerFraming framing) {
+    return framing == FRAMING_CHUNKED ? "chunked" : framing == FRAMING_CLOSE ? "close" : "length";
+}
+
+static int runLoopback(ServerOptions* options, int requests, int concurrency, bool keepAlive, bool reuseResponse, LoadClient client) {
+    BenchServer server;
+    if (!startServer(&server, options)) {
+        perror("loopback server");
+        return 1;
+    }
+    if (concurrency < 1) concurrency = 1;
+    if (requests < concurrency) requests = concurrency;
+
+    HTTPConnectionPool* pool = keepAlive ? CreateHTTPConnectionPool(&(HTTPConnectionPoolOptions){ .max_idle_per_host = concurrency, .max_idle_total = concurrency }) : NULL;
+    long long* latencies = calloc(requests, sizeof(long long));
+    LoadWorker* workers = calloc(concurrency, sizeof(LoadWorker));
+    pthread_t* threads = calloc(concurrency, sizeof(pthread_t));
+    if (!latencies || !workers || !threads) return 1;
+
+    HTTPClient* engine = NULL;
+    if (client != CLIENT_BLOCKING) {
+        HTTPClientOptions clientOptions = { .max_in_flight = concurrency, .max_in_flight_per_host = concurrency, .io_uring = client == CLIENT_URING };
+        engine = CreateHTTPClient(&clientOptions);
+        if (!engine) return 1;
+    }
+    const char* clientName = !engine ? "blocking" : GetHTTPClientBackend(engine) == HTTP_BACKEND_IO_URING ? "io_uring" : "epoll";
+
+    int errors = 0;
+    long long start = nowNs();
+    if (engine) {
+        EngineLoad load = { .client = engine, .port = options->port, .pool = pool, .requests = requests, .latencies = latencies };
+        errors = runEngineLoad(&load, concurrency);
+    } else {
+        int assigned = 0;
+        for (int i = 0; i < concurrency; i++) {
+            workers[i] = (LoadWorker){ .port = options->port, .requests = requests / concurrency + (i < requests % concurrency), .keepAlive = keepAlive, .reuseResponse = reuseResponse, .pool = pool };
+            workers[i].latencies = latencies + assigned;
+            assigned += workers[i].requests;
+            pthread_create(&threads[i], NULL, runLoadWorker, &workers[i]);
+        }
+        for (int i = 0; i < concurrency; i++) {
+            pthread_join(threads[i], NULL);
+            errors += workers[i].errors;
+        }
+    }
+    double seconds = (nowNs() - start) / 1e9;
+
+    HTTPConnectionPoolStats stats = {0};
+    if (pool) GetHTTPConnectionPoolStats(pool, &stats);
+    qsort(latencies, requests, sizeof(long long), compareLatency);
+    printf("{\n  \"benchmark\": \"loopback\",\n");
+    printf("  \"config\": {\"framing\": \"%s\", \"body_bytes\": %zu, \"chunk_bytes\": %zu, \"trickle_bytes\": %zu, \"trickle_delay_us\": %d, "
+        "\"max_requests_per_connection\": %d, \"close_delay_ms\": %d, \"keep_alive\": %s, \"reuse_response\": %s, \"concurrency\": %d, \"client\": \"%s\"},\n",
+        framingName(options->framing), options->bodySize, options->chunkSize, options->trickleBytes, options->trickleDelayUs,
+        options->maxRequests, options->closeDelayMs, keepAlive ? "true" : "false", reuseResponse ? "true" : "false", concurrency, clientName);
+    printf("  \"requests\": %d,\n  \"errors\": %d,\n  \"seconds\": %.3f,\n  \"requests_per_second\": %.1f,\n", requests, errors, seconds, requests / seconds);
+    printf("  \"pool\": {\"hits\": %lu, \"misses\": %lu, \"retries\": %lu},\n", stats.hits, stats.misses, stats.retries);
+    printf("  \"latency_us\": {\"min\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}\n}\n",
+        latencies[0] / 1e3, percentileUs(latencies, requests, 50), percentileUs(latencies, requests, 90),
+        percentileUs(latencies, requests, 99), percentileUs(latencies, requests, 99.9), latencies[requests - 1] / 1e3);
+
+    DestroyHTTPClient(engine);
+    DestroyHTTPConnectionPool(pool);
+    free(latencies);
+    free(workers);
+    free(threads);
+    return errors ? 2 : 0;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+static void usage(void) {
+    fprintf(stderr,
+        "usage: bench micro [--min-ms N]\n"
+        "       bench loopback [server options] [--requests N] [--concurrency N] [--keep-alive] [--reuse-response]\n"
+        "                      [--client blocking|epoll|uring]\n"
+        "       bench serve [server options]\n"
+        "server options: --port N  --framing length|chunked|close  --body N  --chunk N\n"
+        "                --trickle BYTES  --trickle-delay-us N  --max-requests N  --close-delay-ms N\n");
+    exit(64);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) usage();
+    signal(SIGPIPE, SIG_IGN);
+    ServerOptions server = { .bodySize = 256, .chunkSize = 1024 };
+    int minMs = 200, requests = 20000, concurrency = 4;
+    bool keepAlive = false, reuseResponse = false;
+    LoadClient client = CLIENT_BLOCKING;
+
+    for (int i = 2; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(arg, "--keep-alive") == 0) {
+            keepAlive = true;
+            continue;
+        }
+        if (strcmp(arg, "--reuse-response") == 0) {
+            reuseResponse = true;
+            continue;
+        }
+        if (!value) usage();
+        i++;
+        if (strcmp(arg, "--min-ms") == 0) minMs = atoi(value);
+        else if (strcmp(arg, "--requests") == 0) requests = atoi(value);
+        else if (strcmp(arg, "--concurrency") == 0) concurrency = atoi(value);
+        else if (strcmp(arg, "--port") == 0) server.port = atoi(value);
+        else if (strcmp(arg, "--body") == 0) server.bodySize = strtoul(value, NULL, 10);
+        else if (strcmp(arg, "--chunk") == 0) server.chunkSize = strtoul(value, NULL, 10);
+        else if (strcmp(arg, "--trickle") == 0) server.trickleBytes = strtoul(value, NULL, 10);
+        else if (strcmp(arg, "--trickle-delay-us") == 0) server.trickleDelayUs = atoi(value);
+        else if (strcmp(arg, "--max-requests") == 0) server.maxRequests = atoi(value);
+        else if (strcmp(arg, "--close-delay-ms") == 0) server.closeDelayMs = atoi(value);
+        else if (strcmp(arg, "--client") == 0) {
+            if (strcmp(value, "blocking") == 0) client = CLIENT_BLOCKING;
+            else if (strcmp(value, "epoll") == 0) client = CLIENT_EPOLL;
+            else if (strcmp(value, "uring") == 0) client = CLIENT_URING;
+            else usage();
+        } else if (strcmp(arg, "--framing") == 0) {
+            if (strcmp(value, "length") == 0) server.framing = FRAMING_LENGTH;
+            else if (strcmp(value, "chunked") == 0) server.framing = FRAMING_CHUNKED;
+            else if (strcmp(value, "close") == 0) server.framing = FRAMING_CLOSE;
+            else usage();
+        } else usage();
+    }
+    if (server.chunkSize == 0) server.chunkSize = 1;
+
+    if (strcmp(argv[1], "micro") == 0) return runMicro(minMs);
+    if (strcmp(argv[1], "loopback") == 0) return runLoopback(&server, requests, concurrency, keepAlive, reuseResponse, client);
+    if (strcmp(argv[1], "serve") == 0) {
+        BenchServer running;
+        if (!startServer(&running, &server)) {
+            perror("serve");
+            return 1;
+        }
+        fprintf(stderr, "serving on 127.0.0.1:%d (%s, %zu byte body)\n", server.port, framingName(server.framing), server.bodySize);
+        for (;;) pause();
+    }
+    usage();
+}
@@ -6,6 +6,7 @@
 #include <string.h>
 #include <strings.h>
 #include <ctype.h>
+#include <limits.h>
 #include <time.h>
 #include <errno.h>
 #include <sys/types.h> 
@@ -14,8 +15,100 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <stdint.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+#ifdef HTTP_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HTTP_WITH_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#endif
+#ifdef HTTP_WITH_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 #define HTTP_USER_AGENT "OpenwrtRouter/23.05.5"
+#define HTTP_POOL_HOST_SIZE 256
+#define HTTP_RESOLVER_NAME_SIZE 256
+#ifndef HTTP_METRICS_MAX_HOSTS
+#define HTTP_METRICS_MAX_HOSTS 64 // hosts with their own metrics, requests to others only count in the totals
+#endif
+#define HTTP_HEAD_PARTS 8 // fragments of a request head, see beginRequestHead()
+#ifndef HTTP_RECV_INITIAL_SIZE
+#define HTTP_RECV_INITIAL_SIZE 4096 // default HTTPBufferOptions.initial_size
+#endif
+#ifndef HTTP_RECV_MAX_SIZE
+#define HTTP_RECV_MAX_SIZE (64 * 1024 * 1024) // default HTTPBufferOptions.max_size
+#endif
+#ifndef HTTP_RECV_GROWTH_FACTOR
+#define HTTP_RECV_GROWTH_FACTOR 2 // default HTTPBufferOptions.growth_factor
+#endif
+#define HTTP_IO_TIMEOUT_MS 10000 // default HTTPSocketOptions.io_timeout_ms
+#define HTTP_SEND_WAIT_MS 1000 // wait for a full send buffer to drain, without a request deadline
+#define HTTP_RECV_MIN_READ 1024 // grow the buffer rather than recv() less than this
+#ifndef HTTP_BODY_CHUNK_SIZE
+#define HTTP_BODY_CHUNK_SIZE 16384 // largest chunk of a body from an HTTPBodyProducer
+#endif
+#define HTTP_CHUNK_FRAME 18 // room for the size line of a body chunk: 16 hex digits and CRLF
+#define HTTP_SENDFILE_MAX 0x7ffff000 // most bytes sendfile() moves in one call
+#ifndef HTTP_SPLICE_PIPE_SIZE
+#define HTTP_SPLICE_PIPE_SIZE (1024 * 1024) // pipe between the socket and the file of DownloadHTTPFile()
+#endif
+#define HTTP_FSYNC_BYTES (8 * 1024 * 1024) // default HTTPDownloadOptions.fsync_bytes
+#define HTTP_SEGMENT_SIZE (4LL * 1024 * 1024) // default HTTPSegmentedDownloadOptions.segment_size
+#define HTTP_EDGE_SCAN_LIMIT 4096 // addresses of the edge ranges walked for a free candidate after the random draws
+#define HTTP_TLS_SESSIONS 64 // default HTTPTLSOptions.session_cache_size
+#define HTTP_TLS_RECORD_SIZE 16384 // most plaintext in one TLS record, small fragments are gathered up to it
+#ifndef HTTP_STREAM_WINDOW_SIZE
+#define HTTP_STREAM_WINDOW_SIZE 16384 // receive window of FetchHTTPResponseStream(), holds the headers too
+#endif
+#ifndef HTTP_URING_ENTRIES
+#define HTTP_URING_ENTRIES 256 // submission queue of an io_uring client, the completion queue has four times as many
+#endif
+#ifndef HTTP_URING_BUFFERS
+#define HTTP_URING_BUFFERS 64 // receive buffers an io_uring client provides to the kernel, a power of two
+#endif
+#ifndef HTTP_URING_BUFFER_SIZE
+#define HTTP_URING_BUFFER_SIZE 16384
+#endif
+#ifdef HTTP_STATIC
+// Heap-free profile: the blocking request path only uses these fixed slots, see acquireResponse()
+#ifndef HTTP_STATIC_RESPONSES
+#define HTTP_STATIC_RESPONSES 4 // responses alive at once, FreeHTTPResponseResource() hands a slot back
+#endif
+#ifndef HTTP_STATIC_HEADERS
+#define HTTP_STATIC_HEADERS 32 // most headers of one response
+#endif
+#ifndef HTTP_STATIC_BUFFERS
+#define HTTP_STATIC_BUFFERS 8 // response buffers, streaming windows, oversized request heads and pipelined leftovers
+#endif
+#ifndef HTTP_STATIC_BUFFER_SIZE
+#define HTTP_STATIC_BUFFER_SIZE (HTTP_STREAM_WINDOW_SIZE + 1) // largest response (headers, body and a NUL)
+#endif
+_Static_assert(HTTP_STATIC_RESPONSES >= 2 && HTTP_STATIC_HEADERS > 0, "HTTP_STATIC needs a response slot for the result and one for a download segment");
+_Static_assert(HTTP_STATIC_BUFFERS >= 2, "HTTP_STATIC needs a buffer for the response and one for pipelined leftovers");
+_Static_assert(HTTP_STATIC_BUFFER_SIZE >= HTTP_STREAM_WINDOW_SIZE + 1, "HTTP_STATIC_BUFFER_SIZE must hold a streaming window");
+_Static_assert(HTTP_STATIC_BUFFER_SIZE > HTTP_RECV_MIN_READ && HTTP_STATIC_BUFFER_SIZE <= INT_MAX, "HTTP_STATIC_BUFFER_SIZE is out of range");
+#if defined(HTTP_WITH_ZLIB) || defined(HTTP_WITH_OPENSSL)
+#error "HTTP_STATIC cannot be combined with HTTP_WITH_ZLIB or HTTP_WITH_OPENSSL, both keep their state on the heap"
+#endif
+#endif
 
 const char* HTTPMethodString[HTTP_METHOD_MAX] = {
     [HTTP_GET]     = "GET",
@@ -33,432 +126,5287 @@ const char* HTTPContentTypeString[CONTENT_TYPE_MAX] = {
 };
 
 // Generates a random Cloudflare IP address (from the range 104.16.x.x).
+// xorshift64* with per-thread state, seeded once per thread from the clock and the address of the state.
+// Unlike srand(time(NULL)) per call it differs between calls in the same second and between threads.
+static uint64_t nextRandom(void) {
+    static __thread uint64_t state;
+    if (state == 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        state = ((uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec) ^ ((uint64_t)(uintptr_t)&state << 16) ^ (uint64_t)getpid();
+        if (state == 0) state = 0x9E3779B97F4A7C15ull;
+    }
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545F4914F6CDD1Dull;
+}
+
+char* GenerateRandomCloudflareIPInto(char* buffer, size_t size) {
+    if (buffer == NULL || size < INET_ADDRSTRLEN) return NULL;
+    int random_b = (int)(nextRandom() % 252);
+    int random_c = (int)(nextRandom() % 252);
+    snprintf(buffer, size, "104.16.%d.%d", random_b + 1, random_c + 1);
+    #ifdef DEBUG
+    printf("[GenerateRandomCloudflareIP]: using %s as cloudflare ip\n", buffer);
+    #endif
+    return buffer;
+}
+
+#ifndef HTTP_STATIC
 char* GenerateRandomCloudflareIP(void) {
 	char* buffer = calloc(1, INET_ADDRSTRLEN + 1);
 	if (buffer == NULL) return NULL;
+    return GenerateRandomCloudflareIPInto(buffer, INET_ADDRSTRLEN + 1);
+}
+#endif
+
+// Milliseconds from a monotonic clock, used for idle timeouts and TTLs.
+static long long monotonicMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Nanoseconds from the same clock, for request phase timestamps.
+static long long monotonicNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Instrumentation of HTTPRequestTiming, timing may be NULL. With HTTP_NO_METRICS all of it compiles to nothing.
+#ifndef HTTP_NO_METRICS
+#define HTTP_MARK(timing, phase) do { if (timing) (timing)->phase = monotonicNs(); } while (0)
+#define HTTP_MARK_ONCE(timing, phase) do { if ((timing) && !(timing)->phase) (timing)->phase = monotonicNs(); } while (0)
+#define HTTP_COUNT(timing, field, n) do { if (timing) (timing)->field += (n); } while (0)
+#else
+#define HTTP_MARK(timing, phase) ((void)(timing))
+#define HTTP_MARK_ONCE(timing, phase) ((void)(timing))
+#define HTTP_COUNT(timing, field, n) ((void)(timing))
+#endif
+
+#ifndef HTTP_NO_METRICS
+// Process-wide metrics. Counters are updated with relaxed atomic adds, hostLock serializes adding a host, which is
+// published by incrementing hostCount, and setting the hook. The hook and its context are read as a pair under
+// hookSequence, which is odd while SetHTTPMetricsHook() changes them.
+static struct {
+    HTTPMetrics totals;
+    HTTPHostMetrics hosts[HTTP_METRICS_MAX_HOSTS];
+    int hostCount;
+    pthread_mutex_t hostLock;
+    HTTPMetricsHook hook;
+    void* hookContext;
+    unsigned hookSequence;
+} metrics = { .hostLock = PTHREAD_MUTEX_INITIALIZER };
+
+#define HTTP_METRIC_ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+
+// Histogram bucket of a duration: floor(log2(microseconds)), clamped to the bucket range.
+static int latencyBucket(long long ns) {
+    unsigned long long us = ns > 0 ? (unsigned long long)ns / 1000 : 0;
+    int bucket = us > 1 ? 63 - __builtin_clzll(us) : 0;
+    return bucket < HTTP_METRICS_BUCKETS ? bucket : HTTP_METRICS_BUCKETS - 1;
+}
+
+static HTTPHostMetrics* findHostMetrics(const struct sockaddr_in* addr) {
+    int count = __atomic_load_n(&metrics.hostCount, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; i++) {
+        if (metrics.hosts[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr && metrics.hosts[i].addr.sin_port == addr->sin_port) return &metrics.hosts[i];
+    }
+
+    HTTPHostMetrics* host = NULL;
+    pthread_mutex_lock(&metrics.hostLock);
+    count = metrics.hostCount;
+    for (int i = 0; i < count && !host; i++) {
+        if (metrics.hosts[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr && metrics.hosts[i].addr.sin_port == addr->sin_port) host = &metrics.hosts[i];
+    }
+    if (!host && count < HTTP_METRICS_MAX_HOSTS) {
+        host = &metrics.hosts[count];
+        host->addr = *addr;
+        __atomic_store_n(&metrics.hostCount, count + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&metrics.hostLock);
+    return host;
+}
+
+// Records the duration of a lookup that went to getaddrinfo() or the nameserver.
+static void recordResolveMetrics(long long startNs, bool resolved) {
+    HTTP_METRIC_ADD(metrics.totals.resolves, 1);
+    if (!resolved) HTTP_METRIC_ADD(metrics.totals.resolve_failures, 1);
+    HTTP_METRIC_ADD(metrics.totals.resolve_us[latencyBucket(monotonicNs() - startNs)], 1);
+}
+
+static bool requestDestination(const HTTPRequestInfo* rq, struct sockaddr_in* out);
+
+// Marks msg complete, adds it to the process-wide metrics and calls the export hook.
+static void recordHTTPMetrics(const HTTPRequestInfo* rq, HTTPResponseInfo* msg) {
+    HTTPRequestTiming* timing = &msg->timing;
+    HTTP_MARK(timing, done);
+    long long latency = timing->start ? timing->done - timing->start : 0;
+    int bucket = latencyBucket(latency);
+
+    HTTP_METRIC_ADD(metrics.totals.requests, 1);
+    if (msg->error != 0) HTTP_METRIC_ADD(metrics.totals.failures, 1);
+    if (msg->error == -5) HTTP_METRIC_ADD(metrics.totals.timeouts, 1);
+    if (rq->reused) HTTP_METRIC_ADD(metrics.totals.reused, 1);
+    HTTP_METRIC_ADD(metrics.totals.connects, timing->connects);
+    HTTP_METRIC_ADD(metrics.totals.bytes_sent, timing->bytes_sent);
+    HTTP_METRIC_ADD(metrics.totals.bytes_received, timing->bytes_received);
+    HTTP_METRIC_ADD(metrics.totals.syscalls, timing->syscalls);
+    HTTP_METRIC_ADD(metrics.totals.reallocs, timing->reallocs);
+    HTTP_METRIC_ADD(metrics.totals.latency_us[bucket], 1);
+
+    struct sockaddr_in addr;
+    HTTPHostMetrics* host = requestDestination(rq, &addr) ? findHostMetrics(&addr) : NULL;
+    if (host) {
+        HTTP_METRIC_ADD(host->requests, 1);
+        if (msg->error != 0) HTTP_METRIC_ADD(host->failures, 1);
+        HTTP_METRIC_ADD(host->bytes_sent, timing->bytes_sent);
+        HTTP_METRIC_ADD(host->bytes_received, timing->bytes_received);
+        HTTP_METRIC_ADD(host->latency_us[bucket], 1);
+    }
+
+    HTTPMetricsHook hook;
+    void* hookContext;
+    unsigned sequence;
+    do {
+        sequence = __atomic_load_n(&metrics.hookSequence, __ATOMIC_ACQUIRE);
+        hook = __atomic_load_n(&metrics.hook, __ATOMIC_RELAXED);
+        hookContext = __atomic_load_n(&metrics.hookContext, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((sequence & 1) || __atomic_load_n(&metrics.hookSequence, __ATOMIC_RELAXED) != sequence);
+    if (hook) hook(rq, msg, hookContext);
+}
+
+// Relaxed atomic copy of a block of counters.
+static void copyCounters(unsigned long* out, unsigned long* in, size_t count) {
+    for (size_t i = 0; i < count; i++) out[i] = __atomic_load_n(&in[i], __ATOMIC_RELAXED);
+}
+
+void GetHTTPMetrics(HTTPMetrics* out) {
+    if (!out) return;
+    copyCounters((unsigned long*)out, (unsigned long*)&metrics.totals, sizeof(HTTPMetrics) / sizeof(unsigned long));
+}
+
+int GetHTTPHostMetrics(HTTPHostMetrics* out, int max) {
+    int count = __atomic_load_n(&metrics.hostCount, __ATOMIC_ACQUIRE);
+    for (int i = 0; out && i < count && i < max; i++) {
+        out[i].addr = metrics.hosts[i].addr;
+        copyCounters(&out[i].requests, &metrics.hosts[i].requests, (sizeof(HTTPHostMetrics) - offsetof(HTTPHostMetrics, requests)) / sizeof(unsigned long));
+    }
+    return count;
+}
+
+void SetHTTPMetricsHook(HTTPMetricsHook hook, void* ctx) {
+    pthread_mutex_lock(&metrics.hostLock);
+    __atomic_store_n(&metrics.hookSequence, metrics.hookSequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&metrics.hookContext, ctx, __ATOMIC_RELAXED);
+    __atomic_store_n(&metrics.hook, hook, __ATOMIC_RELAXED);
+    __atomic_store_n(&metrics.hookSequence, metrics.hookSequence + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&metrics.hostLock);
+}
+#else
+#define recordResolveMetrics(startNs, resolved) ((void)0)
+#define recordHTTPMetrics(rq, msg) ((void)0)
+
+void GetHTTPMetrics(HTTPMetrics* out) {
+    if (out) memset(out, 0, sizeof(*out));
+}
+
+int GetHTTPHostMetrics(HTTPHostMetrics* out, int max) {
+    (void)out;
+    (void)max;
+    return 0;
+}
+
+void SetHTTPMetricsHook(HTTPMetricsHook hook, void* ctx) {
+    (void)hook;
+    (void)ctx;
+}
+#endif
+
+// Memory of responses and their buffers: the heap, or with HTTP_STATIC the fixed slots below. Memory that did
+// not come from the slots (cached copies, responses of the event loop client, the header index of a context)
+// goes back to the heap either way.
+#ifdef HTTP_STATIC
+typedef struct {
+    HTTPResponseInfo response; // first, so that the response finds its slot
+    HTTPHeaderSpan spans[HTTP_STATIC_HEADERS];
+} HTTPStaticResponse;
+
+static struct {
+    HTTPStaticResponse responses[HTTP_STATIC_RESPONSES];
+    char buffers[HTTP_STATIC_BUFFERS][HTTP_STATIC_BUFFER_SIZE];
+    bool responseUsed[HTTP_STATIC_RESPONSES];
+    bool bufferUsed[HTTP_STATIC_BUFFERS];
+    pthread_mutex_t lock;
+} staticMemory = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Index of the slot of count slots of size bytes from base that p points into, -1 if none.
+static int staticSlot(const void* p, const void* base, size_t size, int count) {
+    uintptr_t offset = (uintptr_t)p - (uintptr_t)base;
+    return (uintptr_t)p >= (uintptr_t)base && offset < size * count ? (int)(offset / size) : -1;
+}
+
+// Takes a free slot, -1 when all of them are in use.
+static int takeStaticSlot(bool* used, int count) {
+    int slot = -1;
+    pthread_mutex_lock(&staticMemory.lock);
+    for (int i = 0; i < count && slot < 0; i++) {
+        if (!used[i]) slot = i;
+    }
+    if (slot >= 0) used[slot] = true;
+    pthread_mutex_unlock(&staticMemory.lock);
+    return slot;
+}
+
+static void releaseStaticSlot(bool* used, int slot) {
+    pthread_mutex_lock(&staticMemory.lock);
+    used[slot] = false;
+    pthread_mutex_unlock(&staticMemory.lock);
+}
+#endif
+
+// A zeroed response. With HTTP_STATIC its header index is the fixed array of the slot.
+static HTTPResponseInfo* acquireResponse(void) {
+    #ifdef HTTP_STATIC
+    int slot = takeStaticSlot(staticMemory.responseUsed, HTTP_STATIC_RESPONSES);
+    if (slot < 0) return NULL;
+    HTTPStaticResponse* entry = &staticMemory.responses[slot];
+    memset(&entry->response, 0, sizeof(entry->response));
+    entry->response.headers.spans = entry->spans;
+    entry->response.headers.capacity = HTTP_STATIC_HEADERS;
+    return &entry->response;
+    #else
+    return calloc(1, sizeof(HTTPResponseInfo));
+    #endif
+}
+
+// A buffer of at least size bytes, NULL when none is left (or, with HTTP_STATIC, size is above HTTP_STATIC_BUFFER_SIZE).
+static void* acquireBuffer(size_t size) {
+    #ifdef HTTP_STATIC
+    if (size > HTTP_STATIC_BUFFER_SIZE) return NULL;
+    int slot = takeStaticSlot(staticMemory.bufferUsed, HTTP_STATIC_BUFFERS);
+    return slot < 0 ? NULL : staticMemory.buffers[slot];
+    #else
+    return malloc(size);
+    #endif
+}
+
+// realloc() of a buffer, a slot already holds HTTP_STATIC_BUFFER_SIZE bytes and never moves.
+static void* resizeBuffer(void* buffer, size_t size) {
+    #ifdef HTTP_STATIC
+    if (!buffer) return acquireBuffer(size);
+    if (staticSlot(buffer, staticMemory.buffers, HTTP_STATIC_BUFFER_SIZE, HTTP_STATIC_BUFFERS) >= 0) return size <= HTTP_STATIC_BUFFER_SIZE ? buffer : NULL;
+    #endif
+    return realloc(buffer, size);
+}
+
+static void releaseBuffer(void* buffer) {
+    #ifdef HTTP_STATIC
+    if (staticSlot(buffer, staticMemory.responses, sizeof(HTTPStaticResponse), HTTP_STATIC_RESPONSES) >= 0) return; // header index of a slot
+    int slot = staticSlot(buffer, staticMemory.buffers, HTTP_STATIC_BUFFER_SIZE, HTTP_STATIC_BUFFERS);
+    if (slot >= 0) {
+        releaseStaticSlot(staticMemory.bufferUsed, slot);
+        return;
+    }
+    #endif
+    free(buffer);
+}
+
+static void releaseResponse(HTTPResponseInfo* msg) {
+    #ifdef HTTP_STATIC
+    int slot = staticSlot(msg, staticMemory.responses, sizeof(HTTPStaticResponse), HTTP_STATIC_RESPONSES);
+    if (slot >= 0) {
+        releaseStaticSlot(staticMemory.responseUsed, slot);
+        return;
+    }
+    #endif
+    free(msg);
+}
+
+// A cached lookup. Negative entries remember names that do not resolve.
+typedef struct {
+    char name[HTTP_RESOLVER_NAME_SIZE];
+    unsigned int hash;
+    bool negative;
+    struct in_addr addr;
+    long long expires;  // monotonicMs() after which the entry is not used
+    long long lastUsed; // monotonicMs() of the last hit, for LRU eviction
+} HTTPResolverEntry;
+
+// Process-wide resolver cache, every field is guarded by lock.
+static struct {
+    pthread_mutex_t lock;
+    bool configured;
+    HTTPResolverOptions options; // nameserver is not kept, see useNameserver
+    bool useNameserver;
+    struct in_addr nameserver;
+    HTTPResolverStats stats;
+    HTTPResolverEntry* entries;  // max_entries slots, allocated on first store
+    int count;
+} resolver = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+struct HTTPResolveQuery {
+    char name[HTTP_RESOLVER_NAME_SIZE];
+    int port;
+    int fd;              // UDP socket or eventfd of the worker thread, -1 once the answer is known
+    bool udp;
+    unsigned short id;   // DNS message id of the UDP query
+    long long deadline;  // monotonicMs() when the UDP query gives up
+    long long started;   // monotonicNs() when the UDP query was sent
+    int status;          // 0 = resolved, -1 = failed, valid once done is set
+    bool done;
+    int refs;            // held by the caller and by the worker thread
+    struct in_addr addr;
+    bool borrowed;       // memory of the caller (ResolveHTTPHost()), not freed
+};
+
+static void applyResolverDefaults(HTTPResolverOptions* options) {
+    if (options->nameserver_port <= 0) options->nameserver_port = 53;
+    if (options->max_entries <= 0) options->max_entries = 256;
+    if (options->default_ttl_s <= 0) options->default_ttl_s = 60;
+    if (options->negative_ttl_s <= 0) options->negative_ttl_s = 10;
+    if (options->timeout_ms <= 0) options->timeout_ms = 2000;
+}
+
+// Must be called with resolver.lock held.
+static void ensureResolverConfigured(void) {
+    if (resolver.configured) return;
+    applyResolverDefaults(&resolver.options);
+    resolver.configured = true;
+}
+
+int ConfigureHTTPResolver(const HTTPResolverOptions* options) {
+    HTTPResolverOptions config = {0};
+    if (options) config = *options;
+    struct in_addr nameserver = {0};
+    if (config.nameserver && inet_pton(AF_INET, config.nameserver, &nameserver) <= 0) return -1;
+    applyResolverDefaults(&config);
+
+    pthread_mutex_lock(&resolver.lock);
+    free(resolver.entries);
+    resolver.entries = NULL;
+    resolver.count = 0;
+    resolver.useNameserver = config.nameserver != NULL;
+    resolver.nameserver = nameserver;
+    config.nameserver = NULL;
+    resolver.options = config;
+    resolver.configured = true;
+    memset(&resolver.stats, 0, sizeof(resolver.stats));
+    pthread_mutex_unlock(&resolver.lock);
+    return 0;
+}
+
+void GetHTTPResolverStats(HTTPResolverStats* stats) {
+    if (!stats) return;
+    pthread_mutex_lock(&resolver.lock);
+    *stats = resolver.stats;
+    pthread_mutex_unlock(&resolver.lock);
+}
+
+// FNV-1a over the lower-cased name, DNS names are case-insensitive.
+static unsigned int hashHostname(const char* name) {
+    unsigned int hash = 2166136261u;
+    for (; *name; name++) {
+        hash ^= (unsigned char)tolower((unsigned char)*name);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Looks the name up in the cache. Returns 1 on a hit (addr is set), -1 on a negative hit, 0 on a miss.
+static int lookupResolverCache(const char* name, struct in_addr* addr) {
+    unsigned int hash = hashHostname(name);
+    long long now = monotonicMs();
+    int result = 0;
+
+    pthread_mutex_lock(&resolver.lock);
+    ensureResolverConfigured();
+    for (int i = 0; i < resolver.count; i++) {
+        HTTPResolverEntry* entry = &resolver.entries[i];
+        if (entry->hash != hash || strcasecmp(entry->name, name) != 0) continue;
+        if (now >= entry->expires) {
+            resolver.entries[i] = resolver.entries[--resolver.count];
+            resolver.stats.expired++;
+            break;
+        }
+        entry->lastUsed = now;
+        if (entry->negative) {
+            resolver.stats.negative_hits++;
+            result = -1;
+        } else {
+            resolver.stats.hits++;
+            *addr = entry->addr;
+            result = 1;
+        }
+        break;
+    }
+    if (result == 0) resolver.stats.misses++;
+    pthread_mutex_unlock(&resolver.lock);
+    return result;
+}
+
+// Stores a lookup result for ttl seconds (0 = the configured default), addr NULL caches a failure
+// for negative_ttl_s. When the cache is full an expired entry is replaced, otherwise the least recently used.
+static void storeResolverCache(const char* name, const struct in_addr* addr, unsigned int ttl) {
+    if (strlen(name) >= HTTP_RESOLVER_NAME_SIZE) return;
+    unsigned int hash = hashHostname(name);
+    long long now = monotonicMs();
+
+    pthread_mutex_lock(&resolver.lock);
+    ensureResolverConfigured();
+    if (!addr) ttl = resolver.options.negative_ttl_s;
+    else if (ttl == 0) ttl = resolver.options.default_ttl_s;
+    if (!resolver.entries) resolver.entries = calloc(resolver.options.max_entries, sizeof(HTTPResolverEntry));
+    if (!resolver.entries) {
+        pthread_mutex_unlock(&resolver.lock);
+        return;
+    }
+
+    HTTPResolverEntry* slot = NULL;
+    for (int i = 0; i < resolver.count && !slot; i++) {
+        if (resolver.entries[i].hash == hash && strcasecmp(resolver.entries[i].name, name) == 0) slot = &resolver.entries[i];
+    }
+    if (!slot && resolver.count < resolver.options.max_entries) slot = &resolver.entries[resolver.count++];
+    if (!slot) {
+        for (int i = 0; i < resolver.count; i++) {
+            HTTPResolverEntry* entry = &resolver.entries[i];
+            if (now >= entry->expires) {
+                slot = entry;
+                break;
+            }
+            if (!slot || entry->lastUsed < slot->lastUsed) slot = entry;
+        }
+        resolver.stats.evicted++;
+    }
+
+    strcpy(slot->name, name);
+    slot->hash = hash;
+    slot->negative = addr == NULL;
+    if (addr) slot->addr = *addr;
+    slot->expires = now + (long long)ttl * 1000;
+    slot->lastUsed = now;
+    pthread_mutex_unlock(&resolver.lock);
+}
+
+// Blocking lookup through getaddrinfo(), which does not report a TTL. Returns 0 or -1.
+static int resolveWithGetaddrinfo(const char* name, struct in_addr* addr) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    #ifndef HTTP_NO_METRICS
+    long long start = monotonicNs();
+    #endif
+    int status = getaddrinfo(name, NULL, &hints, &res);
+    recordResolveMetrics(start, status == 0);
+    if (status != 0) {
+        #ifdef DEBUG
+        printf("[resolveWithGetaddrinfo]: %s: %s\n", name, gai_strerror(status));
+        #endif
+        // only a definite answer is remembered, not a temporary failure
+        if (status == EAI_NONAME) storeResolverCache(name, NULL, 0);
+        return -1;
+    }
+    *addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+    freeaddrinfo(res);
+    storeResolverCache(name, addr, 0);
+    return 0;
+}
+
+// Builds a recursive A query for name. Returns the message length, or -1 if the name is not a valid DNS name.
+static int buildDNSQuery(const char* name, unsigned short id, unsigned char* buffer, size_t size) {
+    size_t length = strlen(name);
+    if (length > 0 && name[length - 1] == '.') length--;
+    if (length == 0 || length > 253 || size < 12 + length + 2 + 4) return -1;
+
+    unsigned char header[12] = { id >> 8, id & 0xff, 0x01, 0x00, 0, 1, 0, 0, 0, 0, 0, 0 }; // RD, one question
+    memcpy(buffer, header, sizeof(header));
+    size_t offset = sizeof(header);
+    const char* label = name;
+    const char* end = name + length;
+    while (label < end) {
+        const char* dot = memchr(label, '.', end - label);
+        size_t labelLength = (dot ? dot : end) - label;
+        if (labelLength == 0 || labelLength > 63) return -1;
+        buffer[offset++] = (unsigned char)labelLength;
+        memcpy(buffer + offset, label, labelLength);
+        offset += labelLength;
+        label += labelLength + 1;
+    }
+    buffer[offset++] = 0;
+    memcpy(buffer + offset, "\x00\x01\x00\x01", 4); // QTYPE A, QCLASS IN
+    return (int)(offset + 4);
+}
+
+// Skips a possibly compressed name starting at offset. Returns the offset after it, or -1 if it runs past length.
+static int skipDNSName(const unsigned char* msg, int length, int offset) {
+    while (offset < length) {
+        unsigned char c = msg[offset];
+        if (c == 0) return offset + 1;
+        if ((c & 0xc0) == 0xc0) return offset + 2 <= length ? offset + 2 : -1;
+        if (c & 0xc0) return -1;
+        offset += c + 1;
+    }
+    return -1;
+}
+
+// Parses the reply to query id. Returns 1 with the first A record and the smallest TTL along the answer chain,
+// 0 if the name does not exist or has no A record, -1 if the server failed, or -2 if the message is not
+// a reply to this query.
+static int parseDNSResponse(const unsigned char* msg, int length, unsigned short id, struct in_addr* addr, unsigned int* ttl) {
+    if (length < 12 || ((msg[0] << 8) | msg[1]) != id || !(msg[2] & 0x80)) return -2;
+    int rcode = msg[3] & 0x0f;
+    if (rcode == 3) return 0; // NXDOMAIN
+    if (rcode != 0 || (msg[2] & 0x02)) return -1; // server failure or truncated
+
+    int questions = (msg[4] << 8) | msg[5];
+    int answers = (msg[6] << 8) | msg[7];
+    int offset = 12;
+    for (int i = 0; i < questions; i++) {
+        offset = skipDNSName(msg, length, offset);
+        if (offset < 0 || offset + 4 > length) return -2;
+        offset += 4;
+    }
+
+    unsigned int minTTL = UINT_MAX;
+    for (int i = 0; i < answers; i++) {
+        offset = skipDNSName(msg, length, offset);
+        if (offset < 0 || offset + 10 > length) return -2;
+        const unsigned char* rr = msg + offset;
+        int type = (rr[0] << 8) | rr[1];
+        int class = (rr[2] << 8) | rr[3];
+        unsigned int recordTTL = ((unsigned int)rr[4] << 24) | (rr[5] << 16) | (rr[6] << 8) | rr[7];
+        int dataLength = (rr[8] << 8) | rr[9];
+        offset += 10;
+        if (offset + dataLength > length) return -2;
+        if (class != 1) {
+            offset += dataLength;
+            continue;
+        }
+        if (recordTTL < minTTL) minTTL = recordTTL;
+        if (type == 1 && dataLength == 4) {
+            memcpy(&addr->s_addr, msg + offset, 4);
+            *ttl = minTTL;
+            return 1;
+        }
+        offset += dataLength; // CNAME and others, the A record of the target follows
+    }
+    return 0;
+}
+
+// Sends the A query of a new UDP lookup to the configured nameserver.
+static bool sendDNSQuery(HTTPResolveQuery* query, struct in_addr nameserver, int port) {
+    unsigned char packet[512];
+    // The id is all an off-path sender has to guess besides the source port, so it comes from the kernel's
+    // generator, nextRandom() is seeded from the clock and only used if getrandom() fails
+    if (getrandom(&query->id, sizeof(query->id), GRND_NONBLOCK) != sizeof(query->id)) query->id = (unsigned short)nextRandom();
+    int length = buildDNSQuery(query->name, query->id, packet, sizeof(packet));
+    if (length < 0) return false;
+
+    query->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (query->fd < 0) return false;
+    struct sockaddr_in server_addr = {0};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr = nameserver;
+    // connect() makes the kernel drop datagrams from other sources
+    if (connect(query->fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0 || send(query->fd, packet, length, 0) != length) {
+        close(query->fd);
+        query->fd = -1;
+        return false;
+    }
+    return true;
+}
+
+// Reads replies from the UDP socket. Returns true once the query is answered.
+static bool receiveDNSResponse(HTTPResolveQuery* query) {
+    unsigned char packet[1500];
+    for (;;) {
+        ssize_t n = recv(query->fd, packet, sizeof(packet), 0);
+        if (n < 0) return false; // EAGAIN, or an ICMP error which the deadline takes care of
+        unsigned int ttl = 0;
+        int result = parseDNSResponse(packet, (int)n, query->id, &query->addr, &ttl);
+        if (result == -2) continue;
+        recordResolveMetrics(query->started, result == 1);
+        if (result == 1) storeResolverCache(query->name, &query->addr, ttl ? ttl : 1);
+        else if (result == 0) storeResolverCache(query->name, NULL, 0);
+        query->status = result == 1 ? 0 : -1;
+        query->done = true;
+        return true;
+    }
+}
+
+static void releaseResolveQuery(HTTPResolveQuery* query) {
+    if (__atomic_sub_fetch(&query->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    if (query->fd >= 0) close(query->fd);
+    if (!query->borrowed) free(query);
+}
+
+static void* resolveWorker(void* arg) {
+    HTTPResolveQuery* query = arg;
+    query->status = resolveWithGetaddrinfo(query->name, &query->addr);
+    __atomic_store_n(&query->done, true, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if (write(query->fd, &one, sizeof(one)) < 0) {} // poll() sees done anyway once the caller wakes up
+    releaseResolveQuery(query);
+    return NULL;
+}
+
+// Answers from an IPv4 literal or the cache. Returns 1 (addr is set), -1 if the name is known not to
+// resolve, or 0 if it has to be looked up.
+static int resolveCachedHost(const char* hostname, struct in_addr* addr) {
+    if (inet_pton(AF_INET, hostname, addr) > 0) return 1;
+    if (strlen(hostname) >= HTTP_RESOLVER_NAME_SIZE) return -1;
+    return lookupResolverCache(hostname, addr);
+}
+
+// Starts a lookup. A getaddrinfo() lookup runs on a worker thread if allowThread, else right here.
+// storage (may be NULL) is used instead of the heap by lookups that finish before the caller returns.
+static HTTPResolveQuery* startResolve(const char* hostname, int port, bool allowThread, HTTPResolveQuery* storage) {
+    if (!hostname) return NULL;
+    HTTPResolveQuery* query = storage ? memset(storage, 0, sizeof(*storage)) : calloc(1, sizeof(HTTPResolveQuery));
+    if (!query) return NULL;
+    query->borrowed = storage != NULL;
+    query->port = port;
+    query->fd = -1;
+    query->refs = 1;
+    query->done = true;
+
+    int cached = resolveCachedHost(hostname, &query->addr);
+    if (cached != 0) {
+        query->status = cached > 0 ? 0 : -1;
+        return query;
+    }
+    strcpy(query->name, hostname);
+
+    pthread_mutex_lock(&resolver.lock);
+    bool udp = resolver.useNameserver;
+    struct in_addr nameserver = resolver.nameserver;
+    int nameserverPort = resolver.options.nameserver_port;
+    int timeout = resolver.options.timeout_ms;
+    pthread_mutex_unlock(&resolver.lock);
+
+    if (udp) {
+        query->udp = true;
+        query->deadline = monotonicMs() + timeout;
+        query->started = monotonicNs();
+        query->done = !sendDNSQuery(query, nameserver, nameserverPort);
+        query->status = query->done ? -1 : 0;
+        return query;
+    }
+
+    // getaddrinfo() only blocks, so it runs on a detached thread that signals an eventfd
+    if (allowThread) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        query->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (query->fd >= 0 && pthread_attr_init(&attr) == 0) {
+            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+            query->done = false;
+            query->refs = 2;
+            bool started = pthread_create(&thread, &attr, resolveWorker, query) == 0;
+            pthread_attr_destroy(&attr);
+            if (started) return query;
+            query->done = true;
+            query->refs = 1;
+        }
+        if (query->fd >= 0) close(query->fd);
+        query->fd = -1;
+    }
+    query->status = resolveWithGetaddrinfo(hostname, &query->addr);
+    return query;
+}
+
+HTTPResolveQuery* StartHTTPResolve(const char* hostname, int port) {
+    return startResolve(hostname, port, true, NULL);
+}
+
+int GetHTTPResolveFD(const HTTPResolveQuery* query) {
+    return query ? query->fd : -1;
+}
+
+int FinishHTTPResolve(HTTPResolveQuery* query, struct sockaddr_in* addr, int timeout_ms) {
+    if (!query) return -1;
+    long long end = timeout_ms >= 0 ? monotonicMs() + timeout_ms : -1;
+    for (;;) {
+        if (query->udp ? query->done || receiveDNSResponse(query) : __atomic_load_n(&query->done, __ATOMIC_ACQUIRE)) break;
+
+        long long now = monotonicMs();
+        if (query->udp && now >= query->deadline) {
+            #ifdef DEBUG
+            printf("[FinishHTTPResolve]: %s timed out\n", query->name);
+            #endif
+            recordResolveMetrics(query->started, false);
+            query->status = -1;
+            break;
+        }
+        if (end >= 0 && now >= end) return 1;
+        long long wait = end >= 0 ? end - now : -1;
+        if (query->udp && (wait < 0 || query->deadline - now < wait)) wait = query->deadline - now;
+        struct pollfd pfd = { .fd = query->fd, .events = POLLIN };
+        if (poll(&pfd, 1, (int)wait) < 0 && errno != EINTR) {
+            query->status = -1;
+            break;
+        }
+    }
+
+    int status = query->status;
+    if (status == 0 && addr) {
+        memset(addr, 0, sizeof(*addr));
+        addr->sin_family = AF_INET;
+        addr->sin_port = htons(query->port);
+        addr->sin_addr = query->addr;
+    }
+    releaseResolveQuery(query);
+    return status;
+}
+
+void CancelHTTPResolve(HTTPResolveQuery* query) {
+    if (query) releaseResolveQuery(query);
+}
+
+int ResolveHTTPHost(const char* hostname, int port, struct sockaddr_in* addr) {
+    if (!addr) return -1;
+    HTTPResolveQuery query;
+    return FinishHTTPResolve(startResolve(hostname, port, false, &query), addr, -1);
+}
 
-    srand((unsigned) time(NULL));
-    int random_b = rand() % 252;
-    int random_c = rand() % 252;
-    snprintf(buffer, INET_ADDRSTRLEN + 1, "104.16.%d.%d", random_b + 1, random_c + 1);
+// Resolves a given hostname to an IPv4 address through the resolver cache.
+char* GetIPv4AddressInto(const char* hostname, char* buffer, size_t size) {
+    struct sockaddr_in addr;
+    if (buffer == NULL || size < INET_ADDRSTRLEN || ResolveHTTPHost(hostname, 80, &addr) != 0) return NULL;
+    inet_ntop(AF_INET, &addr.sin_addr, buffer, size);
     #ifdef DEBUG
-    printf("[GenerateRandomCloudflareIP]: using %s as cloudflare ip\n", buffer);
+    printf("[GetIPv4Address]: resolved %s\n", buffer);
     #endif
     return buffer;
 }
 
-// Resolves a given hostname to an IPv4 address using getaddrinfo.
+#ifndef HTTP_STATIC
 char* GetIPv4Address(const char* hostname) {
     char* buffer = calloc(1, INET_ADDRSTRLEN);
     if (buffer == NULL) return NULL;
+    if (GetIPv4AddressInto(hostname, buffer, INET_ADDRSTRLEN)) return buffer;
+    free(buffer);
+    return NULL;
+}
+#endif
+
+struct HTTPPreparedRequest {
+    HTTPMethod method;
+    char* host;         // Host header, keys pooled connections
+    char* block;        // " HTTP/1.1\r\n" and the headers that do not change between sends
+    size_t blockLength;
+};
+
+// The Host header a request is sent with.
+static const char* requestHost(const HTTPRequestInfo* rq) {
+    return rq->prepared ? rq->prepared->host : rq->host;
+}
+
+// Whether receiving the request twice has the effect of receiving it once (RFC 9110 9.2.2), all methods but POST.
+static bool requestIdempotent(const HTTPRequestInfo* rq) {
+    return (rq->prepared ? rq->prepared->method : rq->method) != HTTP_POST;
+}
+
+// Fills the destination of a request from rq->addr, or else by parsing rq->ipaddr, with rq->port.
+static bool requestDestination(const HTTPRequestInfo* rq, struct sockaddr_in* out) {
+    if (!rq->port || (!rq->addr && !rq->ipaddr)) return false;
+    memset(out, 0, sizeof(*out));
+    if (rq->addr) out->sin_addr = rq->addr->sin_addr;
+    else if (inet_pton(AF_INET, rq->ipaddr, &out->sin_addr) <= 0) return false;
+    out->sin_family = AF_INET;
+    out->sin_port = htons(rq->port);
+    return true;
+}
+
+// Waits until sd is ready for events or deadline (monotonicMs()) has passed.
+// Returns 1 when ready, 0 on timeout, -1 on error.
+static int waitSocket(int sd, short events, long long deadline, HTTPRequestTiming* timing) {
+    for (;;) {
+        long long left = deadline - monotonicMs();
+        if (left <= 0) return 0;
+        struct pollfd pfd = { .fd = sd, .events = events };
+        int ret = poll(&pfd, 1, left > INT_MAX ? INT_MAX : (int)left);
+        HTTP_COUNT(timing, syscalls, 1);
+        if (ret < 0 && errno == EINTR) continue;
+        return ret < 0 ? -1 : ret > 0;
+    }
+}
+
+// Whether the deadline set by SendHTTPRequest() has passed.
+static bool requestExpired(const HTTPRequestInfo* rq) {
+    return rq->deadline && monotonicMs() >= rq->deadline;
+}
+
+// Applies the tuning of options to a new socket before it connects. With timeouts it also gets the per-call
+// send and receive timeouts of blocking use. Returns false if binding to the source address or interface fails.
+static bool configureSocket(int sd, const HTTPSocketOptions* options, bool timeouts) {
+    int one = 1;
+    if (timeouts) {
+        int ms = options->io_timeout_ms > 0 ? options->io_timeout_ms : HTTP_IO_TIMEOUT_MS;
+        struct timeval timeout = { .tv_sec = ms / 1000, .tv_usec = (ms % 1000) * 1000 };
+        setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+    if (options->no_delay) setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (options->quick_ack) setsockopt(sd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+    if (options->recv_buffer_size > 0) setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &options->recv_buffer_size, sizeof(int));
+    if (options->send_buffer_size > 0) setsockopt(sd, SOL_SOCKET, SO_SNDBUF, &options->send_buffer_size, sizeof(int));
+    #ifdef TCP_FASTOPEN_CONNECT
+    // connect() returns at once and the SYN leaves with the first send
+    if (options->fast_open) setsockopt(sd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one));
+    #endif
+
+    if (options->bind_interface && options->bind_interface[0] &&
+        setsockopt(sd, SOL_SOCKET, SO_BINDTODEVICE, options->bind_interface, strlen(options->bind_interface)) < 0) {
+        #ifdef DEBUG
+        printf("[configureSocket]: cannot bind to %s: %s\n", options->bind_interface, strerror(errno));
+        #endif
+        return false;
+    }
+    if (options->bind_address) {
+        struct sockaddr_in local = { .sin_family = AF_INET };
+        if (inet_pton(AF_INET, options->bind_address, &local.sin_addr) != 1 || bind(sd, (struct sockaddr*)&local, sizeof(local)) < 0) {
+            #ifdef DEBUG
+            printf("[configureSocket]: cannot bind to %s: %s\n", options->bind_address, strerror(errno));
+            #endif
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifdef HTTP_WITH_OPENSSL
+// The latest resumable session of a host, keyed by "host:port".
+typedef struct {
+    char key[HTTP_POOL_HOST_SIZE + 8];
+    SSL_SESSION* session;
+    unsigned long long used; // tick of the last store or use, the least recently used entry is replaced
+} HTTPTLSSession;
+
+// TLS state of a connected socket, kept next to the descriptor in HTTPRequestInfo.tls_connection and in the idle
+// pool entry. The socket stays non-blocking, every SSL call that cannot go on waits in poll().
+struct HTTPTLSConnection {
+    SSL* ssl;
+    char key[HTTP_POOL_HOST_SIZE + 8]; // where sessions the server hands out are cached
+    int timeoutMs;                     // wait of one call without a request deadline, io_timeout_ms of the opening request
+};
+
+// Process-wide TLS context and session cache.
+static struct {
+    pthread_mutex_t lock;
+    SSL_CTX* context;
+    HTTPTLSSession* sessions;
+    int capacity;
+    int count;
+    unsigned long long tick;
+    HTTPTLSStats stats;
+} tls = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static HTTPTLSSession* findTLSSession(const char* key) {
+    for (int i = 0; i < tls.count; i++) {
+        if (strcmp(tls.sessions[i].key, key) == 0) return &tls.sessions[i];
+    }
+    return NULL;
+}
+
+// New session callback: keeps the session handed out on a connection (a TLS 1.3 ticket arrives after the
+// handshake) as the one to resume for its host. Returns 1 when the cache took the reference.
+static int storeTLSSession(SSL* ssl, SSL_SESSION* session) {
+    HTTPTLSConnection* conn = SSL_get_app_data(ssl);
+    if (!conn || !SSL_SESSION_is_resumable(session)) return 0;
+    pthread_mutex_lock(&tls.lock);
+    HTTPTLSSession* entry = findTLSSession(conn->key);
+    if (!entry && tls.count < tls.capacity) {
+        entry = &tls.sessions[tls.count++];
+    } else if (!entry) {
+        entry = &tls.sessions[0];
+        for (int i = 1; i < tls.count; i++) {
+            if (tls.sessions[i].used < entry->used) entry = &tls.sessions[i];
+        }
+    }
+    if (entry->session) SSL_SESSION_free(entry->session);
+    strcpy(entry->key, conn->key);
+    entry->session = session;
+    entry->used = ++tls.tick;
+    tls.stats.sessions = tls.count;
+    pthread_mutex_unlock(&tls.lock);
+    return 1;
+}
+
+// Creates the context, called with tls.lock held.
+static bool createTLSContext(const HTTPTLSOptions* options) {
+    HTTPTLSOptions defaults = {0};
+    if (!options) options = &defaults;
+    SSL_CTX* context = SSL_CTX_new(TLS_client_method());
+    if (!context) return false;
+    SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+    SSL_CTX_set_options(context, SSL_OP_IGNORE_UNEXPECTED_EOF); // a server closing without close_notify ends the body
+    SSL_CTX_set_verify(context, options->insecure ? SSL_VERIFY_NONE : SSL_VERIFY_PEER, NULL);
+    bool trusted = options->insecure || (options->ca_file || options->ca_path ? SSL_CTX_load_verify_locations(context, options->ca_file, options->ca_path) : SSL_CTX_set_default_verify_paths(context));
+    int capacity = options->session_cache_size < 0 ? 0 : options->session_cache_size ? options->session_cache_size : HTTP_TLS_SESSIONS;
+    HTTPTLSSession* sessions = capacity > 0 ? calloc(capacity, sizeof(HTTPTLSSession)) : NULL;
+    if (!trusted || (capacity > 0 && !sessions)) {
+        #ifdef DEBUG
+        printf("[createTLSContext]: %s\n", trusted ? "out of memory" : ERR_error_string(ERR_get_error(), NULL));
+        #endif
+        SSL_CTX_free(context);
+        free(sessions);
+        return false;
+    }
+    if (capacity > 0) {
+        // sessions are kept by host here instead of by ID in the context
+        SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(context, storeTLSSession);
+    }
+    tls.context = context;
+    tls.sessions = sessions;
+    tls.capacity = capacity;
+    return true;
+}
+
+int InitHTTPTLS(const HTTPTLSOptions* options) {
+    pthread_mutex_lock(&tls.lock);
+    bool created = !tls.context && createTLSContext(options);
+    pthread_mutex_unlock(&tls.lock);
+    return created ? 0 : -1;
+}
+
+void GetHTTPTLSStats(HTTPTLSStats* stats) {
+    if (!stats) return;
+    pthread_mutex_lock(&tls.lock);
+    *stats = tls.stats;
+    pthread_mutex_unlock(&tls.lock);
+}
+
+// Waits until the socket of conn is ready for the SSL call that failed with reason, until deadline, or
+// conn->timeoutMs from now without one. Returns true to repeat the call, false with errno if it failed for good.
+static bool waitTLS(HTTPTLSConnection* conn, int reason, long long deadline, HTTPRequestTiming* timing) {
+    if (reason != SSL_ERROR_WANT_READ && reason != SSL_ERROR_WANT_WRITE) {
+        if (reason != SSL_ERROR_SYSCALL || errno == 0) errno = EPROTO;
+        ERR_clear_error();
+        return false;
+    }
+    int ready = waitSocket(SSL_get_fd(conn->ssl), reason == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT,
+                           deadline ? deadline : monotonicMs() + conn->timeoutMs, timing);
+    if (ready == 0) errno = ETIMEDOUT;
+    return ready > 0;
+}
+
+// Runs the TLS handshake on the connected, non-blocking socket sd of rq, offering the cached session of host:port.
+// The host is sent as SNI and verified against the certificate (as an address when it is one). Returns the TLS
+// state of the connection, or NULL, with errno ETIMEDOUT on timeout, if it failed.
+static HTTPTLSConnection* startTLS(int sd, HTTPRequestInfo* rq, long long deadline) {
+    pthread_mutex_lock(&tls.lock);
+    if (!tls.context) createTLSContext(NULL);
+    SSL_CTX* context = tls.context;
+    pthread_mutex_unlock(&tls.lock);
+    if (!context) return NULL;
+    HTTPTLSConnection* conn = calloc(1, sizeof(HTTPTLSConnection));
+    SSL* ssl = conn ? SSL_new(context) : NULL;
+    if (!ssl) {
+        free(conn);
+        return NULL;
+    }
+    const char* host = requestHost(rq);
+    struct in_addr literal;
+    conn->ssl = ssl;
+    conn->timeoutMs = rq->socket_options.io_timeout_ms > 0 ? rq->socket_options.io_timeout_ms : HTTP_IO_TIMEOUT_MS;
+    snprintf(conn->key, sizeof(conn->key), "%s:%d", host, rq->port);
+    SSL_set_fd(ssl, sd);
+    SSL_set_app_data(ssl, conn);
+    if (inet_pton(AF_INET, host, &literal) == 1) {
+        X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host);
+    } else {
+        SSL_set_tlsext_host_name(ssl, host);
+        SSL_set1_host(ssl, host);
+    }
+    pthread_mutex_lock(&tls.lock);
+    HTTPTLSSession* cached = findTLSSession(conn->key);
+    if (cached) {
+        SSL_set_session(ssl, cached->session);
+        cached->used = ++tls.tick;
+    }
+    pthread_mutex_unlock(&tls.lock);
+
+    int result, error = 0;
+    while ((result = SSL_connect(ssl)) != 1) {
+        HTTP_COUNT(&rq->timing, syscalls, 1);
+        if (waitTLS(conn, SSL_get_error(ssl, result), deadline, &rq->timing)) continue;
+        error = errno == EPROTO ? ECONNRESET : errno;
+        break;
+    }
+    HTTP_COUNT(&rq->timing, syscalls, 1);
+    bool resumed = result == 1 && SSL_session_reused(ssl);
+    #ifdef DEBUG
+    printf("[startTLS]: %s %s, %s\n", conn->key, result == 1 ? SSL_get_version(ssl) : ERR_error_string(ERR_peek_error(), NULL), resumed ? "resumed" : "full handshake");
+    #endif
+    pthread_mutex_lock(&tls.lock);
+    if (result == 1) tls.stats.handshakes++;
+    else tls.stats.failures++;
+    if (resumed) tls.stats.resumed++;
+    pthread_mutex_unlock(&tls.lock);
+    if (result == 1) return conn;
+
+    SSL_free(ssl);
+    free(conn);
+    ERR_clear_error();
+    errno = error;
+    return NULL;
+}
+
+// SSL_write() of all of data, waiting for the socket whenever it is full.
+static bool writeTLSData(HTTPTLSConnection* conn, const char* data, size_t length, long long deadline, HTTPRequestTiming* timing) {
+    for (size_t done = 0; done < length; ) {
+        size_t part = length - done > INT_MAX ? INT_MAX : length - done;
+        int bytes = SSL_write(conn->ssl, data + done, (int)part);
+        HTTP_COUNT(timing, syscalls, 1);
+        if (bytes > 0) {
+            HTTP_COUNT(timing, bytes_sent, bytes);
+            done += bytes;
+        } else if (!waitTLS(conn, SSL_get_error(conn->ssl, bytes), deadline, timing)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// sendTCPRawData() over TLS. Fragments are gathered into records of up to HTTP_TLS_RECORD_SIZE bytes, so that a
+// request head goes out in one record, larger fragments are written as they are. iov is not consumed.
+static bool sendTLSData(HTTPTLSConnection* conn, const struct iovec* iov, int count, long long deadline, HTTPRequestTiming* timing) {
+    char record[HTTP_TLS_RECORD_SIZE];
+    size_t gathered = 0;
+    for (int i = 0; i <= count; i++) {
+        bool last = i == count;
+        size_t length = last ? 0 : iov[i].iov_len;
+        if (gathered > 0 && (last || gathered + length > sizeof(record))) {
+            if (!writeTLSData(conn, record, gathered, deadline, timing)) return false;
+            gathered = 0;
+        }
+        if (length >= sizeof(record)) {
+            if (!writeTLSData(conn, iov[i].iov_base, length, deadline, timing)) return false;
+        } else if (length > 0) {
+            memcpy(record + gathered, iov[i].iov_base, length);
+            gathered += length;
+        }
+    }
+    return true;
+}
+
+// receiveSocketData() over TLS. Data already decrypted is returned without waiting for the socket, on timeout
+// errno is ETIMEDOUT.
+static ssize_t receiveTLSData(HTTPTLSConnection* conn, void* buffer, size_t length, long long deadline, HTTPRequestTiming* timing) {
+    for (;;) {
+        int bytes = SSL_read(conn->ssl, buffer, length > INT_MAX ? INT_MAX : (int)length);
+        HTTP_COUNT(timing, syscalls, 1);
+        if (bytes > 0) return bytes;
+        int reason = SSL_get_error(conn->ssl, bytes);
+        if (reason == SSL_ERROR_ZERO_RETURN) {
+            ERR_clear_error();
+            return 0;
+        }
+        if (!waitTLS(conn, reason, deadline, timing)) return -1;
+    }
+}
+#else
+int InitHTTPTLS(const HTTPTLSOptions* options) {
+    (void)options;
+    return -1;
+}
+
+void GetHTTPTLSStats(HTTPTLSStats* stats) {
+    if (stats) memset(stats, 0, sizeof(*stats));
+}
+#endif
+
+// Closes a connection socket together with its TLS state (may be NULL). No close_notify is sent, the session
+// stays resumable.
+static void closeConnection(int sd, HTTPTLSConnection* tlsConnection) {
+    #ifdef HTTP_WITH_OPENSSL
+    if (tlsConnection) {
+        SSL_set_quiet_shutdown(tlsConnection->ssl, 1);
+        SSL_shutdown(tlsConnection->ssl);
+        SSL_free(tlsConnection->ssl);
+        free(tlsConnection);
+    }
+    #else
+    (void)tlsConnection;
+    #endif
+    close(sd);
+}
+
+// Opens a blocking connection for rq, with TLS when rq->tls is set. With a connect timeout or a request deadline
+// the connect (and handshake) itself is non-blocking and waited for with poll(), on timeout errno is ETIMEDOUT.
+// TLS sockets stay non-blocking, so that no SSL call can block past the deadline or io_timeout_ms.
+static bool createTCPSocket(HTTPRequestInfo *rq) {
+    struct sockaddr_in server_addr;
+	if (!rq || !requestDestination(rq, &server_addr)) return false;
+    const HTTPSocketOptions* options = &rq->socket_options;
+    long long deadline = rq->deadline;
+    rq->tls_connection = NULL;
+    if (options->connect_timeout_ms > 0) {
+        long long connectDeadline = monotonicMs() + options->connect_timeout_ms;
+        if (!deadline || connectDeadline < deadline) deadline = connectDeadline;
+    }
+    int sd = socket(AF_INET, SOCK_STREAM | (deadline ? SOCK_NONBLOCK : 0), 0);
+    HTTP_COUNT(&rq->timing, syscalls, 2);
+    HTTP_COUNT(&rq->timing, connects, 1);
+    if (sd < 0) return false;
+    if (!configureSocket(sd, options, true)) {
+        close(sd);
+        return false;
+    }
+
+    int result = connect(sd, (struct sockaddr *)&server_addr, sizeof(server_addr));
+    if (result < 0 && errno == EINPROGRESS) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        int ready = waitSocket(sd, POLLOUT, deadline, &rq->timing);
+        if (ready == 1 && getsockopt(sd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0) result = 0;
+        else errno = ready == 0 ? ETIMEDOUT : error;
+    }
+    if (result == 0 && rq->tls) {
+        #ifdef HTTP_WITH_OPENSSL
+        if (!deadline) fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK);
+        rq->tls_connection = startTLS(sd, rq, deadline);
+        if (!rq->tls_connection) result = -1;
+        #else
+        errno = EPROTONOSUPPORT;
+        result = -1;
+        #endif
+    }
+    if (result == 0 && deadline && !rq->tls) fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) & ~O_NONBLOCK); // reads and writes wait for the deadline themselves
+    if (result < 0) {
+        #ifdef DEBUG
+        printf("[createTCPSocket]: connect error: %s\n", strerror(errno));
+        #endif
+        int error = errno;
+        close(sd);
+        errno = error;
+        return false;
+    }
+    
+    rq->sd = sd;
+    HTTP_MARK(&rq->timing, connected);
+    #ifdef DEBUG
+    printf("[createTCPSocket]: created fd %d\n", sd);
+    #endif
+    return true;
+}
+
+// An idle keep-alive socket, keyed by the address, port, Host header and TLS it was opened for.
+typedef struct {
+    struct sockaddr_in addr;
+    char host[HTTP_POOL_HOST_SIZE];
+    bool tls;
+    int sd;
+    HTTPTLSConnection* tlsConnection; // TLS state of sd, NULL without TLS
+    long long idleSince; // monotonicMs() when the socket was released
+} HTTPIdleConnection;
+
+struct HTTPConnectionPool {
+    pthread_mutex_t lock;
+    HTTPConnectionPoolOptions options;
+    HTTPConnectionPoolStats stats;
+    HTTPIdleConnection* idle; // idle sockets, unordered, max_idle_total slots
+    int idleCount;
+};
+
+HTTPConnectionPool* CreateHTTPConnectionPool(const HTTPConnectionPoolOptions* options) {
+    HTTPConnectionPool* pool = calloc(1, sizeof(HTTPConnectionPool));
+    if (!pool) return NULL;
+    if (options) pool->options = *options;
+    if (pool->options.max_idle_per_host <= 0) pool->options.max_idle_per_host = 4;
+    if (pool->options.max_idle_total <= 0) pool->options.max_idle_total = 64;
+    if (pool->options.idle_timeout_ms <= 0) pool->options.idle_timeout_ms = 30000;
+
+    pool->idle = calloc(pool->options.max_idle_total, sizeof(HTTPIdleConnection));
+    if (!pool->idle || pthread_mutex_init(&pool->lock, NULL) != 0) {
+        free(pool->idle);
+        free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void DestroyHTTPConnectionPool(HTTPConnectionPool* pool) {
+    if (!pool) return;
+    for (int i = 0; i < pool->idleCount; i++) closeConnection(pool->idle[i].sd, pool->idle[i].tlsConnection);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->idle);
+    free(pool);
+}
+
+void GetHTTPConnectionPoolStats(HTTPConnectionPool* pool, HTTPConnectionPoolStats* stats) {
+    if (!pool || !stats) return;
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Whether an idle socket can still carry a request. A readable idle socket means the server
+// has closed it (recv returns 0) or sent something we did not ask for, neither can be reused.
+static bool isIdleConnectionAlive(const HTTPIdleConnection* conn) {
+    #ifdef HTTP_WITH_OPENSSL
+    if (conn->tlsConnection && SSL_pending(conn->tlsConnection->ssl) > 0) return false;
+    #endif
+    char c;
+    ssize_t n = recv(conn->sd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+static bool sameDestination(const struct sockaddr_in* a, const struct sockaddr_in* b) {
+    return a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr;
+}
+
+static bool matchIdleConnection(const HTTPIdleConnection* conn, const struct sockaddr_in* addr, const HTTPRequestInfo* rq) {
+    return sameDestination(&conn->addr, addr) && conn->tls == rq->tls && strcmp(conn->host, requestHost(rq)) == 0;
+}
+
+// Takes the most recently released matching socket from the pool and stores it in rq->sd.
+// Expired and closed sockets met on the way are dropped.
+static bool acquirePooledConnection(HTTPConnectionPool* pool, HTTPRequestInfo* rq) {
+    struct sockaddr_in addr;
+    if (!requestDestination(rq, &addr)) return false;
+    long long now = monotonicMs();
+    bool found = false;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        int best = -1;
+        for (int i = 0; i < pool->idleCount; i++) {
+            if (!matchIdleConnection(&pool->idle[i], &addr, rq)) continue;
+            if (best < 0 || pool->idle[i].idleSince > pool->idle[best].idleSince) best = i;
+        }
+        if (best < 0) break;
+
+        HTTPIdleConnection conn = pool->idle[best];
+        pool->idle[best] = pool->idle[--pool->idleCount];
+        if (now - conn.idleSince >= pool->options.idle_timeout_ms || !isIdleConnectionAlive(&conn)) {
+            closeConnection(conn.sd, conn.tlsConnection);
+            pool->stats.stale++;
+            continue;
+        }
+        rq->sd = conn.sd;
+        rq->tls_connection = conn.tlsConnection;
+        found = true;
+        break;
+    }
+    if (found) pool->stats.hits++;
+    else pool->stats.misses++;
+    pthread_mutex_unlock(&pool->lock);
+
+    #ifdef DEBUG
+    if (found) printf("[acquirePooledConnection]: reusing fd %d for %s:%d\n", rq->sd, requestHost(rq), rq->port);
+    #endif
+    return found;
+}
+
+// Returns rq->sd and its TLS state to the pool. The socket is closed instead if the key does not fit,
+// the host already has max_idle_per_host idle sockets, or the pool is full after dropping expired ones.
+static void releasePooledConnection(HTTPConnectionPool* pool, HTTPRequestInfo* rq) {
+    struct sockaddr_in addr;
+    if (!requestDestination(rq, &addr) || strlen(requestHost(rq)) >= HTTP_POOL_HOST_SIZE) {
+        closeConnection(rq->sd, rq->tls_connection);
+        rq->sd = -1;
+        rq->tls_connection = NULL;
+        return;
+    }
+
+    long long now = monotonicMs();
+    int sameHost = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (int i = 0; i < pool->idleCount; i++) {
+        if (now - pool->idle[i].idleSince >= pool->options.idle_timeout_ms) {
+            closeConnection(pool->idle[i].sd, pool->idle[i].tlsConnection);
+            pool->idle[i--] = pool->idle[--pool->idleCount];
+            pool->stats.stale++;
+        } else if (matchIdleConnection(&pool->idle[i], &addr, rq)) {
+            sameHost++;
+        }
+    }
+
+    if (sameHost >= pool->options.max_idle_per_host || pool->idleCount >= pool->options.max_idle_total) {
+        closeConnection(rq->sd, rq->tls_connection);
+        pool->stats.evicted++;
+    } else {
+        HTTPIdleConnection* conn = &pool->idle[pool->idleCount++];
+        conn->addr = addr;
+        strcpy(conn->host, requestHost(rq));
+        conn->tls = rq->tls;
+        conn->sd = rq->sd;
+        conn->tlsConnection = rq->tls_connection;
+        conn->idleSince = now;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    rq->sd = -1;
+    rq->tls_connection = NULL;
+}
+
+static void recordPoolRetry(HTTPConnectionPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stats.retries++;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Sends raw data (like GET / HTTP/1.1) gathered from iov through the provided socket, one sendmsg() per
+// attempt, iov is consumed. Uses MSG_NOSIGNAL to prevent the process from being killed by SIGPIPE if the
+// connection is closed on the other side. flags are added to every sendmsg(), e.g. MSG_MORE when more follows.
+// With tlsConnection the data is encrypted and written through it instead.
+static bool sendTCPRawData(int sd, HTTPTLSConnection* tlsConnection, struct iovec* iov, int count, HTTPRequestTiming* timing, long long deadline, int flags) {
+    size_t length = 0;
+    for (int i = 0; i < count; i++) length += iov[i].iov_len;
+    if (length == 0) return false;
+    #ifdef HTTP_WITH_OPENSSL
+    if (tlsConnection) return sendTLSData(tlsConnection, iov, count, deadline, timing);
+    #else
+    (void)tlsConnection;
+    #endif
+
+    size_t remaining = length;
+    while (remaining > 0) {
+        struct msghdr message = { .msg_iov = iov, .msg_iovlen = count };
+        ssize_t bytes = sendmsg(sd, &message, MSG_NOSIGNAL | flags | (deadline ? MSG_DONTWAIT : 0));
+        HTTP_COUNT(timing, syscalls, 1);
+        if (bytes < 0) {
+            #ifdef DEBUG
+            printf("[sendTCPRawData]: error when sending data: %d\n", errno);
+            #endif
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // wait when the buffer is full, until the request deadline if there is one
+                int ret = waitSocket(sd, POLLOUT, deadline ? deadline : monotonicMs() + HTTP_SEND_WAIT_MS, timing);
+                if (ret > 0) {
+                    continue;
+                } else {
+                    // timeout or poll error
+                    return false;
+                }
+            } else {
+                // other errors that is unable to handle
+                return false;
+            }
+
+        } else if (bytes == 0) {
+            // send() return 0, which means the server closed the connection
+            return false;
+
+        } else {
+            // successfully sent bytes, skip what is done and move into a partially sent fragment
+            remaining -= bytes;
+            HTTP_COUNT(timing, bytes_sent, bytes);
+            while (count > 0 && (size_t)bytes >= iov->iov_len) {
+                bytes -= iov->iov_len;
+                iov++;
+                count--;
+            }
+            if (count > 0) {
+                iov->iov_base = (char*)iov->iov_base + bytes;
+                iov->iov_len -= bytes;
+            }
+        }
+    }
+
+    #ifdef DEBUG
+    printf("[sendTCPRawData]: sent %zu bytes, remain %zu bytes\n", length, remaining);
+    #endif
+    return true;
+}
+
+// Sends the next part of a file body, done bytes of which are already sent, with one sendfile() that moves
+// the data from the page cache to the socket without a copy through user space. Pipes, which sendfile()
+// cannot read, are spliced. Returns the bytes sent, 0 if the file ended early, -1 with errno.
+static ssize_t sendFileData(int sd, HTTPTLSConnection* tlsConnection, const HTTPRequestBody* body, long long done, long long deadline, HTTPRequestTiming* timing) {
+    long long left = body->length - done;
+    size_t length = left > HTTP_SENDFILE_MAX ? HTTP_SENDFILE_MAX : (size_t)left;
+    off_t position = body->offset + done;
+    #ifdef HTTP_WITH_OPENSSL
+    if (tlsConnection) {
+        // encrypted in user space, one record at a time
+        char record[HTTP_TLS_RECORD_SIZE];
+        if (length > sizeof(record)) length = sizeof(record);
+        ssize_t bytes = pread(body->fd, record, length, position);
+        if (bytes < 0 && errno == ESPIPE) bytes = read(body->fd, record, length);
+        HTTP_COUNT(timing, syscalls, 1);
+        if (bytes <= 0) return bytes;
+        struct iovec iov = { .iov_base = record, .iov_len = bytes };
+        return sendTLSData(tlsConnection, &iov, 1, deadline, timing) ? bytes : -1;
+    }
+    #else
+    (void)tlsConnection;
+    (void)deadline;
+    #endif
+    ssize_t bytes = sendfile(sd, body->fd, &position, length);
+    HTTP_COUNT(timing, syscalls, 1);
+    if (bytes < 0 && (errno == EINVAL || errno == ESPIPE)) {
+        bytes = splice(body->fd, NULL, sd, NULL, length, SPLICE_F_MOVE | (left > (long long)length ? SPLICE_F_MORE : 0));
+        HTTP_COUNT(timing, syscalls, 1);
+    }
+    if (bytes > 0) HTTP_COUNT(timing, bytes_sent, bytes);
+    return bytes;
+}
+
+// Fills chunk (HTTP_CHUNK_FRAME + HTTP_BODY_CHUNK_SIZE + 2 bytes) with the next chunk of a produced body.
+// The producer writes the payload behind the room reserved for the size line, which is then written
+// right-aligned against it, so the chunk starts at *start and is *size bytes long. Once the producer
+// has nothing more, the chunk is the last one and *last is set. Returns false if the producer failed.
+static bool produceBodyChunk(const HTTPRequestBody* body, char* chunk, size_t* start, size_t* size, bool* last) {
+    long long produced = body->produce(chunk + HTTP_CHUNK_FRAME, HTTP_BODY_CHUNK_SIZE, body->ctx);
+    if (produced < 0 || produced > HTTP_BODY_CHUNK_SIZE) return false;
+    *last = produced == 0;
+    if (*last) {
+        memcpy(chunk, "0\r\n\r\n", 5);
+        *start = 0;
+        *size = 5;
+        return true;
+    }
+
+    char* line = chunk + HTTP_CHUNK_FRAME;
+    *--line = '\n';
+    *--line = '\r';
+    unsigned long long value = (unsigned long long)produced;
+    do *--line = "0123456789abcdef"[value & 15]; while (value >>= 4);
+    memcpy(chunk + HTTP_CHUNK_FRAME + produced, "\r\n", 2);
+    *start = line - chunk;
+    *size = HTTP_CHUNK_FRAME + produced + 2 - *start;
+    return true;
+}
+
+// A produced body is consumed as it is sent, so its request cannot be sent again on a new connection.
+static bool requestReplayable(const HTTPRequestInfo* rq) {
+    return !rq->body || !rq->body->produce;
+}
+
+// Whether rq failed because the server had closed or reset its reused connection before any of the response
+// arrived, which is how an idle connection the server has dropped shows up. Only then is a request sent again:
+// after a timeout or part of a response the server may still be working on it. A closed or reset socket
+// reads end of file from then on, one that is still open would block.
+static bool reusedConnectionDropped(const HTTPRequestInfo* rq, const HTTPResponseInfo* msg) {
+    if (!rq->reused || msg->l4.totalSize != 0 || !requestReplayable(rq)) return false;
+    char byte;
+    return recv(rq->sd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+}
+
+// Parses the status line of the HTTP response (e.g., HTTP/1.x 200 OK).
+// Validates the HTTP version and extracts the status code.
+static bool parseHTTPStatusLine(HTTPResponseInfo* msg, const char* line) {
+    if (!msg || !line) return false;
+
+    // Check if the content starts with "HTTP/1.x"
+    if (strncmp(line, "HTTP/1.", 7) != 0) return false;
+
+    // Find the first ' '
+    char* statusStart = strchr(line, ' ');
+    if (!statusStart) return false;
+    statusStart++;
+    if (!isdigit(*statusStart)) return false;
+    int result = atoi(statusStart); // " OK" will be ignored by atoi()
+    if (result >= 100 && result <= 999) {
+    	#ifdef DEBUG
+    	printf("[parseHTTPStatusLine]: parsed http status_code: %d\n", result);
+    	#endif
+        msg->l7.status_code = result;
+        msg->l7.keepAlive = line[7] != '0'; // HTTP/1.1 defaults to keep-alive, HTTP/1.0 to close
+    	return true;
+    }
+    return false;
+}
+
+// How the end of the response body is found.
+typedef enum {
+    HTTP_BODY_NONE,        // 1xx, 204 and 304 responses carry no body
+    HTTP_BODY_LENGTH,      // Content-Length bytes follow the headers
+    HTTP_BODY_CHUNKED,     // chunks up to the zero-length chunk and the trailers
+    HTTP_BODY_UNTIL_CLOSE  // no framing, the body ends when the server closes the connection
+} HTTPBodyFraming;
+
+typedef enum {
+    HTTP_PARSE_MORE,       // the message is incomplete, read more data
+    HTTP_PARSE_DONE,       // the message is complete, see HTTPResponseParser.messageSize
+    HTTP_PARSE_BAD_HEADER, // malformed status line or headers
+    HTTP_PARSE_BAD_CHUNK,  // malformed chunk size line
+    HTTP_PARSE_ABORTED     // a stream callback asked to stop
+} HTTPParseResult;
+
+// States of the chunked transfer decoder, one per syntax element of RFC 9112 section 7.1.
+typedef enum {
+    CHUNK_SIZE,          // hex digits of the chunk size
+    CHUNK_EXTENSION,     // ";name=value" after the size, ignored
+    CHUNK_SIZE_LF,       // LF ending the size line
+    CHUNK_DATA,          // chunk payload
+    CHUNK_DATA_CR,       // CRLF after the payload
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER,       // start of a trailer line or of the final empty line
+    CHUNK_TRAILER_LINE,  // trailer field, ignored
+    CHUNK_TRAILER_LF,
+    CHUNK_END_LF,        // LF of the final empty line
+    CHUNK_DONE
+} HTTPChunkState;
+
+// Incremental chunked transfer decoder, it keeps no data of its own so input can arrive in any split.
+typedef struct {
+    HTTPChunkState state;
+    unsigned long long remaining; // size being parsed, then payload bytes left in the current chunk
+    bool hasDigits;
+} HTTPChunkDecoder;
+
+// Receives a span of decoded payload, returns false to abort decoding.
+typedef bool (*HTTPChunkSink)(char* data, size_t length, void* ctx);
+
+// Decodes length bytes of chunked data and hands every payload span to sink, without copying.
+// *consumed is set to the number of input bytes used, which is all of them unless the body
+// ends (HTTP_PARSE_DONE) or an error is returned.
+static HTTPParseResult decodeChunks(HTTPChunkDecoder* decoder, char* data, size_t length, size_t* consumed, HTTPChunkSink sink, void* ctx) {
+    size_t i = 0;
+    HTTPParseResult result = HTTP_PARSE_MORE;
+
+    while (i < length && result == HTTP_PARSE_MORE) {
+        char c = data[i];
+        switch (decoder->state) {
+        case CHUNK_SIZE:
+            if (isxdigit((unsigned char)c)) {
+                if (decoder->remaining >> 60) { result = HTTP_PARSE_BAD_CHUNK; break; }
+                decoder->remaining = decoder->remaining * 16 + (isdigit((unsigned char)c) ? c - '0' : (tolower((unsigned char)c) - 'a' + 10));
+                decoder->hasDigits = true;
+            } else if (!decoder->hasDigits) {
+                result = HTTP_PARSE_BAD_CHUNK;
+            } else if (c == ';' || c == ' ' || c == '\t') {
+                decoder->state = CHUNK_EXTENSION;
+            } else if (c == '\r') {
+                decoder->state = CHUNK_SIZE_LF;
+            } else {
+                result = HTTP_PARSE_BAD_CHUNK;
+            }
+            i++;
+            break;
+        case CHUNK_EXTENSION:
+            if (c == '\r') decoder->state = CHUNK_SIZE_LF;
+            i++;
+            break;
+        case CHUNK_SIZE_LF:
+            if (c != '\n') { result = HTTP_PARSE_BAD_CHUNK; break; }
+            decoder->state = decoder->remaining ? CHUNK_DATA : CHUNK_TRAILER;
+            i++;
+            break;
+        case CHUNK_DATA: {
+            size_t n = length - i;
+            if (n > decoder->remaining) n = decoder->remaining;
+            if (!sink(data + i, n, ctx)) { result = HTTP_PARSE_ABORTED; break; }
+            decoder->remaining -= n;
+            if (decoder->remaining == 0) decoder->state = CHUNK_DATA_CR;
+            i += n;
+            break;
+        }
+        case CHUNK_DATA_CR:
+            if (c != '\r') { result = HTTP_PARSE_BAD_CHUNK; break; }
+            decoder->state = CHUNK_DATA_LF;
+            i++;
+            break;
+        case CHUNK_DATA_LF:
+            if (c != '\n') { result = HTTP_PARSE_BAD_CHUNK; break; }
+            decoder->state = CHUNK_SIZE;
+            decoder->hasDigits = false;
+            i++;
+            break;
+        case CHUNK_TRAILER:
+            decoder->state = c == '\r' ? CHUNK_END_LF : CHUNK_TRAILER_LINE;
+            i++;
+            break;
+        case CHUNK_TRAILER_LINE:
+            if (c == '\r') decoder->state = CHUNK_TRAILER_LF;
+            i++;
+            break;
+        case CHUNK_TRAILER_LF:
+            if (c != '\n') { result = HTTP_PARSE_BAD_CHUNK; break; }
+            decoder->state = CHUNK_TRAILER;
+            i++;
+            break;
+        case CHUNK_END_LF:
+            if (c != '\n') { result = HTTP_PARSE_BAD_CHUNK; break; }
+            decoder->state = CHUNK_DONE;
+            i++;
+            break;
+        case CHUNK_DONE:
+            break;
+        }
+        if (decoder->state == CHUNK_DONE && result == HTTP_PARSE_MORE) result = HTTP_PARSE_DONE;
+    }
+
+    *consumed = i;
+    return result;
+}
+
+// Framing state of one response, advanced every time data is appended to l4.buffer
+// so that the response is finished as soon as its last byte arrives.
+typedef struct {
+    size_t scanned;      // bytes already searched for the empty line ending the headers
+    size_t headerSize;   // status line and headers including the empty line, 0 until they are received
+    HTTPBodyFraming framing;
+    HTTPChunkDecoder chunks; // chunked bodies are decoded while they arrive
+    size_t bodyEnd;      // end of the decoded chunked body in l4.buffer
+    size_t messageSize;  // size of the complete message, set with HTTP_PARSE_DONE
+} HTTPResponseParser;
+
+// Well-known response headers, recognised once while the index is built.
+typedef enum {
+    HTTP_HEADER_AGE,
+    HTTP_HEADER_DATE,
+    HTTP_HEADER_ETAG,
+    HTTP_HEADER_VARY,
+    HTTP_HEADER_SERVER,
+    HTTP_HEADER_EXPIRES,
+    HTTP_HEADER_LOCATION,
+    HTTP_HEADER_CONNECTION,
+    HTTP_HEADER_KEEP_ALIVE,
+    HTTP_HEADER_SET_COOKIE,
+    HTTP_HEADER_RETRY_AFTER,
+    HTTP_HEADER_CONTENT_TYPE,
+    HTTP_HEADER_ACCEPT_RANGES,
+    HTTP_HEADER_CACHE_CONTROL,
+    HTTP_HEADER_CONTENT_RANGE,
+    HTTP_HEADER_LAST_MODIFIED,
+    HTTP_HEADER_CONTENT_LENGTH,
+    HTTP_HEADER_CONTENT_ENCODING,
+    HTTP_HEADER_WWW_AUTHENTICATE,
+    HTTP_HEADER_TRANSFER_ENCODING,
+    HTTP_HEADER_KNOWN_MAX
+} HTTPKnownHeader;
+
+static const char* HTTPKnownHeaderString[HTTP_HEADER_KNOWN_MAX] = {
+    [HTTP_HEADER_AGE]               = "Age",
+    [HTTP_HEADER_DATE]              = "Date",
+    [HTTP_HEADER_ETAG]              = "ETag",
+    [HTTP_HEADER_VARY]              = "Vary",
+    [HTTP_HEADER_SERVER]            = "Server",
+    [HTTP_HEADER_EXPIRES]           = "Expires",
+    [HTTP_HEADER_LOCATION]          = "Location",
+    [HTTP_HEADER_CONNECTION]        = "Connection",
+    [HTTP_HEADER_KEEP_ALIVE]        = "Keep-Alive",
+    [HTTP_HEADER_SET_COOKIE]        = "Set-Cookie",
+    [HTTP_HEADER_RETRY_AFTER]       = "Retry-After",
+    [HTTP_HEADER_CONTENT_TYPE]      = "Content-Type",
+    [HTTP_HEADER_ACCEPT_RANGES]     = "Accept-Ranges",
+    [HTTP_HEADER_CACHE_CONTROL]     = "Cache-Control",
+    [HTTP_HEADER_CONTENT_RANGE]     = "Content-Range",
+    [HTTP_HEADER_LAST_MODIFIED]     = "Last-Modified",
+    [HTTP_HEADER_CONTENT_LENGTH]    = "Content-Length",
+    [HTTP_HEADER_CONTENT_ENCODING]  = "Content-Encoding",
+    [HTTP_HEADER_WWW_AUTHENTICATE]  = "WWW-Authenticate",
+    [HTTP_HEADER_TRANSFER_ENCODING] = "Transfer-Encoding"
+};
+
+// Candidates per name length, the id plus one (0 ends the list), so a name is compared
+// against at most four known names of exactly its length.
+#define HTTP_KNOWN_HEADER_MAX_LENGTH 17
+static const unsigned char knownHeadersByLength[HTTP_KNOWN_HEADER_MAX_LENGTH + 1][4] = {
+    [3]  = { HTTP_HEADER_AGE + 1 },
+    [4]  = { HTTP_HEADER_DATE + 1, HTTP_HEADER_ETAG + 1, HTTP_HEADER_VARY + 1 },
+    [6]  = { HTTP_HEADER_SERVER + 1 },
+    [7]  = { HTTP_HEADER_EXPIRES + 1 },
+    [8]  = { HTTP_HEADER_LOCATION + 1 },
+    [10] = { HTTP_HEADER_CONNECTION + 1, HTTP_HEADER_KEEP_ALIVE + 1, HTTP_HEADER_SET_COOKIE + 1 },
+    [11] = { HTTP_HEADER_RETRY_AFTER + 1 },
+    [12] = { HTTP_HEADER_CONTENT_TYPE + 1 },
+    [13] = { HTTP_HEADER_ACCEPT_RANGES + 1, HTTP_HEADER_CACHE_CONTROL + 1, HTTP_HEADER_CONTENT_RANGE + 1, HTTP_HEADER_LAST_MODIFIED + 1 },
+    [14] = { HTTP_HEADER_CONTENT_LENGTH + 1 },
+    [16] = { HTTP_HEADER_CONTENT_ENCODING + 1, HTTP_HEADER_WWW_AUTHENTICATE + 1 },
+    [17] = { HTTP_HEADER_TRANSFER_ENCODING + 1 }
+};
+
+// Returns the HTTPKnownHeader of a name of the given length, or -1.
+static int findKnownHeader(const char* name, size_t length) {
+    if (length > HTTP_KNOWN_HEADER_MAX_LENGTH) return -1;
+    const unsigned char* candidates = knownHeadersByLength[length];
+    for (int i = 0; i < 4 && candidates[i]; i++) {
+        if (strncasecmp(name, HTTPKnownHeaderString[candidates[i] - 1], length) == 0) return candidates[i] - 1;
+    }
+    return -1;
+}
+
+// Returns the first '\r' or ':' in [p, end), or end. 32 or 16 bytes are compared at a time with
+// AVX2 or SSE2 when the compiler targets them, the rest byte by byte.
+static const char* scanHeaderDelimiter(const char* p, const char* end) {
+#if defined(__AVX2__)
+    const __m256i cr32 = _mm256_set1_epi8('\r');
+    const __m256i colon32 = _mm256_set1_epi8(':');
+    for (; end - p >= 32; p += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)p);
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(block, cr32), _mm256_cmpeq_epi8(block, colon32)));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i colon = _mm_set1_epi8(':');
+    for (; end - p >= 16; p += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)p);
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, cr), _mm_cmpeq_epi8(block, colon)));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+#endif
+    for (; p < end; p++) {
+        if (*p == '\r' || *p == ':') return p;
+    }
+    return end;
+}
+
+// Returns the CRLF ending the line at p, or NULL. Bare CRs inside the line are skipped.
+static char* findLineEnd(char* p, char* end) {
+    for (;;) {
+        p = memchr(p, '\r', end - p); // glibc's memchr is vectorized already
+        if (!p || p + 1 >= end) return NULL;
+        if (p[1] == '\n') return p;
+        p++;
+    }
+}
+
+static bool appendHeaderSpan(HTTPResponseInfo* msg, size_t name, size_t value, int known) {
+    if (msg->headers.count == msg->headers.capacity) {
+        int capacity = msg->headers.capacity ? msg->headers.capacity * 2 : 16;
+        #ifdef HTTP_STATIC
+        if (staticSlot(msg->headers.spans, staticMemory.responses, sizeof(HTTPStaticResponse), HTTP_STATIC_RESPONSES) >= 0) return false;
+        #endif
+        HTTPHeaderSpan* spans = realloc(msg->headers.spans, capacity * sizeof(HTTPHeaderSpan));
+        if (!spans) return false;
+        msg->headers.spans = spans;
+        msg->headers.capacity = capacity;
+    }
+    msg->headers.spans[msg->headers.count++] = (HTTPHeaderSpan){ .name = (unsigned int)name, .value = (unsigned int)value, .known = known };
+    return true;
+}
+
+static const char* headerValue(const HTTPResponseInfo* msg, const HTTPHeaderSpan* span) {
+    return msg->l4.buffer + span->value;
+}
+
+// Points l7.cookie at the last Set-Cookie value, GetHTTPHeaderValues() returns all of them.
+static void updateHTTPCookie(HTTPResponseInfo* msg) {
+    msg->l7.cookie = NULL;
+    for (int i = 0; i < msg->headers.count; i++) {
+        if (msg->headers.spans[i].known == HTTP_HEADER_SET_COOKIE) msg->l7.cookie = (char*)headerValue(msg, &msg->headers.spans[i]);
+    }
+}
+
+// Applies the headers that drive the transfer: Content-Length, Transfer-Encoding and Connection.
+static bool applyHTTPHeader(HTTPResponseInfo* msg, int known, const char* value) {
+    switch (known) {
+    case HTTP_HEADER_CONTENT_LENGTH: {
+        // a length that is not a plain number or does not fit is a framing error, never a truncated length
+        char* end;
+        if (!isdigit((unsigned char)*value)) return false;
+        int saved = errno;
+        errno = 0;
+        long long length = strtoll(value, &end, 10);
+        bool valid = errno == 0 && *end == '\0';
+        errno = saved;
+        if (!valid) return false;
+        msg->l7.content_length = length;
+        break;
+    }
+    case HTTP_HEADER_TRANSFER_ENCODING:
+        if (strcasestr(value, "chunked")) msg->l7.chunkedTransfer = true;
+        break;
+    case HTTP_HEADER_CONNECTION:
+        if (strcasestr(value, "close")) msg->l7.keepAlive = false;
+        else if (strcasestr(value, "keep-alive")) msg->l7.keepAlive = true;
+        break;
+    }
+    return true;
+}
+
+// Parses the status line and the headers, which end with the empty line at headerSize, into msg->headers.
+// Each line is scanned once for its first colon and its CRLF. The CRLFs are replaced with NULs, and so are
+// the colons, so that names and values can be used as strings.
+static bool parseHTTPHeaders(HTTPResponseInfo* msg, size_t headerSize) {
+    char* buffer = msg->l4.buffer;
+    char* cursor = buffer; // current position
+    char* end = buffer + headerSize - 2; // the CRLF of the empty line
+    msg->headers.count = 0;
+
+    // 1. parse status line
+    char* lineEnd = findLineEnd(cursor, end + 2);
+    *lineEnd = '\0'; // replace crlf with 0x00
+    if (!parseHTTPStatusLine(msg, cursor)) return false;
+    cursor = lineEnd + 2; // move to next line
+
+    // 2. index headers
+    while (cursor < end) {
+        char* colon = (char*)scanHeaderDelimiter(cursor, end);
+        if (colon == end || *colon != ':' || colon == cursor) return false; // no name, or a line without a colon
+        lineEnd = findLineEnd(colon, end + 2);
+        char* value = colon + 1;
+        while (*value == ' ' || *value == '\t') value++; // if multi space exists
+        char* valueEnd = lineEnd;
+        while (valueEnd > value && (valueEnd[-1] == ' ' || valueEnd[-1] == '\t')) valueEnd--;
+        *colon = '\0';
+        *valueEnd = '\0';
+
+        int known = findKnownHeader(cursor, colon - cursor);
+        if (!appendHeaderSpan(msg, cursor - buffer, value - buffer, known)) return false;
+        if (!applyHTTPHeader(msg, known, value)) return false;
+        cursor = lineEnd + 2;
+    }
+    *end = '\0';
+    updateHTTPCookie(msg);
+    #ifdef DEBUG
+    printf("[parseHTTPHeaders]: indexed %d headers\n", msg->headers.count);
+    #endif
+    return true;
+}
+
+int GetHTTPHeaderValues(const HTTPResponseInfo* msg, const char* name, const char** values, int max) {
+    if (!msg || !name || !msg->l4.buffer) return 0;
+    size_t length = strlen(name);
+    int known = findKnownHeader(name, length);
+    int found = 0;
+    for (int i = 0; i < msg->headers.count; i++) {
+        const HTTPHeaderSpan* span = &msg->headers.spans[i];
+        if (known >= 0 ? span->known != known : span->known >= 0 || strcasecmp(msg->l4.buffer + span->name, name) != 0) continue;
+        if (values && found < max) values[found] = headerValue(msg, span);
+        found++;
+    }
+    return found;
+}
+
+const char* GetHTTPHeader(const HTTPResponseInfo* msg, const char* name) {
+    const char* value = NULL;
+    return GetHTTPHeaderValues(msg, name, &value, 1) > 0 ? value : NULL;
+}
+
+int GetHTTPHeaderCount(const HTTPResponseInfo* msg) {
+    return msg && msg->l4.buffer ? msg->headers.count : 0;
+}
+
+bool GetHTTPHeaderAt(const HTTPResponseInfo* msg, int index, const char** name, const char** value) {
+    if (!msg || !msg->l4.buffer || index < 0 || index >= msg->headers.count) return false;
+    if (name) *name = msg->l4.buffer + msg->headers.spans[index].name;
+    if (value) *value = headerValue(msg, &msg->headers.spans[index]);
+    return true;
+}
+
+// Moves a decoded payload span down to the write cursor, the span never lies before it.
+static bool compactChunk(char* data, size_t length, void* ctx) {
+    char** write = ctx;
+    memmove(*write, data, length);
+    *write += length;
+    return true;
+}
+
+// Decodes the chunked data appended since the last call in place, in a single forward pass:
+// payloads are moved down to the end of the decoded body while size lines, extensions, CRLFs and
+// trailers are dropped. l4.totalSize then ends at the decoded body, so no second buffer is needed
+// and the buffer only ever holds the headers, the decoded body and the latest read.
+// Data received after the end of the body (a pipelined response) is moved along behind the body.
+static HTTPParseResult advanceChunkedBody(HTTPResponseInfo* msg, HTTPResponseParser* parser) {
+    char* input = msg->l4.buffer + parser->bodyEnd;
+    size_t inputSize = msg->l4.totalSize - parser->bodyEnd;
+    char* write = input;
+    size_t used;
+    HTTPParseResult result = decodeChunks(&parser->chunks, input, inputSize, &used, compactChunk, &write);
+    parser->bodyEnd = write - msg->l4.buffer;
+    msg->l4.totalSize = parser->bodyEnd;
+    if (result == HTTP_PARSE_DONE) {
+        parser->messageSize = parser->bodyEnd;
+        memmove(write, input + used, inputSize - used);
+        msg->l4.totalSize += inputSize - used;
+    }
+    return result;
+}
+
+// Looks for the end of the headers in the data appended to l4.buffer and parses them once complete.
+// Interim 1xx responses (100 Continue) are dropped from the buffer and parsing starts over.
+// Returns HTTP_PARSE_DONE when parser->headerSize and parser->framing are known.
+static HTTPParseResult advanceHTTPHeaders(HTTPResponseInfo* msg, HTTPResponseParser* parser) {
+    while (parser->headerSize == 0) {
+        size_t from = parser->scanned > 3 ? parser->scanned - 3 : 0;
+        const char* headerEnd = memmem(msg->l4.buffer + from, msg->l4.totalSize - from, "\r\n\r\n", 4);
+        if (!headerEnd) {
+            parser->scanned = msg->l4.totalSize;
+            return HTTP_PARSE_MORE;
+        }
+        size_t headerSize = headerEnd + 4 - msg->l4.buffer;
+        if (!parseHTTPHeaders(msg, headerSize)) return HTTP_PARSE_BAD_HEADER;
+
+        if (msg->l7.status_code >= 100 && msg->l7.status_code < 200 && msg->l7.status_code != 101) {
+            msg->l4.totalSize -= headerSize;
+            memmove(msg->l4.buffer, msg->l4.buffer + headerSize, msg->l4.totalSize);
+            msg->l4.buffer[msg->l4.totalSize] = '\0';
+            msg->l7.content_length = -1;
+            msg->l7.chunkedTransfer = false;
+            memset(parser, 0, sizeof(*parser));
+            continue;
+        }
+
+        parser->headerSize = headerSize;
+        parser->bodyEnd = headerSize;
+        if (msg->l7.status_code < 200 || msg->l7.status_code == 204 || msg->l7.status_code == 304) parser->framing = HTTP_BODY_NONE;
+        else if (msg->l7.chunkedTransfer) parser->framing = HTTP_BODY_CHUNKED;
+        else if (msg->l7.content_length >= 0) parser->framing = HTTP_BODY_LENGTH;
+        else parser->framing = HTTP_BODY_UNTIL_CLOSE;
+        #ifdef DEBUG
+        printf("[advanceHTTPHeaders]: headers complete, %zu bytes, framing %d\n", headerSize, parser->framing);
+        #endif
+    }
+    return HTTP_PARSE_DONE;
+}
+
+// Advances the framing of the response after new data was appended to l4.buffer.
+static HTTPParseResult advanceHTTPResponse(HTTPResponseInfo* msg, HTTPResponseParser* parser) {
+    HTTPParseResult result = advanceHTTPHeaders(msg, parser);
+    if (result != HTTP_PARSE_DONE) return result;
+
+    switch (parser->framing) {
+    case HTTP_BODY_NONE:
+        parser->messageSize = parser->headerSize;
+        return HTTP_PARSE_DONE;
+    case HTTP_BODY_LENGTH:
+        if ((unsigned long long)(msg->l4.totalSize - parser->headerSize) < (unsigned long long)msg->l7.content_length) return HTTP_PARSE_MORE;
+        parser->messageSize = parser->headerSize + msg->l7.content_length;
+        return HTTP_PARSE_DONE;
+    case HTTP_BODY_CHUNKED:
+        return advanceChunkedBody(msg, parser);
+    default:
+        return HTTP_PARSE_MORE; // finished by the end of the stream
+    }
+}
+
+// Points l7.content at the body of the complete message. Data received after the end
+// of the message is dropped and the buffer is NUL terminated after the body.
+static void finishHTTPMessage(HTTPResponseInfo* msg, HTTPResponseParser* parser) {
+    if (parser->framing == HTTP_BODY_UNTIL_CLOSE) parser->messageSize = msg->l4.totalSize;
+    msg->l4.totalSize = parser->messageSize;
+    msg->l4.buffer[msg->l4.totalSize] = '\0';
+
+    if (parser->framing == HTTP_BODY_NONE) msg->l7.content_length = 0;
+    else msg->l7.content_length = parser->messageSize - parser->headerSize;
+    msg->l7.content = msg->l7.content_length > 0 ? msg->l4.buffer + parser->headerSize : NULL;
+    updateHTTPCookie(msg); // the buffer may have moved since the headers were parsed
+    #ifdef DEBUG
+    if (msg->l7.content) printf("[finishHTTPMessage]: http content body:\n--------Begin of content--------\n%s--------End of content--------\n", msg->l7.content);
+    #endif
+}
+
+// Receive state of a buffered response, shared by the blocking and the event loop paths.
+typedef struct {
+    HTTPResponseParser parser;
+    size_t maxBufferSize;
+    size_t growthFactor;
+    bool exactSize; // the buffer has been sized for the whole message
+    bool keepSurplus;    // save data received after the end of the message (pipelining)
+    char* surplus;       // copy of that data from acquireBuffer(), set by receivedResponseData()
+    size_t surplusSize;
+    const char* borrowed; // caller memory from an HTTPResponseContext, never reallocated or freed
+    bool fixedSize;       // the buffer must not grow (HTTP_OVERFLOW_FAIL)
+    bool overflowed;      // the response did not fit into the fixed buffer
+    bool decompress;      // inflate a gzip or deflate body (HTTPRequestInfo.decompress)
+    size_t maxDecompressed;
+} HTTPReceiveState;
+
+// Grows (or shrinks) l4.buffer to size bytes, the contents up to l4.totalSize are kept.
+// Borrowed caller memory is left as it is and the data moves to a new heap buffer.
+static bool resizeResponseBuffer(HTTPResponseInfo* msg, HTTPReceiveState* state, size_t size) {
+    if (state->fixedSize) {
+        state->overflowed = true;
+        return false;
+    }
+    char *newBuffer;
+    if (state->borrowed && msg->l4.buffer == state->borrowed) {
+        newBuffer = (char*)acquireBuffer(size);
+        if (newBuffer) memcpy(newBuffer, msg->l4.buffer, msg->l4.totalSize);
+    } else {
+        newBuffer = (char*)resizeBuffer(msg->l4.buffer, size);
+    }
+    if (!newBuffer) {
+        #ifdef HTTP_STATIC
+        state->overflowed = size > HTTP_STATIC_BUFFER_SIZE;
+        #endif
+        return false; // no need free here, it will be freed finally, avoid double free
+    }
+    msg->l4.buffer = newBuffer;
+    msg->l4.bufferSize = (int)size;
+    HTTP_COUNT(&msg->timing, reallocs, 1);
+    return true;
+}
+
+// Allocates the initial response buffer with the sizes from rq->recv_buffer (rq NULL = defaults).
+// A buffer already in msg (reused through an HTTPResponseContext) is kept whatever its size.
+static bool beginResponseBuffer(HTTPResponseInfo* msg, HTTPReceiveState* state, const HTTPRequestInfo* rq) {
+    const HTTPBufferOptions* options = rq ? &rq->recv_buffer : NULL;
+    size_t initBufferSize = options && options->initial_size ? options->initial_size : HTTP_RECV_INITIAL_SIZE;
+    #ifdef HTTP_STATIC
+    initBufferSize = HTTP_STATIC_BUFFER_SIZE; // a slot is the same size whatever is asked for
+    #endif
+    memset(state, 0, sizeof(*state));
+    state->maxBufferSize = options && options->max_size ? options->max_size : HTTP_RECV_MAX_SIZE;
+    state->growthFactor = options && options->growth_factor > 1 ? (size_t)options->growth_factor : HTTP_RECV_GROWTH_FACTOR;
+    if (state->maxBufferSize > INT_MAX) state->maxBufferSize = INT_MAX;
+    if (initBufferSize > state->maxBufferSize) initBufferSize = state->maxBufferSize;
+    if (initBufferSize < 2) return false;
+    #ifdef HTTP_WITH_ZLIB
+    state->decompress = rq && rq->decompress;
+    state->maxDecompressed = rq && rq->max_decompressed_size ? rq->max_decompressed_size : state->maxBufferSize;
+    #endif
+    msg->l4.totalSize = 0;
+    if (msg->l4.buffer && msg->l4.bufferSize >= 2) return true;
+
+    msg->l4.buffer = (char*)acquireBuffer(initBufferSize);
+    if (!msg->l4.buffer) return false;
+    msg->l4.bufferSize = initBufferSize;
+    msg->l4.totalSize = 0;
+    return true;
+}
+
+// Makes room for the next recv() and returns how many bytes it should ask for, 0 on error.
+// The buffer grows geometrically by growthFactor up to maxBufferSize. Once Content-Length is known
+// it is sized exactly for the message, and *waitAll tells that the rest of the body can be
+// received with MSG_WAITALL. One byte is always kept for the NUL terminator.
+static size_t reserveResponseBuffer(HTTPResponseInfo* msg, HTTPReceiveState* state, bool* waitAll) {
+    HTTPResponseParser* parser = &state->parser;
+    size_t freeSpace = msg->l4.bufferSize - msg->l4.totalSize - 1;
+    *waitAll = false;
+
+    if (!state->exactSize && parser->framing == HTTP_BODY_LENGTH) {
+        if ((unsigned long long)msg->l7.content_length + parser->headerSize + 1 > state->maxBufferSize) {
+            #ifdef DEBUG
+            printf("[reserveResponseBuffer] Content-Length %lld exceeds maximum buffer size %zu\n", msg->l7.content_length, state->maxBufferSize);
+            #endif
+            return 0;
+        }
+        size_t messageSize = parser->headerSize + (size_t)msg->l7.content_length;
+        if (messageSize + 1 > (size_t)msg->l4.bufferSize && !resizeResponseBuffer(msg, state, messageSize + 1)) return 0;
+        state->exactSize = true;
+    } else if (!state->exactSize && !state->fixedSize && freeSpace < HTTP_RECV_MIN_READ) {
+        size_t newSize = msg->l4.bufferSize * state->growthFactor;
+        if (newSize > state->maxBufferSize) newSize = state->maxBufferSize;
+        if (newSize > (size_t)msg->l4.bufferSize) {
+            if (!resizeResponseBuffer(msg, state, newSize)) return 0;
+            freeSpace = newSize - msg->l4.totalSize - 1;
+        }
+        #ifdef DEBUG
+        if (freeSpace == 0) printf("[reserveResponseBuffer] Buffer size exceeded maximum allowed size %zu\n", state->maxBufferSize);
+        #endif
+    } else if (!state->exactSize && freeSpace == 0 && state->fixedSize) {
+        state->overflowed = true;
+    }
+
+    // with a known length, ask for exactly the rest of the body so nothing after it is consumed
+    if (state->exactSize) {
+        freeSpace = parser->headerSize + (size_t)msg->l7.content_length - msg->l4.totalSize;
+        *waitAll = true;
+    }
+    return freeSpace;
+}
+
+#ifdef HTTP_WITH_ZLIB
+// zlib windowBits for the Content-Encoding of msg, 0 when the body is not compressed. Some servers send
+// raw deflate data for "deflate" instead of the zlib format, which is told apart by the zlib header
+// (body may be NULL until the first bytes are known, the zlib format is assumed then).
+static int contentEncodingWindowBits(const HTTPResponseInfo* msg, const unsigned char* body, size_t length) {
+    const char* encoding = GetHTTPHeader(msg, "Content-Encoding");
+    if (!encoding) return 0;
+    if (strcasecmp(encoding, "gzip") == 0 || strcasecmp(encoding, "x-gzip") == 0) return 15 + 16;
+    if (strcasecmp(encoding, "deflate") != 0) return 0;
+    if (!body || length < 2) return 15;
+    return (body[0] & 0x0F) == 8 && ((body[0] << 8) | body[1]) % 31 == 0 ? 15 : -15;
+}
+
+// Replaces the gzip or deflate body of a complete message by the inflated data. The headers are copied
+// into a new heap buffer followed by the output, which grows geometrically up to maxDecompressed.
+// Borrowed or fixed buffers get the result copied back when it fits.
+// Returns 0 or the error code: -7 corrupt, truncated or too large, -6 too large for a fixed buffer.
+static int inflateHTTPBody(HTTPResponseInfo* msg, HTTPReceiveState* state) {
+    size_t headerSize = state->parser.headerSize;
+    size_t bodySize = msg->l7.content_length > 0 ? (size_t)msg->l7.content_length : 0;
+    unsigned char* body = (unsigned char*)msg->l4.buffer + headerSize;
+    int windowBits = bodySize ? contentEncodingWindowBits(msg, body, bodySize) : 0;
+    if (windowBits == 0) return 0;
+
+    size_t limit = headerSize + state->maxDecompressed + 1;
+    if (limit > INT_MAX) limit = INT_MAX;
+    size_t capacity = headerSize + (bodySize < 1024 ? 4096 : bodySize * 4) + 1;
+    if (capacity > limit) capacity = limit;
+    char* output = malloc(capacity);
+    if (!output) return -1;
+    memcpy(output, msg->l4.buffer, headerSize);
+
+    z_stream stream = {0};
+    if (inflateInit2(&stream, windowBits) != Z_OK) {
+        free(output);
+        return -1;
+    }
+    stream.next_in = body;
+    stream.avail_in = (uInt)bodySize;
+    int error = 0;
+    for (;;) {
+        size_t room = capacity - headerSize - 1 - stream.total_out;
+        if (room == 0) {
+            if (capacity == limit) { error = -7; break; } // beyond maxDecompressed, a decompression bomb
+            size_t grown = capacity * state->growthFactor < limit ? capacity * state->growthFactor : limit;
+            char* newOutput = realloc(output, grown);
+            if (!newOutput) { error = -1; break; }
+            output = newOutput;
+            capacity = grown;
+            HTTP_COUNT(&msg->timing, reallocs, 1);
+            continue;
+        }
+        stream.next_out = (Bytef*)output + headerSize + stream.total_out;
+        stream.avail_out = room > UINT_MAX ? UINT_MAX : (uInt)room;
+        int result = inflate(&stream, Z_NO_FLUSH);
+        if (result == Z_STREAM_END) break;
+        // Z_OK means the output is full or the input ran out, which is a truncated stream
+        if (result != Z_OK || (stream.avail_in == 0 && stream.avail_out > 0)) { error = -7; break; }
+    }
+    size_t decoded = stream.total_out;
+    inflateEnd(&stream);
+    if (error != 0) {
+        free(output);
+        #ifdef DEBUG
+        printf("[inflateHTTPBody]: inflating %zu body bytes failed with %d\n", bodySize, error);
+        #endif
+        return error;
+    }
+
+    size_t size = headerSize + decoded;
+    output[size] = '\0';
+    if ((state->fixedSize || msg->l4.buffer == state->borrowed) && size + 1 <= (size_t)msg->l4.bufferSize) {
+        memcpy(msg->l4.buffer + headerSize, output + headerSize, decoded + 1);
+        free(output);
+    } else if (state->fixedSize) {
+        free(output);
+        return -6;
+    } else {
+        if (msg->l4.buffer != state->borrowed) free(msg->l4.buffer);
+        msg->l4.buffer = output;
+        msg->l4.bufferSize = (int)capacity;
+    }
+    msg->l4.totalSize = (int)size;
+    msg->l7.content_length = decoded;
+    msg->l7.content = decoded > 0 ? msg->l4.buffer + headerSize : NULL;
+    msg->encoding.decoded = true;
+    msg->encoding.compressed_bytes = bodySize;
+    msg->encoding.decompressed_bytes = decoded;
+    updateHTTPCookie(msg);
+    #ifdef DEBUG
+    printf("[inflateHTTPBody]: inflated %zu body bytes to %zu\n", bodySize, decoded);
+    #endif
+    return 0;
+}
+#endif
+
+// Accounts for bytesRead new bytes at the end of the buffer (0 = the server closed the connection)
+// and advances the framing. Returns 0 and sets *done once the message is complete, otherwise
+// 0 to keep reading or the error code for HTTPResponseInfo.error.
+static int receivedResponseData(HTTPResponseInfo* msg, HTTPReceiveState* state, size_t bytesRead, bool* done) {
+    HTTPResponseParser* parser = &state->parser;
+    *done = false;
+    if (bytesRead == 0) {
+        // the server closed the connection, which only ends a response without framing
+        if (parser->headerSize == 0) return msg->l4.totalSize == 0 ? -1 : -2;
+        if (parser->framing != HTTP_BODY_UNTIL_CLOSE) return -1;
+        msg->l7.keepAlive = false;
+    } else {
+        msg->l4.totalSize += bytesRead;
+        msg->l4.buffer[msg->l4.totalSize] = '\0';
+        HTTP_MARK_ONCE(&msg->timing, first_byte);
+        HTTP_COUNT(&msg->timing, bytes_received, bytesRead);
+
+        HTTPParseResult result = advanceHTTPResponse(msg, parser);
+        if (parser->headerSize) HTTP_MARK_ONCE(&msg->timing, headers);
+        if (result == HTTP_PARSE_BAD_HEADER) return -2;
+        if (result == HTTP_PARSE_BAD_CHUNK) return -3;
+        if (result != HTTP_PARSE_DONE) return 0;
+
+        if (state->keepSurplus && (size_t)msg->l4.totalSize > parser->messageSize) {
+            state->surplusSize = msg->l4.totalSize - parser->messageSize;
+            state->surplus = acquireBuffer(state->surplusSize);
+            if (!state->surplus) return -1;
+            memcpy(state->surplus, msg->l4.buffer + parser->messageSize, state->surplusSize);
+        }
+    }
+
+    finishHTTPMessage(msg, parser);
+    #ifdef HTTP_WITH_ZLIB
+    if (state->decompress) {
+        int error = inflateHTTPBody(msg, state);
+        if (error != 0) return error;
+    }
+    #endif
+    *done = true;
+    #ifdef DEBUG
+    printf("[receivedResponseData]: read result: \n--------Begin of content--------\n%s--------End of content--------\n", msg->l4.buffer);
+    printf("[receivedResponseData]: allocated buffer size: %d\n", msg->l4.bufferSize);
+    #endif
+    return 0;
+}
+
+// recv() for the blocking paths. With a deadline in rq (may be NULL) the socket is read without blocking
+// and waited for with poll(), -1 with errno ETIMEDOUT once the deadline has passed. TCP_QUICKACK is
+// re-armed after every read since the kernel clears it. With tlsConnection the data is read through it instead.
+static ssize_t receiveSocketData(int sd, HTTPTLSConnection* tlsConnection, void* buffer, size_t length, int flags, const HTTPRequestInfo* rq, HTTPRequestTiming* timing) {
+    long long deadline = rq ? rq->deadline : 0;
+    #ifdef HTTP_WITH_OPENSSL
+    if (tlsConnection) return receiveTLSData(tlsConnection, buffer, length, deadline, timing);
+    #else
+    (void)tlsConnection;
+    #endif
+    for (;;) {
+        ssize_t bytes = recv(sd, buffer, length, deadline ? MSG_DONTWAIT : flags);
+        HTTP_COUNT(timing, syscalls, 1);
+        if (rq && rq->socket_options.quick_ack) {
+            int one = 1, error = errno;
+            setsockopt(sd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+            errno = error;
+        }
+        if (bytes >= 0 || !deadline || (errno != EAGAIN && errno != EWOULDBLOCK)) return bytes;
+        int ready = waitSocket(sd, POLLIN, deadline, timing);
+        if (ready <= 0) {
+            if (ready == 0) errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+}
+
+// Error code of a failed receive: -5 when the deadline or the socket timeout (SO_RCVTIMEO) expired, -1 otherwise.
+static int receiveError(void) {
+    return errno == ETIMEDOUT || errno == EAGAIN || errno == EWOULDBLOCK ? -5 : -1;
+}
+
+// Reads data from the socket into the HTTPResponseInfo structure until the response is complete.
+// Every recv() asks for all the free space in the buffer, received data is never zeroed,
+// see reserveResponseBuffer() for how the buffer grows.
+// The response is framed while it arrives (Content-Length, chunked or end of stream), so reading stops
+// at the end of the message instead of waiting for the server to close the connection.
+// With carry (pipelining), *carry holds data already received from the connection that is used
+// before the socket, and is replaced by the data left over after this response (from acquireBuffer(), may be NULL).
+// With context, msg already holds the buffer of its previous response and the overflow policy applies.
+// rq (may be NULL) supplies the buffer sizing and the deadline.
+// Returns 0 or the error code for HTTPResponseInfo.error.
+static int readTCPRawData(int sd, HTTPTLSConnection* tlsConnection, HTTPResponseInfo* msg, const HTTPRequestInfo* rq, const HTTPResponseContext* context, char** carry, size_t* carrySize) {
+    if (!msg || sd < 0) return -1;
+    HTTPReceiveState state;
+    if (!beginResponseBuffer(msg, &state, rq)) return -1;
+    if (context) {
+        state.borrowed = context->storage;
+        state.fixedSize = context->overflow == HTTP_OVERFLOW_FAIL;
+    }
+    state.keepSurplus = carry != NULL;
+    size_t carryUsed = 0;
+
+    for (;;) {
+        bool waitAll;
+        size_t readSize = reserveResponseBuffer(msg, &state, &waitAll);
+        if (readSize == 0) return state.overflowed ? -6 : -1;
+
+        ssize_t bytesRead;
+        if (carry && carryUsed < *carrySize) {
+            bytesRead = *carrySize - carryUsed < readSize ? *carrySize - carryUsed : readSize;
+            memcpy(msg->l4.buffer + msg->l4.totalSize, *carry + carryUsed, bytesRead);
+            carryUsed += bytesRead;
+        } else {
+            bytesRead = receiveSocketData(sd, tlsConnection, msg->l4.buffer + msg->l4.totalSize, readSize, waitAll ? MSG_WAITALL : 0, rq, &msg->timing);
+        }
+        if (bytesRead < 0) {
+            if (errno == EINTR) continue; 
+            #ifdef DEBUG
+            printf("[readTCPRawData]: Read %d bytes from fd %d\n", (int)bytesRead, sd);
+            perror("[readTCPRawData]: Read failed");
+            #endif
+            return receiveError();
+        }
+
+        bool done;
+        int error = receivedResponseData(msg, &state, bytesRead, &done);
+        if (error != 0 || !done) {
+            if (error == 0) continue;
+            releaseBuffer(state.surplus);
+            return error;
+        }
+        if (!carry) return 0;
+
+        // hand the data after this response (surplus, then carry not used yet) to the next one
+        size_t left = *carrySize - carryUsed;
+        char* next = NULL;
+        if (state.surplusSize + left > 0) {
+            next = acquireBuffer(state.surplusSize + left);
+            if (!next) {
+                releaseBuffer(state.surplus);
+                return -1;
+            }
+            if (state.surplusSize) memcpy(next, state.surplus, state.surplusSize);
+            if (left) memcpy(next + state.surplusSize, *carry + carryUsed, left);
+        }
+        releaseBuffer(state.surplus);
+        releaseBuffer(*carry);
+        *carry = next;
+        *carrySize = state.surplusSize + left;
+        return 0;
+    }
+}
+
+// Body delivery state of FetchHTTPResponseStream().
+typedef struct {
+    const HTTPStreamCallbacks* callbacks;
+    long long delivered; // decoded body bytes passed to on_body
+    int error;           // error code when delivery stopped for another reason than on_body (-4)
+    #ifdef HTTP_WITH_ZLIB
+    int windowBits;      // of the Content-Encoding, 0 = passed through as received
+    bool inflating;      // inflater is initialized
+    bool inflated;       // the compressed stream has ended
+    long long compressed;
+    size_t maxDecompressed;
+    z_stream inflater;
+    #endif
+} HTTPStreamSink;
+
+static bool passStreamBody(HTTPStreamSink* sink, char* data, size_t length) {
+    if (length == 0) return true;
+    sink->delivered += length;
+    return !sink->callbacks->on_body || sink->callbacks->on_body(data, length, sink->callbacks->ctx);
+}
+
+#ifdef HTTP_WITH_ZLIB
+// Inflates a fragment of a compressed body through a small stack buffer and passes the output on,
+// so the body is never held in memory. The inflater is set up by the first fragment.
+static bool inflateStreamBody(HTTPStreamSink* sink, char* data, size_t length) {
+    z_stream* stream = &sink->inflater;
+    if (!sink->inflating) {
+        if (sink->windowBits == 15 && length >= 2) {
+            unsigned char b0 = data[0], b1 = data[1];
+            if ((b0 & 0x0F) != 8 || ((b0 << 8) | b1) % 31 != 0) sink->windowBits = -15;
+        }
+        if (inflateInit2(stream, sink->windowBits) != Z_OK) {
+            sink->error = -1;
+            return false;
+        }
+        sink->inflating = true;
+    }
+    sink->compressed += length;
+    if (sink->inflated) return true; // data after the end of the compressed stream is dropped
+
+    unsigned char output[4096];
+    stream->next_in = (Bytef*)data;
+    stream->avail_in = (uInt)length;
+    do {
+        stream->next_out = output;
+        stream->avail_out = sizeof(output);
+        int result = inflate(stream, Z_NO_FLUSH);
+        if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) {
+            sink->error = -7;
+            return false;
+        }
+        size_t produced = sizeof(output) - stream->avail_out;
+        if (stream->total_out > sink->maxDecompressed) {
+            sink->error = -7; // a decompression bomb
+            return false;
+        }
+        if (!passStreamBody(sink, (char*)output, produced)) return false;
+        if (result == Z_STREAM_END) sink->inflated = true;
+        if (result == Z_BUF_ERROR) break;
+    } while (!sink->inflated && (stream->avail_in > 0 || stream->avail_out == 0));
+    return true;
+}
+#endif
+
+static bool deliverStreamBody(char* data, size_t length, void* ctx) {
+    HTTPStreamSink* sink = ctx;
+    #ifdef HTTP_WITH_ZLIB
+    if (sink->windowBits != 0 && length > 0) return inflateStreamBody(sink, data, length);
+    #endif
+    return passStreamBody(sink, data, length);
+}
+
+// Passes the body that follows the headers in the window to sink, reading the rest through the window.
+// Returns 0 or the error code for HTTPResponseInfo.error.
+static int readStreamBody(int sd, HTTPTLSConnection* tlsConnection, HTTPResponseInfo* msg, const HTTPRequestInfo* rq, HTTPResponseParser* parser, HTTPStreamSink* sink) {
+    char* window = msg->l4.buffer + parser->headerSize;
+    size_t windowSize = HTTP_STREAM_WINDOW_SIZE - parser->headerSize;
+    size_t available = msg->l4.totalSize - parser->headerSize;
+    long long left = parser->framing == HTTP_BODY_LENGTH ? msg->l7.content_length : 0;
+    HTTPChunkDecoder decoder = {0};
+    if (parser->framing != HTTP_BODY_NONE && windowSize == 0) return -2;
+
+    while (parser->framing != HTTP_BODY_NONE) {
+        if (parser->framing == HTTP_BODY_CHUNKED) {
+            size_t used;
+            HTTPParseResult result = decodeChunks(&decoder, window, available, &used, deliverStreamBody, sink);
+            if (result == HTTP_PARSE_DONE) break;
+            if (result == HTTP_PARSE_BAD_CHUNK) return -3;
+            if (result == HTTP_PARSE_ABORTED) return sink->error ? sink->error : -4;
+        } else {
+            size_t n = available;
+            if (parser->framing == HTTP_BODY_LENGTH && n > (unsigned long long)left) n = left;
+            if (!deliverStreamBody(window, n, sink)) return sink->error ? sink->error : -4;
+            left -= n;
+            if (parser->framing == HTTP_BODY_LENGTH && left == 0) break;
+        }
+
+        size_t readSize = windowSize;
+        if (parser->framing == HTTP_BODY_LENGTH && (unsigned long long)left < readSize) readSize = left;
+        ssize_t bytesRead = receiveSocketData(sd, tlsConnection, window, readSize, 0, rq, &msg->timing);
+        available = 0;
+        if (bytesRead < 0) {
+            if (errno == EINTR) continue;
+            return receiveError();
+        } else if (bytesRead == 0) {
+            // the server closed the connection, which only ends a response without framing
+            if (parser->framing != HTTP_BODY_UNTIL_CLOSE) return -1;
+            msg->l7.keepAlive = false;
+            break;
+        }
+        HTTP_COUNT(&msg->timing, bytes_received, bytesRead);
+        available = bytesRead;
+    }
+
+    return 0;
+}
+
+// Receives the status line and headers into a new window of HTTP_STREAM_WINDOW_SIZE bytes, they have
+// to fit into it. Body data that arrives along with them stays behind the headers.
+// Returns 0 or the error code for HTTPResponseInfo.error.
+static int readStreamHeaders(int sd, HTTPTLSConnection* tlsConnection, HTTPResponseInfo* msg, const HTTPRequestInfo* rq, HTTPResponseParser* parser) {
+    msg->l4.buffer = (char*)acquireBuffer(HTTP_STREAM_WINDOW_SIZE + 1);
+    if (!msg->l4.buffer) return -1;
+    msg->l4.bufferSize = HTTP_STREAM_WINDOW_SIZE + 1;
+    msg->l4.totalSize = 0;
+
+    HTTPParseResult result = HTTP_PARSE_MORE;
+    while (result == HTTP_PARSE_MORE) {
+        if (msg->l4.totalSize == HTTP_STREAM_WINDOW_SIZE) return -2;
+        ssize_t bytesRead = receiveSocketData(sd, tlsConnection, msg->l4.buffer + msg->l4.totalSize, HTTP_STREAM_WINDOW_SIZE - msg->l4.totalSize, 0, rq, &msg->timing);
+        if (bytesRead < 0) {
+            if (errno == EINTR) continue;
+            return receiveError();
+        } else if (bytesRead == 0) {
+            return msg->l4.totalSize == 0 ? -1 : -2;
+        }
+        HTTP_MARK_ONCE(&msg->timing, first_byte);
+        HTTP_COUNT(&msg->timing, bytes_received, bytesRead);
+        msg->l4.totalSize += bytesRead;
+        msg->l4.buffer[msg->l4.totalSize] = '\0';
+        result = advanceHTTPHeaders(msg, parser);
+    }
+    if (result != HTTP_PARSE_DONE) return -2;
+    HTTP_MARK(&msg->timing, headers);
+    return 0;
+}
+
+// Sets up sink for the body of msg, which is inflated on the way when rq asks for decompression.
+static void beginStreamSink(HTTPStreamSink* sink, const HTTPStreamCallbacks* callbacks, const HTTPResponseInfo* msg, const HTTPRequestInfo* rq) {
+    memset(sink, 0, sizeof(*sink));
+    sink->callbacks = callbacks;
+    #ifdef HTTP_WITH_ZLIB
+    if (rq && rq->decompress) {
+        sink->windowBits = contentEncodingWindowBits(msg, NULL, 0);
+        sink->maxDecompressed = rq->max_decompressed_size ? rq->max_decompressed_size : rq->recv_buffer.max_size ? rq->recv_buffer.max_size : HTTP_RECV_MAX_SIZE;
+    }
+    #else
+    (void)msg;
+    (void)rq;
+    #endif
+}
+
+// Releases the inflater of sink and reports the encoding. error is the result of the body, a compressed
+// stream that did not end turns success into -7. Returns the final error code.
+static int endStreamSink(HTTPStreamSink* sink, HTTPResponseInfo* msg, int error) {
+    #ifdef HTTP_WITH_ZLIB
+    if (sink->inflating) {
+        inflateEnd(&sink->inflater);
+        if (error == 0 && !sink->inflated) error = -7; // truncated compressed stream
+        msg->encoding.decoded = true;
+        msg->encoding.compressed_bytes = sink->compressed;
+        msg->encoding.decompressed_bytes = sink->delivered;
+    }
+    #else
+    (void)sink;
+    (void)msg;
+    #endif
+    return error;
+}
+
+// Reads the response headers into a fixed window of HTTP_STREAM_WINDOW_SIZE bytes, then reuses the
+// rest of the window for the body, which is passed to the callbacks fragment by fragment
+// (chunked bodies already decoded). The headers stay in l4.buffer, the body is never kept.
+// Returns 0 or the error code for HTTPResponseInfo.error.
+static int readTCPStream(int sd, HTTPTLSConnection* tlsConnection, HTTPResponseInfo* msg, const HTTPRequestInfo* rq, const HTTPStreamCallbacks* callbacks) {
+    if (!msg || sd < 0 || !callbacks) return -1;
+
+    // 1. receive the status line and headers, they have to fit into the window
+    HTTPResponseParser parser = {0};
+    int error = readStreamHeaders(sd, tlsConnection, msg, rq, &parser);
+    if (error != 0) return error;
+    if (callbacks->on_headers && !callbacks->on_headers(msg, callbacks->ctx)) return -4;
+
+    // 2. pass the body through the rest of the window, starting with what arrived along with the headers
+    HTTPStreamSink sink;
+    beginStreamSink(&sink, callbacks, msg, rq);
+    error = endStreamSink(&sink, msg, readStreamBody(sd, tlsConnection, msg, rq, &parser, &sink));
+    if (error != 0) return error;
+
+    msg->l4.totalSize = parser.headerSize;
+    msg->l4.buffer[msg->l4.totalSize] = '\0';
+    msg->l7.content = NULL;
+    msg->l7.content_length = sink.delivered;
+    #ifdef DEBUG
+    printf("[readTCPStream]: delivered %lld body bytes\n", sink.delivered);
+    #endif
+    return 0;
+}
+
+// File side of DownloadHTTPFile(): where the next body byte goes and the sync and progress bookkeeping.
+typedef struct {
+    const HTTPDownloadOptions* options;
+    bool seekable;       // a file written at position, otherwise a pipe written in order
+    long long position;  // file offset of the next body byte
+    long long written;
+    long long total;     // size of the complete file, -1 if unknown
+    long long unsynced;  // bytes written since the last fdatasync()
+    int error;           // why writing stopped, -4 when on_progress asked to
+} HTTPDownloadState;
+
+// Accounts for bytes that reached the file, syncs by the policy and reports the progress.
+// Returns false to stop the download with download->error.
+static bool advanceDownload(HTTPDownloadState* download, size_t bytes) {
+    const HTTPDownloadOptions* options = download->options;
+    download->position += bytes;
+    download->written += bytes;
+    download->unsynced += bytes;
+    long long interval = options->fsync_bytes > 0 ? options->fsync_bytes : HTTP_FSYNC_BYTES;
+    if (options->fsync == HTTP_FSYNC_PERIODIC && download->unsynced >= interval) {
+        if (fdatasync(options->fd) < 0 && errno != EINVAL) {
+            download->error = -1;
+            return false;
+        }
+        download->unsynced = 0;
+    }
+    if (options->on_progress && !options->on_progress(download->position, download->total, options->ctx)) {
+        download->error = -4;
+        return false;
+    }
+    return true;
+}
+
+// on_body of the bounce window: writes a fragment (data that came with the headers, a chunked or
+// an inflated body) to the file.
+static bool writeDownloadBody(const char* data, size_t length, void* ctx) {
+    HTTPDownloadState* download = ctx;
+    while (length > 0) {
+        ssize_t bytes = download->seekable ? pwrite(download->options->fd, data, length, download->position) : write(download->options->fd, data, length);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) {
+            download->error = -1;
+            return false;
+        }
+        data += bytes;
+        length -= bytes;
+        if (!advanceDownload(download, bytes)) return false;
+    }
+    return true;
+}
+
+// Moves left bytes of the body from the socket to the file through a pipe with splice(), so the data never
+// enters user space and memory stays constant. With a deadline the socket is read without blocking.
+// Returns 0 or the error code for HTTPResponseInfo.error.
+static int spliceDownloadBody(int sd, HTTPResponseInfo* msg, const HTTPRequestInfo* rq, HTTPDownloadState* download, long long left) {
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) < 0) return -1;
+    fcntl(pipefd[1], F_SETPIPE_SZ, HTTP_SPLICE_PIPE_SIZE); // may be refused (pipe-max-size), any size works
+    int flags = fcntl(sd, F_GETFL);
+    if (rq->deadline) fcntl(sd, F_SETFL, flags | O_NONBLOCK);
+
+    int error = 0;
+    while (left > 0 && error == 0) {
+        ssize_t bytes = splice(sd, NULL, pipefd[1], NULL, left < HTTP_SPLICE_PIPE_SIZE ? (size_t)left : HTTP_SPLICE_PIPE_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE);
+        HTTP_COUNT(&msg->timing, syscalls, 1);
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            if (rq->deadline && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                int ready = waitSocket(sd, POLLIN, rq->deadline, &msg->timing);
+                if (ready > 0) continue;
+                error = ready == 0 ? -5 : -1;
+            } else {
+                error = receiveError();
+            }
+            break;
+        } else if (bytes == 0) {
+            error = -1; // the server closed the connection before the end of the body
+            break;
+        }
+        HTTP_COUNT(&msg->timing, bytes_received, bytes);
+        left -= bytes;
+
+        // drain the pipe into the file
+        while (bytes > 0) {
+            loff_t position = download->position;
+            ssize_t moved = splice(pipefd[0], NULL, download->options->fd, download->seekable ? &position : NULL, bytes, SPLICE_F_MOVE | (left > 0 ? SPLICE_F_MORE : 0));
+            HTTP_COUNT(&msg->timing, syscalls, 1);
+            if (moved < 0 && errno == EINTR) continue;
+            if (moved <= 0) {
+                error = -1;
+                break;
+            }
+            bytes -= moved;
+            if (!advanceDownload(download, moved)) {
+                error = download->error;
+                break;
+            }
+        }
+    }
+
+    if (rq->deadline) fcntl(sd, F_SETFL, flags);
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return error;
+}
+
+// Reads "bytes first-last/size" of a Content-Range header, *size is -1 for "*".
+static bool parseContentRange(const char* value, long long* first, long long* size) {
+    char* end;
+    if (!value || strncasecmp(value, "bytes ", 6) != 0) return false;
+    value += 6;
+    if (*value == '*') {
+        *first = -1;
+    } else {
+        *first = strtoll(value, &end, 10);
+        if (end == value || *end != '-' || *first < 0) return false;
+    }
+    value = strchr(value, '/');
+    if (!value) return false;
+    value++;
+    if (*value == '*') {
+        *size = -1;
+        return true;
+    }
+    *size = strtoll(value, &end, 10);
+    return end != value && *size >= 0;
+}
+
+// Reads the response headers into the streaming window and writes the body of a 200 or 206 response into
+// options->fd: spliced with a Content-Length, through the window otherwise. Any other body is discarded.
+// With partial a 200 response fails with -2 after the headers, its body would overwrite the file from offset 0.
+// Returns 0 or the error code for HTTPResponseInfo.error.
+static int readTCPFile(int sd, HTTPTLSConnection* tlsConnection, HTTPResponseInfo* msg, const HTTPRequestInfo* rq, const HTTPDownloadOptions* options, bool partial) {
+    if (!msg || sd < 0 || !options) return -1;
+    HTTPResponseParser parser = {0};
+    int error = readStreamHeaders(sd, tlsConnection, msg, rq, &parser);
+    if (error != 0) return error;
+
+    HTTPDownloadState download = { .options = options, .total = -1 };
+    download.seekable = lseek(options->fd, 0, SEEK_CUR) >= 0;
+    int status = msg->l7.status_code;
+    if (partial && status == 200) return -2;
+    bool store = status == 200 || status == 206;
+    if (status == 206 || status == 416) {
+        long long first;
+        if (!parseContentRange(GetHTTPHeader(msg, "Content-Range"), &first, &download.total) || (status == 206 && first < 0)) return -2;
+        if (status == 206) download.position = download.seekable ? first : 0;
+    } else if (status == 200 && parser.framing == HTTP_BODY_LENGTH) {
+        download.total = msg->l7.content_length;
+    }
+    msg->download.offset = store ? download.position : 0;
+    msg->download.size = download.total;
+    #ifdef DEBUG
+    printf("[readTCPFile]: status %d, writing %s at %lld of %lld\n", status, store ? "the body" : "nothing", download.position, download.total);
+    #endif
+
+    // data that came along with the headers goes through the window, a plain body is spliced after it
+    HTTPStreamCallbacks callbacks = { NULL, store ? writeDownloadBody : NULL, &download };
+    HTTPStreamSink sink;
+    beginStreamSink(&sink, &callbacks, msg, rq);
+    bool splicing = store && parser.framing == HTTP_BODY_LENGTH && !tlsConnection; // TLS is decrypted in user space
+    #ifdef HTTP_WITH_ZLIB
+    if (sink.windowBits != 0) {
+        splicing = false;
+        download.total = msg->download.size = -1; // the inflated size is not known in advance
+    }
+    #endif
+    if (splicing) {
+        size_t available = msg->l4.totalSize - parser.headerSize;
+        long long left = msg->l7.content_length;
+        if (available > (unsigned long long)left) available = left;
+        if (!deliverStreamBody(msg->l4.buffer + parser.headerSize, available, &sink)) error = download.error;
+        else error = spliceDownloadBody(sd, msg, rq, &download, left - available);
+    } else {
+        error = readStreamBody(sd, tlsConnection, msg, rq, &parser, &sink);
+        if (error == -4 && download.error) error = download.error;
+    }
+    error = endStreamSink(&sink, msg, error);
+    msg->download.written = download.written;
+    if (error != 0) return error;
+
+    if (store && download.seekable && status == 200) {
+        struct stat info;
+        if (fstat(options->fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > download.position && ftruncate(options->fd, download.position) < 0) return -1;
+    }
+    if (store && options->fsync != HTTP_FSYNC_NONE && download.unsynced > 0 && fdatasync(options->fd) < 0 && errno != EINVAL) return -1;
+
+    msg->l4.totalSize = parser.headerSize;
+    msg->l4.buffer[msg->l4.totalSize] = '\0';
+    msg->l7.content = NULL;
+    msg->l7.content_length = download.written;
+    #ifdef DEBUG
+    printf("[readTCPFile]: wrote %lld body bytes\n", download.written);
+    #endif
+    return 0;
+}
+
+// A request head as fragments for sendmsg(): the request line and the fixed headers come from a
+// prepared block or from buffer / allocated, path, cookie, body framing and Range are patched in per send.
+typedef struct {
+    struct iovec iov[HTTP_HEAD_PARTS + 1]; // one more for the body
+    int count;
+    size_t length;      // bytes in the head fragments
+    char tail[112];     // end of the Cookie line, Content-Length or Transfer-Encoding, Range and the blank line
+    char* allocated;    // block that did not fit in buffer
+    char buffer[1024];  // block of an unprepared request
+} HTTPRequestHead;
+
+static bool isHeaderToken(const char* s, bool value) {
+    if (!s || (!value && !*s)) return false;
+    for (; *s; s++) {
+        if (*s == '\r' || *s == '\n' || (!value && (*s == ':' || *s == ' '))) return false;
+    }
+    return true;
+}
+
+// A request target is sent as is, so it must not hold spaces or control characters that would end the request line.
+static bool isRequestTarget(const char* s) {
+    if (!*s) return false;
+    for (; *s; s++) {
+        if ((unsigned char)*s <= ' ' || *s == 0x7f) return false;
+    }
+    return true;
+}
+
+static char* appendHeadText(char* out, const char* text) {
+    size_t length = strlen(text);
+    memcpy(out, text, length);
+    return out + length;
+}
+
+static char* appendHeadNumber(char* out, unsigned long long value) {
+    char digits[24];
+    int n = 0;
+    do digits[n++] = '0' + value % 10; while (value /= 10);
+    while (n > 0) *out++ = digits[--n];
+    return out;
+}
+
+// Serializes the part of the head that does not change between sends into buffer, or only measures it
+// when buffer is NULL. Returns its length, or 0 if a field is invalid.
+static size_t formatHTTPHeadBlock(const HTTPRequestInfo* rq, char* buffer) {
+    if (rq->method < 0 || rq->method >= HTTP_METHOD_MAX) return 0;
+    if (rq->content_type < 0 || rq->content_type >= CONTENT_TYPE_MAX) return 0;
+    if (!isHeaderToken(rq->host, true) || rq->header_count < 0 || (rq->header_count && !rq->headers)) return 0;
+    for (int i = 0; i < rq->header_count; i++) {
+        if (!isHeaderToken(rq->headers[i].name, false) || !isHeaderToken(rq->headers[i].value, true)) return 0;
+    }
+
+    const char* parts[] = {
+        " HTTP/1.1\r\nHost: ", rq->host,
+        "\r\nAccept: */*\r\nAccept-Language: en-US\r\nUser-Agent: "HTTP_USER_AGENT"\r\nContent-Type: ",
+        HTTPContentTypeString[rq->content_type], "\r\n"
+    };
+    size_t length = 0;
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) length += strlen(parts[i]);
+    for (int i = 0; i < rq->header_count; i++) length += strlen(rq->headers[i].name) + 2 + strlen(rq->headers[i].value) + 2;
+    if (!buffer) return length;
+
+    char* out = buffer;
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) out = appendHeadText(out, parts[i]);
+    for (int i = 0; i < rq->header_count; i++) {
+        out = appendHeadText(out, rq->headers[i].name);
+        out = appendHeadText(out, ": ");
+        out = appendHeadText(out, rq->headers[i].value);
+        out = appendHeadText(out, "\r\n");
+    }
+    return length;
+}
+
+HTTPPreparedRequest* PrepareHTTPRequest(const HTTPRequestInfo* rq) {
+    if (!rq) return NULL;
+    size_t length = formatHTTPHeadBlock(rq, NULL);
+    if (length == 0) return NULL;
+    HTTPPreparedRequest* prepared = calloc(1, sizeof(HTTPPreparedRequest));
+    if (!prepared) return NULL;
+    prepared->block = malloc(length);
+    prepared->host = strdup(rq->host);
+    if (!prepared->block || !prepared->host) {
+        FreeHTTPPreparedRequest(prepared);
+        return NULL;
+    }
+    prepared->method = rq->method;
+    prepared->blockLength = formatHTTPHeadBlock(rq, prepared->block);
+    return prepared;
+}
+
+void FreeHTTPPreparedRequest(HTTPPreparedRequest* prepared) {
+    if (!prepared) return;
+    free(prepared->block);
+    free(prepared->host);
+    free(prepared);
+}
+
+static void addHeadPart(HTTPRequestHead* head, const char* data, size_t length) {
+    head->iov[head->count++] = (struct iovec){ .iov_base = (void*)data, .iov_len = length };
+    head->length += length;
+}
+
+// Lays out the head of rq (from rq->prepared when set), asking the server to keep the connection open
+// with keepAlive. Returns false if rq is invalid or memory runs out, endRequestHead() must be called otherwise.
+static bool beginRequestHead(HTTPRequestHead* head, HTTPRequestInfo* rq, bool keepAlive) {
+    head->count = 0;
+    head->length = 0;
+    head->allocated = NULL;
+    if (!rq->query || (!rq->prepared && !rq->host)) return false;
+    const char* cookie = rq->cookie ? rq->cookie : "";
+    if (!isRequestTarget(rq->query) || !isHeaderToken(cookie, true)) return false;
+
+    HTTPMethod method;
+    const char* block;
+    size_t blockLength;
+    if (rq->prepared) {
+        method = rq->prepared->method;
+        block = rq->prepared->block;
+        blockLength = rq->prepared->blockLength;
+    } else {
+        blockLength = formatHTTPHeadBlock(rq, NULL);
+        if (blockLength == 0) return false;
+        if (blockLength > sizeof(head->buffer)) {
+            head->allocated = acquireBuffer(blockLength);
+            if (!head->allocated) return false;
+        }
+        block = head->allocated ? head->allocated : head->buffer;
+        formatHTTPHeadBlock(rq, (char*)block);
+        method = rq->method;
+    }
+
+    char* tail = head->tail;
+    tail = appendHeadText(tail, "\r\n");
+    long long contentLength = rq->body ? (rq->body->produce ? -1 : rq->body->length) : rq->data ? rq->data_length : -1;
+    if (rq->body && rq->body->produce) {
+        tail = appendHeadText(tail, "Transfer-Encoding: chunked\r\n");
+    } else if (contentLength >= 0) {
+        tail = appendHeadText(tail, "Content-Length: ");
+        tail = appendHeadNumber(tail, (unsigned long long)contentLength);
+        tail = appendHeadText(tail, "\r\n");
+    }
+    if (rq->range_length != 0 && rq->range_from >= 0) {
+        tail = appendHeadText(tail, "Range: bytes=");
+        tail = appendHeadNumber(tail, (unsigned long long)rq->range_from);
+        *tail++ = '-';
+        if (rq->range_length > 0) tail = appendHeadNumber(tail, (unsigned long long)(rq->range_from + rq->range_length - 1));
+        tail = appendHeadText(tail, "\r\n");
+    }
+    tail = appendHeadText(tail, "\r\n");
+
+    // Accept-Encoding shares the fragment of the Connection line
+    static const char* const connectionLines[2][2] = {
+        { "Connection: close\r\n", "Connection: keep-alive\r\n" },
+        { "Accept-Encoding: gzip, deflate\r\nConnection: close\r\n", "Accept-Encoding: gzip, deflate\r\nConnection: keep-alive\r\n" },
+    };
+    bool acceptEncoding = false;
+    #ifdef HTTP_WITH_ZLIB
+    acceptEncoding = rq->decompress;
+    #endif
+    const char* connection = connectionLines[acceptEncoding][keepAlive];
+    addHeadPart(head, HTTPMethodString[method], strlen(HTTPMethodString[method]));
+    addHeadPart(head, " ", 1);
+    addHeadPart(head, rq->query, strlen(rq->query));
+    addHeadPart(head, block, blockLength);
+    addHeadPart(head, connection, strlen(connection));
+    addHeadPart(head, "Cookie: ", 8);
+    addHeadPart(head, cookie, strlen(cookie));
+    addHeadPart(head, head->tail, tail - head->tail);
+    #ifdef DEBUG
+    printf("[beginRequestHead]: about to send http request:\n--------Begin of content--------\n");
+    for (int i = 0; i < head->count; i++) fwrite(head->iov[i].iov_base, 1, head->iov[i].iov_len, stdout);
+    printf("--------End of content--------\n");
+    #endif
+    return true;
+}
+
+static void endRequestHead(HTTPRequestHead* head) {
+    releaseBuffer(head->allocated);
+    head->allocated = NULL;
+}
+
+// Sends rq->body after the head: the file range, or the producer's output as chunks of up to
+// HTTP_BODY_CHUNK_SIZE bytes, each in one send with MSG_MORE until the last.
+static bool sendRequestBody(int sd, HTTPTLSConnection* tlsConnection, HTTPRequestInfo* rq) {
+    const HTTPRequestBody* body = rq->body;
+    if (body->produce) {
+        char chunk[HTTP_CHUNK_FRAME + HTTP_BODY_CHUNK_SIZE + 2];
+        bool last = false;
+        while (!last) {
+            size_t start, size;
+            if (!produceBodyChunk(body, chunk, &start, &size, &last)) return false;
+            struct iovec iov = { .iov_base = chunk + start, .iov_len = size };
+            if (!sendTCPRawData(sd, tlsConnection, &iov, 1, &rq->timing, rq->deadline, last ? 0 : MSG_MORE)) return false;
+        }
+        return true;
+    }
+
+    for (long long done = 0; done < body->length; ) {
+        ssize_t bytes = sendFileData(sd, tlsConnection, body, done, rq->deadline, &rq->timing);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // SO_SNDTIMEO expired, wait until the request deadline if there is one
+            if (waitSocket(sd, POLLOUT, rq->deadline ? rq->deadline : monotonicMs() + HTTP_SEND_WAIT_MS, &rq->timing) > 0) continue;
+            return false;
+        }
+        if (bytes <= 0) return false; // the file is shorter than body->length
+        done += bytes;
+    }
+    return true;
+}
+
+// Writes the head and the body of rq in one gathered send, a streamed body follows the head.
+static bool sendRequestHead(int sd, HTTPTLSConnection* tlsConnection, const HTTPRequestHead* head, HTTPRequestInfo* rq) {
+    struct iovec iov[HTTP_HEAD_PARTS + 1];
+    memcpy(iov, head->iov, head->count * sizeof(struct iovec));
+    int count = head->count;
+    bool streamBody = rq->body && (rq->body->produce || rq->body->length > 0);
+    if (!rq->body && rq->data_length > 0 && rq->data) iov[count++] = (struct iovec){ .iov_base = rq->data, .iov_len = rq->data_length };
+    if (!sendTCPRawData(sd, tlsConnection, iov, count, &rq->timing, rq->deadline, streamBody ? MSG_MORE : 0)) return false;
+    return !streamBody || sendRequestBody(sd, tlsConnection, rq);
+}
+
+// Sends an HTTP request with the specified method (GET, POST, etc.) and headers.
+// Includes optional body data if present.
+// Sends the request in raw TCP format. With allowReuse the socket is taken from rq->pool when possible,
+// and a reused socket that fails while sending is replaced by a new one once.
+static int sendHTTPRequest(HTTPRequestInfo* rq, bool allowReuse) {
+    if (!rq) return -1;
+    rq->sd = -1;
+    rq->tls_connection = NULL;
+    rq->reused = false;
+    if (allowReuse) {
+        // a resend keeps accumulating into the timing and the deadline of the original request
+        memset(&rq->timing, 0, sizeof(rq->timing));
+        HTTP_MARK(&rq->timing, start);
+        rq->deadline = rq->socket_options.deadline_ms > 0 ? monotonicMs() + rq->socket_options.deadline_ms : 0;
+    }
+
+    HTTPRequestHead head;
+    if (!beginRequestHead(&head, rq, rq->pool != NULL)) return -1;
+
+    if (rq->pool && allowReuse) rq->reused = acquirePooledConnection(rq->pool, rq);
+    if (rq->reused) HTTP_MARK(&rq->timing, connected);
+    bool timedOut = false;
+    for (;;) {
+        if (!rq->reused && !createTCPSocket(rq)) { // no manually creating socket needed
+            timedOut = errno == ETIMEDOUT;
+            break;
+        }
+        if (sendRequestHead(rq->sd, rq->tls_connection, &head, rq)) {
+            HTTP_MARK(&rq->timing, sent);
+            endRequestHead(&head);
+            return 0;
+        }
+
+        bool dropped = errno == EPIPE || errno == ECONNRESET;
+        closeConnection(rq->sd, rq->tls_connection);
+        rq->sd = -1;
+        rq->tls_connection = NULL;
+        if (!rq->reused || !dropped || !requestReplayable(rq)) break;
+        // the server closed the idle connection, retry once on a new socket
+        rq->reused = false;
+        recordPoolRetry(rq->pool);
+    }
+    endRequestHead(&head);
+    return timedOut || requestExpired(rq) ? -5 : -1;
+}
+
+int SendHTTPRequest(HTTPRequestInfo* rq) {
+    return sendHTTPRequest(rq, true);
+}
+
+// Where receiveHTTPResponse() puts the body, at most one of them is set.
+typedef struct {
+    const HTTPStreamCallbacks* callbacks; // streamed through the window
+    const HTTPResponseContext* context;   // buffered into reused memory
+    const HTTPDownloadOptions* download;  // written to a file
+    bool partial;                         // download: only a 206 body is written, for segments
+} HTTPResponseTarget;
+
+static int readResponse(HTTPRequestInfo* rq, HTTPResponseInfo* msg, const HTTPResponseTarget* target) {
+    if (target->download) return readTCPFile(rq->sd, rq->tls_connection, msg, rq, target->download, target->partial);
+    if (target->callbacks) return readTCPStream(rq->sd, rq->tls_connection, msg, rq, target->callbacks);
+    return readTCPRawData(rq->sd, rq->tls_connection, msg, rq, target->context, NULL, NULL);
+}
+
+// Reads the response to rq into msg: into l4.buffer, through the streaming window or into a file, see target.
+// Pooled keep-alive sockets are handed back to rq->pool when the response is complete and the server allows it.
+static void receiveHTTPResponse(HTTPRequestInfo* rq, HTTPResponseInfo* msg, const HTTPResponseTarget* target) {
+    msg->error = 0;
+    msg->l7.chunkedTransfer = false;
+    msg->l7.content_length = -1;
+    msg->timing = rq->timing;
+    if (rq->sd < 0) {
+        msg->error = requestExpired(rq) ? -5 : -1;
+        recordHTTPMetrics(rq, msg);
+        return;
+    }
+
+    msg->error = readResponse(rq, msg, target);
+    if (msg->error == -1 && reusedConnectionDropped(rq, msg)) {
+        // a reused socket was closed (or reset) by the server before it answered, resend once on a new socket
+        if (!target->context) {
+            releaseBuffer(msg->l4.buffer);
+            msg->l4.buffer = NULL;
+        }
+        closeConnection(rq->sd, rq->tls_connection);
+        recordPoolRetry(rq->pool);
+        rq->timing = msg->timing;
+        int resent = sendHTTPRequest(rq, false);
+        msg->timing = rq->timing;
+        if (resent != 0) msg->error = resent;
+        else msg->error = readResponse(rq, msg, target);
+    }
+    if (rq->sd >= 0) {
+        if (rq->pool && msg->error == 0 && msg->l7.keepAlive) {
+            releasePooledConnection(rq->pool, rq);
+        } else {
+            closeConnection(rq->sd, rq->tls_connection);
+            rq->sd = -1;
+            rq->tls_connection = NULL;
+        }
+    }
+    recordHTTPMetrics(rq, msg);
+}
+
+static HTTPResponseInfo* fetchHTTPResponse(HTTPRequestInfo* rq, const HTTPStreamCallbacks* callbacks) {
+    HTTPResponseInfo* msg = acquireResponse();
+    if (!msg) return NULL;
+    HTTPResponseTarget target = { .callbacks = callbacks };
+    receiveHTTPResponse(rq, msg, &target);
+    return msg;
+}
+
+// Reads and parses the HTTP response after sending an HTTP request.
+// Handles both normal and chunked transfer responses.
+HTTPResponseInfo* FetchHTTPResponse(HTTPRequestInfo* rq) {
+    return fetchHTTPResponse(rq, NULL);
+}
+
+HTTPResponseInfo* FetchHTTPResponseStream(HTTPRequestInfo* rq, const HTTPStreamCallbacks* callbacks) {
+    if (!callbacks) return NULL;
+    return fetchHTTPResponse(rq, callbacks);
+}
+
+// The buffer (caller storage, or the heap buffer of an earlier response) and the header index of the
+// previous response are kept, everything else starts over.
+int FetchHTTPResponseInto(HTTPRequestInfo* rq, HTTPResponseContext* ctx) {
+    if (!rq || !ctx) return -1;
+    HTTPResponseInfo* msg = &ctx->response;
+    char* buffer = msg->l4.buffer;
+    int bufferSize = msg->l4.bufferSize;
+    HTTPHeaderSpan* spans = msg->headers.spans;
+    int capacity = msg->headers.capacity;
+    if (!buffer && ctx->storage && ctx->storage_size >= 2) {
+        buffer = ctx->storage;
+        bufferSize = ctx->storage_size > INT_MAX ? INT_MAX : (int)ctx->storage_size;
+    }
+
+    memset(msg, 0, sizeof(*msg));
+    msg->l4.buffer = buffer;
+    msg->l4.bufferSize = bufferSize;
+    msg->headers.spans = spans;
+    msg->headers.capacity = capacity;
+    HTTPResponseTarget target = { .context = ctx };
+    receiveHTTPResponse(rq, msg, &target);
+    return msg->error;
+}
+
+// Resuming asks for the bytes from the current size of the file on, the response then says where its body goes.
+HTTPResponseInfo* DownloadHTTPFile(HTTPRequestInfo* rq, const HTTPDownloadOptions* options) {
+    if (!rq || !options || options->fd < 0) return NULL;
+    HTTPResponseInfo* msg = acquireResponse();
+    if (!msg) return NULL;
+    if (options->resume) {
+        struct stat info;
+        if (fstat(options->fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+            rq->range_from = info.st_size;
+            rq->range_length = -1;
+        }
+    }
+
+    int error = sendHTTPRequest(rq, true);
+    if (error != 0) {
+        msg->timing = rq->timing;
+        msg->error = error;
+        recordHTTPMetrics(rq, msg);
+        return msg;
+    }
+    HTTPResponseTarget target = { .download = options };
+    receiveHTTPResponse(rq, msg, &target);
+    return msg;
+}
+
+// Shared state of DownloadHTTPSegmented(). Segment 0 is the first request, the threads take the others in order.
+typedef struct {
+    HTTPRequestInfo* rq;
+    const HTTPSegmentedDownloadOptions* options;
+    pthread_mutex_t lock;
+    long long segmentSize;
+    long long total;     // size of the resource, -1 until known
+    long long received;  // bytes in place
+    int segments;
+    int next;            // next segment to fetch
+    int retries;
+    int error;           // set by the first segment that failed for good, stops the others
+} HTTPSegmentedDownload;
+
+// One attempt at a segment.
+typedef struct {
+    HTTPSegmentedDownload* download;
+    long long start;
+    long long length;    // 0 = no Range header (a pipe)
+    long long received;  // bytes of this attempt in place
+    bool store;          // the buffer takes the body of this response
+    int error;           // why the buffer callbacks stopped, replaces the error of the response
+} HTTPSegment;
+
+// Accounts for bytes of a segment that are in place and reports the progress with the size of the resource
+// once known (total < 0 = not known to the caller). Returns false to stop the segment.
+static bool advanceSegment(HTTPSegment* segment, long long bytes, long long total) {
+    HTTPSegmentedDownload* download = segment->download;
+    const HTTPSegmentedDownloadOptions* options = download->options;
+    pthread_mutex_lock(&download->lock);
+    if (download->total < 0) download->total = total;
+    segment->received += bytes;
+    download->received += bytes;
+    bool proceed = download->error == 0;
+    if (proceed && options->on_progress && !options->on_progress(download->received, download->total, options->ctx)) {
+        download->error = -4;
+        proceed = false;
+    }
+    pthread_mutex_unlock(&download->lock);
+    return proceed;
+}
+
+// on_progress of a segment written to the file, position is the file offset reached.
+static bool advanceSegmentFile(long long position, long long total, void* ctx) {
+    HTTPSegment* segment = ctx;
+    return advanceSegment(segment, position - segment->start - segment->received, total);
+}
+
+// on_headers of a segment copied into the buffer: a 206 must start at the segment, a 200 is only taken as the
+// answer to the first request and everything must fit. Other statuses are kept without their body.
+static bool checkSegmentHeaders(const HTTPResponseInfo* msg, void* ctx) {
+    HTTPSegment* segment = ctx;
+    HTTPSegmentedDownload* download = segment->download;
+    long long first = 0, total = -1;
+    int status = msg->l7.status_code;
+    if (status == 206) {
+        if (!parseContentRange(GetHTTPHeader(msg, "Content-Range"), &first, &total) || first != segment->start) segment->error = -2;
+    } else if (status == 200) {
+        if (segment->start != 0) segment->error = -2;
+        total = msg->l7.content_length;
+    }
+    if (segment->error == 0 && total > (long long)download->options->buffer_size) segment->error = -6;
+    if (segment->error != 0) return false;
+    segment->store = status == 200 || status == 206;
+    pthread_mutex_lock(&download->lock);
+    if (download->total < 0) download->total = total;
+    pthread_mutex_unlock(&download->lock);
+    return true;
+}
+
+// on_body of a segment copied into the buffer at its offset.
+static bool copySegmentBody(const char* data, size_t length, void* ctx) {
+    HTTPSegment* segment = ctx;
+    HTTPSegmentedDownload* download = segment->download;
+    if (!segment->store) return true;
+    long long position = segment->start + segment->received;
+    if (position + (long long)length > (long long)download->options->buffer_size) {
+        segment->error = -6;
+        return false;
+    }
+    memcpy(download->options->buffer + position, data, length);
+    return advanceSegment(segment, length, -1);
+}
+
+// Sends the Range request of a segment on a connection of its own (or one from rq->pool) and puts the body in
+// place: spliced into the file, or copied into the buffer. Only the first segment may be answered with 200.
+static HTTPResponseInfo* fetchSegment(HTTPSegment* segment) {
+    HTTPSegmentedDownload* download = segment->download;
+    HTTPRequestInfo rq = *download->rq;
+    rq.range_from = segment->start;
+    rq.range_length = segment->length;
+    rq.decompress = false; // ranges are offsets into the encoded body
+    HTTPResponseInfo* msg = acquireResponse(); // a slot with HTTP_STATIC, one per connection is in use at once
+    if (!msg) return NULL;
+
+    int error = sendHTTPRequest(&rq, true);
+    if (error != 0) {
+        msg->timing = rq.timing;
+        msg->error = error;
+        recordHTTPMetrics(&rq, msg);
+        return msg;
+    }
+    HTTPDownloadOptions file = { .fd = download->options->fd, .on_progress = advanceSegmentFile, .ctx = segment };
+    HTTPStreamCallbacks callbacks = { checkSegmentHeaders, copySegmentBody, segment };
+    HTTPResponseTarget target = { .partial = segment->start != 0 };
+    if (download->options->fd >= 0) target.download = &file;
+    else target.callbacks = &callbacks;
+    receiveHTTPResponse(&rq, msg, &target);
+    if (segment->error != 0) msg->error = segment->error;
+    return msg;
+}
+
+// Whether a segment response put the whole segment at its offset.
+static bool segmentComplete(const HTTPSegment* segment, const HTTPResponseInfo* msg) {
+    if (msg->l7.status_code != 206 || segment->received != segment->length) return false;
+    return segment->download->options->fd < 0 || msg->download.offset == segment->start;
+}
+
+// Fetches a segment, again up to download->retries times after an IO error or a timeout, and for any segment but
+// the first also after a response that did not bring the whole segment (except a 200, ranges are not served).
+// Returns the response of the last attempt, NULL on allocation failure.
+static HTTPResponseInfo* retrySegment(HTTPSegment* segment, bool first) {
+    HTTPSegmentedDownload* download = segment->download;
+    HTTPResponseInfo* msg = NULL;
+    for (int attempt = 0; attempt <= download->retries; attempt++) {
+        if (msg) {
+            // the part of the failed attempt is written again
+            FreeHTTPResponseResource(msg);
+            pthread_mutex_lock(&download->lock);
+            download->received -= segment->received;
+            pthread_mutex_unlock(&download->lock);
+            segment->received = 0;
+            segment->error = 0;
+        }
+        msg = fetchSegment(segment);
+        if (!msg) return NULL;
+        bool failed = msg->error == -1 || msg->error == -5;
+        if (!first && msg->error == 0 && msg->l7.status_code != 200) failed = !segmentComplete(segment, msg);
+        #ifdef DEBUG
+        printf("[retrySegment]: segment at %lld, attempt %d, error %d, status %d\n", segment->start, attempt, msg->error, msg->l7.status_code);
+        #endif
+        pthread_mutex_lock(&download->lock);
+        bool stopped = download->error != 0;
+        pthread_mutex_unlock(&download->lock);
+        if (!failed || stopped) break;
+    }
+    return msg;
+}
+
+// Download thread: fetches the next segment until none is left or one failed for good.
+static void* downloadSegments(void* arg) {
+    HTTPSegmentedDownload* download = arg;
+    for (;;) {
+        pthread_mutex_lock(&download->lock);
+        int index = download->error == 0 && download->next < download->segments ? download->next++ : -1;
+        pthread_mutex_unlock(&download->lock);
+        if (index < 0) return NULL;
+
+        HTTPSegment segment = { .download = download, .start = index * download->segmentSize };
+        segment.length = download->total - segment.start < download->segmentSize ? download->total - segment.start : download->segmentSize;
+        HTTPResponseInfo* msg = retrySegment(&segment, false);
+        int error = !msg ? -1 : msg->error != 0 ? msg->error : segmentComplete(&segment, msg) ? 0 : -2;
+        FreeHTTPResponseResource(msg);
+        if (error != 0) {
+            pthread_mutex_lock(&download->lock);
+            if (download->error == 0) download->error = error;
+            pthread_mutex_unlock(&download->lock);
+            return NULL;
+        }
+    }
+}
+
+HTTPResponseInfo* DownloadHTTPSegmented(HTTPRequestInfo* rq, const HTTPSegmentedDownloadOptions* options) {
+    if (!rq || !options || (options->fd < 0 && !options->buffer)) return NULL;
+    HTTPSegmentedDownload download = { .rq = rq, .options = options, .total = -1 };
+    download.segmentSize = options->segment_size > 0 ? options->segment_size : HTTP_SEGMENT_SIZE;
+    download.retries = options->retries < 0 ? 0 : options->retries > 0 ? options->retries : 2;
+    if (pthread_mutex_init(&download.lock, NULL) != 0) return NULL;
+
+    // the first segment tells the size and whether the server serves ranges, a pipe takes the body in one stream
+    HTTPSegment first = { .download = &download, .length = download.segmentSize };
+    if (options->fd >= 0 && lseek(options->fd, 0, SEEK_CUR) < 0) first.length = 0;
+    HTTPResponseInfo* msg = retrySegment(&first, true);
+    if (!msg) {
+        pthread_mutex_destroy(&download.lock);
+        return NULL;
+    }
+    if (options->fd >= 0) download.total = msg->download.size;
+    bool segmented = msg->error == 0 && msg->l7.status_code == 206;
+    if (download.total >= 0 && first.length > download.total) first.length = download.total;
+    if (segmented && (download.total < 0 || !segmentComplete(&first, msg))) {
+        msg->error = -2; // no size in Content-Range, or not the range asked for
+        segmented = false;
+    }
+    if (segmented && options->fd >= 0) {
+        // the size of the resource, allocated up front where the filesystem can
+        if (ftruncate(options->fd, download.total) < 0) msg->error = -1;
+        else if (download.total > 0) fallocate(options->fd, 0, 0, download.total);
+    }
+
+    if (segmented && msg->error == 0 && download.total > download.segmentSize) {
+        download.segments = (int)((download.total + download.segmentSize - 1) / download.segmentSize);
+        download.next = 1;
+        int threads = options->connections > 0 ? options->connections : 4;
+        #ifdef HTTP_STATIC
+        // every connection holds a buffer and a response, the first segment one more of each
+        if (threads > HTTP_STATIC_BUFFERS - 1) threads = HTTP_STATIC_BUFFERS - 1;
+        if (threads > HTTP_STATIC_RESPONSES - 1) threads = HTTP_STATIC_RESPONSES - 1;
+        pthread_t ids[HTTP_STATIC_BUFFERS - 1];
+        #endif
+        if (threads > download.segments - 1) threads = download.segments - 1;
+        #ifndef HTTP_STATIC
+        pthread_t* ids = malloc(threads * sizeof(pthread_t));
+        if (!ids) threads = 0;
+        #endif
+        int started = 0;
+        while (started < threads && pthread_create(&ids[started], NULL, downloadSegments, &download) == 0) started++;
+        #ifdef DEBUG
+        printf("[DownloadHTTPSegmented]: %lld bytes in %d segments on %d threads\n", download.total, download.segments, started);
+        #endif
+        if (started == 0) downloadSegments(&download);
+        for (int i = 0; i < started; i++) pthread_join(ids[i], NULL);
+        #ifndef HTTP_STATIC
+        free(ids);
+        #endif
+        if (download.error != 0) msg->error = download.error;
+    }
+    pthread_mutex_destroy(&download.lock);
+
+    msg->l7.content = NULL;
+    msg->download.offset = 0;
+    msg->download.size = download.total;
+    msg->download.written = download.received;
+    msg->l7.content_length = download.received;
+    return msg;
+}
+
+void ReleaseHTTPResponseContext(HTTPResponseContext* ctx) {
+    if (!ctx) return;
+    if (ctx->response.l4.buffer != ctx->storage) releaseBuffer(ctx->response.l4.buffer);
+    releaseBuffer(ctx->response.headers.spans);
+    memset(&ctx->response, 0, sizeof(ctx->response));
+}
+
+// Pipelining: all requests are written back to back on one connection before the first response
+// is read, the responses are then framed one after another off the same stream.
+int FetchHTTPPipeline(HTTPRequestInfo* rqs, int count, HTTPResponseInfo** responses) {
+    if (!rqs || count <= 0 || !responses) return -1;
+    struct sockaddr_in addr, first_addr;
+    for (int i = 0; i < count; i++) {
+        responses[i] = NULL;
+        if (!requestDestination(&rqs[i], i ? &addr : &first_addr)) return -1;
+        if (i && !sameDestination(&addr, &first_addr)) return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        memset(&rqs[i].timing, 0, sizeof(rqs[i].timing));
+        HTTP_MARK(&rqs[i].timing, start);
+        rqs[i].deadline = rqs[i].socket_options.deadline_ms > 0 ? monotonicMs() + rqs[i].socket_options.deadline_ms : 0;
+    }
+    HTTPRequestInfo* first = &rqs[0];
+    bool keepOpen = first->pool != NULL; // otherwise the last request asks the server to close
+
+    // 1. write all requests
+    int sent = 0;
+    first->sd = -1;
+    first->tls_connection = NULL;
+    first->reused = first->pool && acquirePooledConnection(first->pool, first);
+    if (first->reused) HTTP_MARK(&first->timing, connected);
+    if (first->reused || createTCPSocket(first)) {
+        HTTPRequestHead head;
+        for (; sent < count; sent++) {
+            HTTPRequestInfo* rq = &rqs[sent];
+            if (!beginRequestHead(&head, rq, keepOpen || sent < count - 1)) break;
+            bool written = sendRequestHead(first->sd, first->tls_connection, &head, rq);
+            endRequestHead(&head);
+            if (!written) break;
+            HTTP_MARK(&rq->timing, sent);
+        }
+    }
+    #ifdef DEBUG
+    printf("[FetchHTTPPipeline]: wrote %d of %d requests\n", sent, count);
+    #endif
+
+    // 2. read the responses in order, data read past one response belongs to the next
+    int completed = 0;
+    char* carry = NULL;
+    size_t carrySize = 0;
+    bool reusable = keepOpen && sent == count;
+    bool failed = false;
+    for (; completed < sent; completed++) {
+        HTTPResponseInfo* msg = acquireResponse();
+        if (!msg) {
+            // the answers still unread go with the connection, sending the requests again would fail the same way
+            failed = true;
+            break;
+        }
+        msg->l7.content_length = -1;
+        msg->timing = rqs[completed].timing;
+        msg->error = readTCPRawData(first->sd, first->tls_connection, msg, &rqs[completed], NULL, &carry, &carrySize);
+        if (msg->error == -1 && msg->l4.totalSize == 0) {
+            // the server closed the connection before answering, the rest is sent again one by one
+            FreeHTTPResponseResource(msg);
+            reusable = false;
+            break;
+        }
+        responses[completed] = msg;
+        recordHTTPMetrics(&rqs[completed], msg);
+        if (msg->error != 0) {
+            failed = true;
+            break;
+        }
+        if (!msg->l7.keepAlive) {
+            reusable = false;
+            completed++;
+            break;
+        }
+    }
+    if (first->sd >= 0) {
+        if (!failed && reusable && completed == count && carrySize == 0) {
+            releasePooledConnection(first->pool, first);
+        } else {
+            closeConnection(first->sd, first->tls_connection);
+            first->sd = -1;
+            first->tls_connection = NULL;
+        }
+    }
+    releaseBuffer(carry);
+    if (failed) return completed;
+
+    // 3. fall back to sequential requests for whatever the connection did not carry. A request that was written
+    // may have been processed without an answer, only an idempotent one is sent again, any other fails (-1).
+    for (; completed < count; completed++) {
+        HTTPRequestInfo* rq = &rqs[completed];
+        bool resendable = completed >= sent || (requestIdempotent(rq) && requestReplayable(rq));
+        int error = resendable ? sendHTTPRequest(rq, true) : -1;
+        if (error != 0) {
+            responses[completed] = acquireResponse();
+            if (responses[completed]) responses[completed]->error = error;
+            break;
+        }
+        responses[completed] = fetchHTTPResponse(rq, NULL);
+        if (!responses[completed] || responses[completed]->error != 0) break;
+    }
+    return completed;
+}
+
+void FreeHTTPResponseResource(HTTPResponseInfo* msg) {
+    if (!msg) return;
+    if (msg->l4.buffer) releaseBuffer(msg->l4.buffer);
+    releaseBuffer(msg->headers.spans);
+    releaseResponse(msg);
+}
+
+// A cached response: a private copy whose buffer is trimmed to the message.
+typedef struct {
+    char* key;               // Host:port and the query
+    unsigned int hash;
+    bool decompress;         // stored for a request with HTTPRequestInfo.decompress, the body is inflated
+    HTTPResponseInfo* response;
+    size_t size;             // memory held by the entry
+    long long expires;       // monotonicMs() until which the entry is used without asking the server
+    unsigned long lastUsed;  // cache tick of the last use, for LRU eviction
+} HTTPCacheEntry;
+
+struct HTTPCache {
+    pthread_mutex_t lock;
+    HTTPCacheOptions options;
+    HTTPCacheStats stats;
+    HTTPCacheEntry* entries; // max_entries slots, unordered
+    int count;
+    unsigned long tick;
+};
+
+HTTPCache* CreateHTTPCache(const HTTPCacheOptions* options) {
+    HTTPCache* cache = calloc(1, sizeof(HTTPCache));
+    if (!cache) return NULL;
+    if (options) cache->options = *options;
+    if (cache->options.max_bytes == 0) cache->options.max_bytes = 16 * 1024 * 1024;
+    if (cache->options.max_entries <= 0) cache->options.max_entries = 256;
+    if (cache->options.max_entry_bytes == 0) cache->options.max_entry_bytes = cache->options.max_bytes / 8;
+    if (cache->options.default_ttl_s < 0) cache->options.default_ttl_s = 0;
+
+    cache->entries = calloc(cache->options.max_entries, sizeof(HTTPCacheEntry));
+    if (!cache->entries || pthread_mutex_init(&cache->lock, NULL) != 0) {
+        free(cache->entries);
+        free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void DestroyHTTPCache(HTTPCache* cache) {
+    if (!cache) return;
+    for (int i = 0; i < cache->count; i++) {
+        FreeHTTPResponseResource(cache->entries[i].response);
+        free(cache->entries[i].key);
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->entries);
+    free(cache);
+}
+
+void GetHTTPCacheStats(HTTPCache* cache, HTTPCacheStats* stats) {
+    if (!cache || !stats) return;
+    pthread_mutex_lock(&cache->lock);
+    *stats = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Copy of a complete buffered response with its own buffer, trimmed to the message, and header index.
+static HTTPResponseInfo* copyHTTPResponse(const HTTPResponseInfo* src) {
+    HTTPResponseInfo* msg = malloc(sizeof(HTTPResponseInfo));
+    if (!msg) return NULL;
+    *msg = *src;
+    msg->l4.buffer = malloc(src->l4.totalSize + 1);
+    msg->l4.bufferSize = src->l4.totalSize + 1;
+    msg->headers.spans = malloc((src->headers.count ? src->headers.count : 1) * sizeof(HTTPHeaderSpan));
+    msg->headers.capacity = src->headers.count;
+    if (!msg->l4.buffer || !msg->headers.spans) {
+        FreeHTTPResponseResource(msg);
+        return NULL;
+    }
+    memcpy(msg->l4.buffer, src->l4.buffer, src->l4.totalSize + 1);
+    memcpy(msg->headers.spans, src->headers.spans, src->headers.count * sizeof(HTTPHeaderSpan));
+    msg->l7.content = src->l7.content ? msg->l4.buffer + (src->l7.content - src->l4.buffer) : NULL;
+    updateHTTPCookie(msg);
+    return msg;
+}
+
+// "host:port" and the query of rq, malloc'd.
+static char* cacheKey(const HTTPRequestInfo* rq) {
+    const char* host = requestHost(rq) ? requestHost(rq) : rq->ipaddr ? rq->ipaddr : "";
+    const char* query = rq->query ? rq->query : "";
+    size_t length = strlen(host) + strlen(query) + 16;
+    char* key = malloc(length);
+    if (key) snprintf(key, length, "%s:%d%s", host, rq->port, query);
+    return key;
+}
+
+// Whether rq carries credentials, a cookie or an Authorization header (also in rq->prepared). The cache is shared
+// by all callers, so the answer to such a request is neither stored nor served from it.
+static bool hasCredentials(const HTTPRequestInfo* rq) {
+    if (rq->cookie && *rq->cookie) return true;
+    for (int i = 0; i < rq->header_count && rq->headers; i++) {
+        if (rq->headers[i].name && strcasecmp(rq->headers[i].name, "Authorization") == 0) return true;
+    }
+    const HTTPPreparedRequest* prepared = rq->prepared;
+    for (size_t i = 0; prepared && i + 15 <= prepared->blockLength; i++) {
+        if (prepared->block[i] == '\n' && strncasecmp(prepared->block + i + 1, "Authorization:", 14) == 0) return true;
+    }
+    return false;
+}
+
+// Whether the Cache-Control directive at p (length bytes up to the next comma) is name.
+static bool isCacheDirective(const char* p, size_t length, const char* name) {
+    size_t nameLength = strlen(name);
+    return length >= nameLength && strncasecmp(p, name, nameLength) == 0 &&
+        (length == nameLength || p[nameLength] == '=' || p[nameLength] == ' ' || p[nameLength] == '\t');
+}
+
+// Seconds a response may be used without asking the server: Cache-Control max-age minus Age, defaultTtl
+// without max-age, 0 with no-cache. -1 if it must not be stored (no-store, private, or Vary: *).
+static long long cacheFreshness(const HTTPResponseInfo* msg, int defaultTtl) {
+    const char* vary = GetHTTPHeader(msg, "Vary");
+    if (vary && strchr(vary, '*')) return -1;
+    long long maxAge = -1;
+    bool noCache = false;
+    const char* values[8];
+    int count = GetHTTPHeaderValues(msg, "Cache-Control", values, 8);
+    for (int i = 0; i < count && i < 8; i++) {
+        for (const char* p = values[i]; *p; ) {
+            while (*p == ' ' || *p == '\t' || *p == ',') p++;
+            size_t length = strcspn(p, ",");
+            if (isCacheDirective(p, length, "no-store") || isCacheDirective(p, length, "private")) return -1;
+            if (isCacheDirective(p, length, "no-cache")) noCache = true;
+            else if (isCacheDirective(p, length, "max-age") && p[7] == '=') maxAge = atoll(p + 8);
+            p += length;
+        }
+    }
+    if (noCache) return 0;
+    if (maxAge < 0) return defaultTtl;
+    const char* age = GetHTTPHeader(msg, "Age");
+    if (age) maxAge -= atoll(age);
+    return maxAge > 0 ? maxAge : 0;
+}
+
+// Whether a conditional request can check the response.
+static bool hasValidator(const HTTPResponseInfo* msg) {
+    return GetHTTPHeader(msg, "ETag") || GetHTTPHeader(msg, "Last-Modified");
+}
+
+// Must be called with cache->lock held.
+static int findCacheEntry(HTTPCache* cache, const char* key, unsigned int hash, bool decompress) {
+    for (int i = 0; i < cache->count; i++) {
+        HTTPCacheEntry* entry = &cache->entries[i];
+        if (entry->hash == hash && entry->decompress == decompress && strcmp(entry->key, key) == 0) return i;
+    }
+    return -1;
+}
+
+// Must be called with cache->lock held.
+static void removeCacheEntry(HTTPCache* cache, int index) {
+    HTTPCacheEntry* entry = &cache->entries[index];
+    FreeHTTPResponseResource(entry->response);
+    free(entry->key);
+    cache->stats.bytes -= entry->size;
+    cache->entries[index] = cache->entries[--cache->count];
+    cache->stats.entries = cache->count;
+}
+
+// Stores a copy of msg under key (which the cache takes over) for freshness seconds, replacing an entry
+// with the same key. Least recently used entries are evicted until it fits.
+static void storeCacheEntry(HTTPCache* cache, char* key, unsigned int hash, bool decompress, const HTTPResponseInfo* msg, long long freshness) {
+    size_t size = sizeof(HTTPResponseInfo) + msg->l4.totalSize + 1 + msg->headers.count * sizeof(HTTPHeaderSpan) + strlen(key) + 1;
+    HTTPResponseInfo* copy = size <= cache->options.max_entry_bytes ? copyHTTPResponse(msg) : NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    int index = findCacheEntry(cache, key, hash, decompress);
+    if (index >= 0) removeCacheEntry(cache, index);
+    if (copy) {
+        while (cache->count > 0 && (cache->count >= cache->options.max_entries || cache->stats.bytes + size > cache->options.max_bytes)) {
+            int oldest = 0;
+            for (int i = 1; i < cache->count; i++) {
+                if (cache->entries[i].lastUsed < cache->entries[oldest].lastUsed) oldest = i;
+            }
+            removeCacheEntry(cache, oldest);
+            cache->stats.evicted++;
+        }
+        cache->entries[cache->count++] = (HTTPCacheEntry){
+            .key = key, .hash = hash, .decompress = decompress, .response = copy, .size = size,
+            .expires = monotonicMs() + freshness * 1000, .lastUsed = ++cache->tick
+        };
+        cache->stats.entries = cache->count;
+        cache->stats.bytes += size;
+        cache->stats.stores++;
+        key = NULL;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    free(key);
+}
+
+// Sends rq with If-None-Match and If-Modified-Since from the validators of stale (NULL = unconditionally).
+static int sendConditionalRequest(HTTPRequestInfo* rq, const HTTPResponseInfo* stale) {
+    const HTTPHeader* headers = rq->headers;
+    int headerCount = rq->header_count;
+    HTTPHeader* conditional = stale ? malloc((headerCount + 2) * sizeof(HTTPHeader)) : NULL;
+    if (conditional) {
+        int count = headerCount;
+        if (headerCount > 0) memcpy(conditional, headers, headerCount * sizeof(HTTPHeader));
+        const char* etag = GetHTTPHeader(stale, "ETag");
+        const char* lastModified = GetHTTPHeader(stale, "Last-Modified");
+        if (etag) conditional[count++] = (HTTPHeader){ "If-None-Match", etag };
+        if (lastModified) conditional[count++] = (HTTPHeader){ "If-Modified-Since", lastModified };
+        rq->headers = conditional;
+        rq->header_count = count;
+    }
+    int result = SendHTTPRequest(rq);
+    rq->headers = headers;
+    rq->header_count = headerCount;
+    free(conditional);
+    return result;
+}
+
+// The entry is copied while the lock is held, so that it can be evicted by other threads in the meantime.
+// A stale entry is kept aside during the revalidation and returned if the server answers 304.
+HTTPResponseInfo* FetchHTTPCached(HTTPCache* cache, HTTPRequestInfo* rq) {
+    if (!rq) return NULL;
+    bool cacheable = cache && rq->method == HTTP_GET && !rq->body && !(rq->data && rq->data_length > 0) && rq->range_length == 0 &&
+        !hasCredentials(rq);
+    char* key = cacheable ? cacheKey(rq) : NULL;
+    if (!key) {
+        SendHTTPRequest(rq);
+        return FetchHTTPResponse(rq);
+    }
+    unsigned int hash = hashHostname(key);
+
+    HTTPResponseInfo* fresh = NULL;
+    HTTPResponseInfo* stale = NULL;
+    pthread_mutex_lock(&cache->lock);
+    int index = findCacheEntry(cache, key, hash, rq->decompress);
+    if (index >= 0) {
+        HTTPCacheEntry* entry = &cache->entries[index];
+        entry->lastUsed = ++cache->tick;
+        if (monotonicMs() < entry->expires) fresh = copyHTTPResponse(entry->response);
+        else if (!rq->prepared && hasValidator(entry->response)) stale = copyHTTPResponse(entry->response);
+    }
+    if (fresh) cache->stats.hits++;
+    else if (stale) cache->stats.revalidations++;
+    else cache->stats.misses++;
+    pthread_mutex_unlock(&cache->lock);
+
+    if (fresh) {
+        #ifdef DEBUG
+        printf("[FetchHTTPCached]: %s served from the cache\n", key);
+        #endif
+        free(key);
+        memset(&fresh->timing, 0, sizeof(fresh->timing));
+        fresh->cache.hit = true;
+        return fresh;
+    }
+
+    sendConditionalRequest(rq, stale);
+    HTTPResponseInfo* msg = FetchHTTPResponse(rq);
+    if (msg && stale && msg->error == 0 && msg->l7.status_code == 304) {
+        // the 304 may update the freshness, otherwise the stored headers still apply
+        long long freshness = cacheFreshness(GetHTTPHeader(msg, "Cache-Control") ? msg : stale, cache->options.default_ttl_s);
+        pthread_mutex_lock(&cache->lock);
+        cache->stats.not_modified++;
+        index = findCacheEntry(cache, key, hash, rq->decompress);
+        if (index >= 0) cache->entries[index].expires = monotonicMs() + (freshness > 0 ? freshness : 0) * 1000;
+        pthread_mutex_unlock(&cache->lock);
+        #ifdef DEBUG
+        printf("[FetchHTTPCached]: %s not modified\n", key);
+        #endif
+        free(key);
+        stale->timing = msg->timing;
+        stale->cache.hit = true;
+        stale->cache.revalidated = true;
+        FreeHTTPResponseResource(msg);
+        return stale;
+    }
+    FreeHTTPResponseResource(stale);
+
+    if (msg && msg->error == 0 && msg->l7.status_code == 200) {
+        long long freshness = cacheFreshness(msg, cache->options.default_ttl_s);
+        if (freshness > 0 || (freshness == 0 && hasValidator(msg))) {
+            storeCacheEntry(cache, key, hash, rq->decompress, msg, freshness);
+            return msg;
+        }
+        // no-store, or nothing to revalidate with: drop what was cached before
+        pthread_mutex_lock(&cache->lock);
+        index = findCacheEntry(cache, key, hash, rq->decompress);
+        if (index >= 0) removeCacheEntry(cache, index);
+        pthread_mutex_unlock(&cache->lock);
+    }
+    free(key);
+    return msg;
+}
+
+// The event loop client: every request is a task that goes through non-blocking connect, send and
+// receive on one epoll set. Tasks wait in a FIFO until the global and per-host caps allow them to start.
+// With HTTPClientOptions.io_uring the same tasks are driven by io_uring operations instead, see HTTPUring.
+typedef enum {
+    TASK_QUEUED,      // waiting for an in-flight slot
+    TASK_CONNECTING,  // non-blocking connect in progress
+    TASK_SENDING,
+    TASK_RECEIVING,
+    TASK_DONE         // waiting for its callback or in the completion queue
+} HTTPTaskState;
+
+typedef struct HTTPTask {
+    struct HTTPTask* next;       // pending queue, or the list of finished tasks
+    struct HTTPTask* prevActive; // in-flight list
+    struct HTTPTask* nextActive;
+    HTTPRequestInfo* rq;
+    HTTPCompletionCallback callback;
+    void* ctx;
+    HTTPTaskState state;
+    int host;                    // index into HTTPClient.hosts
+    size_t sent;                 // bytes of the head and body sent so far
+    HTTPResponseInfo* msg;
+    HTTPReceiveState receive;
+    long long deadline;          // monotonicMs() when the task times out, earlier while connecting with a connect timeout
+    long long requestDeadline;   // monotonicMs() when the whole request times out
+    char* chunk;                 // chunk of a produced body being sent, behind head in the same allocation
+    size_t chunkStart;           // unsent part of the chunk
+    size_t chunkEnd;
+    bool bodyDone;               // the last chunk has been produced
+    #ifdef HTTP_WITH_URING
+    struct sockaddr_in addr;     // destination of the connect operation
+    struct msghdr message;       // send operation in flight
+    struct iovec iov[2];
+    int uringOps;                // io_uring operations in flight that point at the task
+    bool finishing;              // finished, waiting for those operations to be cancelled
+    int finishError;
+    #endif
+    size_t headSize;
+    char head[];                 // request line and headers
+} HTTPTask;
+
+// In-flight count per address and port.
+typedef struct {
+    struct sockaddr_in addr;
+    int inFlight;
+} HTTPClientHost;
+
+#ifdef HTTP_WITH_URING
+// io_uring transport of an event loop client, set up with the raw syscalls. The connect of a new socket
+// is linked to the send of the head, both submitted with everything else prepared in the same loop
+// iteration. Responses come from multishot receives into a ring of buffers shared by all tasks, whose
+// data is copied into the response buffer and handed back to the kernel right away. Completions carry
+// the task pointer with the operation in its low bits.
+typedef struct {
+    int fd;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned sqMask;
+    unsigned sqEntries;
+    unsigned sqLocalTail;  // entries prepared so far, published to the kernel by enterUring()
+    struct io_uring_sqe* sqes;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe* cqes;
+    void* rings;           // submission and completion rings, one mapping (IORING_FEAT_SINGLE_MMAP)
+    size_t ringsSize;
+    size_t sqesSize;
+    struct io_uring_buf_ring* buffers; // provided receive buffers, buffer group 0
+    char* bufferData;
+    unsigned short bufferTail;
+    bool multishot;        // cleared when the kernel rejects IORING_RECV_MULTISHOT
+} HTTPUring;
+
+typedef enum {
+    URING_CONNECT = 1,
+    URING_SEND,
+    URING_RECV,
+    URING_POLL,    // wait for a full socket while a streamed body is sent
+    URING_CANCEL,
+    URING_OP_MASK = 7
+} HTTPUringOp;
+
+static int uringSetup(unsigned entries, struct io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uringEnter(int fd, unsigned submit, unsigned wait, unsigned flags, void* arg, size_t size) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, size);
+}
+
+static int uringRegister(int fd, unsigned opcode, void* arg, unsigned count) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+// Closing the ring cancels whatever is still in flight.
+static void destroyUring(HTTPUring* ring) {
+    if (!ring) return;
+    if (ring->fd >= 0) close(ring->fd);
+    if (ring->rings) munmap(ring->rings, ring->ringsSize);
+    if (ring->sqes) munmap(ring->sqes, ring->sqesSize);
+    if (ring->buffers) munmap(ring->buffers, HTTP_URING_BUFFERS * sizeof(struct io_uring_buf));
+    free(ring->bufferData);
+    free(ring);
+}
+
+// Hands receive buffer bid (back) to the kernel.
+static void recycleUringBuffer(HTTPUring* ring, unsigned short bid) {
+    struct io_uring_buf* buffer = &ring->buffers->bufs[ring->bufferTail & (HTTP_URING_BUFFERS - 1)];
+    buffer->addr = (uintptr_t)(ring->bufferData + (size_t)bid * HTTP_URING_BUFFER_SIZE);
+    buffer->len = HTTP_URING_BUFFER_SIZE;
+    buffer->bid = bid;
+    __atomic_store_n(&ring->buffers->tail, ++ring->bufferTail, __ATOMIC_RELEASE);
+}
+
+// Maps the rings and checks that the kernel has the operations the transport uses.
+static bool mapUring(HTTPUring* ring, const struct io_uring_params* params) {
+    unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((params->features & required) != required) return false;
+
+    ring->ringsSize = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+    size_t cqSize = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+    if (cqSize > ring->ringsSize) ring->ringsSize = cqSize;
+    ring->rings = mmap(NULL, ring->ringsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->rings == MAP_FAILED) ring->rings = NULL;
+    ring->sqesSize = params->sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) ring->sqes = NULL;
+    if (!ring->rings || !ring->sqes) return false;
+
+    char* base = ring->rings;
+    ring->sqHead = (unsigned*)(base + params->sq_off.head);
+    ring->sqTail = (unsigned*)(base + params->sq_off.tail);
+    ring->sqMask = *(unsigned*)(base + params->sq_off.ring_mask);
+    ring->sqEntries = params->sq_entries;
+    ring->sqLocalTail = *ring->sqTail;
+    unsigned* array = (unsigned*)(base + params->sq_off.array);
+    for (unsigned i = 0; i < params->sq_entries; i++) array[i] = i;
+    ring->cqHead = (unsigned*)(base + params->cq_off.head);
+    ring->cqTail = (unsigned*)(base + params->cq_off.tail);
+    ring->cqMask = *(unsigned*)(base + params->cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(base + params->cq_off.cqes);
+
+    size_t probeSize = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, probeSize);
+    bool supported = probe && uringRegister(ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    const int opcodes[] = { IORING_OP_CONNECT, IORING_OP_SENDMSG, IORING_OP_RECV, IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL };
+    for (size_t i = 0; supported && i < sizeof(opcodes) / sizeof(opcodes[0]); i++) {
+        supported = opcodes[i] <= probe->last_op && (probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return supported;
+}
+
+// Registers the ring of provided receive buffers (Linux 5.19) and fills it.
+static bool provideUringBuffers(HTTPUring* ring) {
+    ring->buffers = mmap(NULL, HTTP_URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buffers == MAP_FAILED) ring->buffers = NULL;
+    ring->bufferData = malloc((size_t)HTTP_URING_BUFFERS * HTTP_URING_BUFFER_SIZE);
+    if (!ring->buffers || !ring->bufferData) return false;
+
+    struct io_uring_buf_reg registration = { .ring_addr = (uintptr_t)ring->buffers, .ring_entries = HTTP_URING_BUFFERS, .bgid = 0 };
+    if (uringRegister(ring->fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) return false;
+    for (unsigned short bid = 0; bid < HTTP_URING_BUFFERS; bid++) recycleUringBuffer(ring, bid);
+    return true;
+}
+
+// Sets up the io_uring of a client, NULL when the kernel lacks anything the transport needs.
+static HTTPUring* createUring(void) {
+    HTTPUring* ring = calloc(1, sizeof(HTTPUring));
+    if (!ring) return NULL;
+    struct io_uring_params params;
+    // SUBMIT_ALL and COOP_TASKRUN (Linux 5.18/5.19) are only optimizations
+    const unsigned setupFlags[] = { IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN, IORING_SETUP_CQSIZE };
+    ring->fd = -1;
+    for (size_t i = 0; i < sizeof(setupFlags) / sizeof(setupFlags[0]) && ring->fd < 0; i++) {
+        memset(&params, 0, sizeof(params));
+        params.flags = setupFlags[i];
+        params.cq_entries = HTTP_URING_ENTRIES * 4;
+        ring->fd = uringSetup(HTTP_URING_ENTRIES, &params);
+    }
+    if (ring->fd < 0 || !mapUring(ring, &params) || !provideUringBuffers(ring)) {
+        #ifdef DEBUG
+        printf("[createUring]: io_uring not usable (%s), using epoll\n", strerror(errno));
+        #endif
+        destroyUring(ring);
+        return NULL;
+    }
+    ring->multishot = true;
+    return ring;
+}
+
+// Makes room for count submission queue entries, submitting what is prepared when the queue is full.
+static bool reserveUringEntries(HTTPUring* ring, unsigned count) {
+    if (ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) + count <= ring->sqEntries) return true;
+    __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+    uringEnter(ring->fd, ring->sqLocalTail - *ring->sqHead, 0, 0, NULL, 0);
+    return ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) + count <= ring->sqEntries;
+}
+
+// Next submission queue entry for operation op of task, after reserveUringEntries().
+static struct io_uring_sqe* nextUringEntry(HTTPUring* ring, void* task, HTTPUringOp op) {
+    struct io_uring_sqe* sqe = &ring->sqes[ring->sqLocalTail++ & ring->sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uintptr_t)task | op;
+    return sqe;
+}
+
+// Submits everything prepared and waits up to wait ms (-1 = no limit, 0 = not at all) for a completion.
+static bool enterUring(HTTPUring* ring, int wait) {
+    __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+    unsigned submit = ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    struct __kernel_timespec timeout = { .tv_sec = wait / 1000, .tv_nsec = (wait % 1000) * 1000000LL };
+    struct io_uring_getevents_arg arg = { .ts = wait >= 0 ? (uintptr_t)&timeout : 0 };
+    if (uringEnter(ring->fd, submit, wait != 0, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) >= 0) return true;
+    // ETIME: nothing completed in time, EBUSY: completions are waiting to be reaped
+    return errno == ETIME || errno == EINTR || errno == EAGAIN || errno == EBUSY;
+}
+#endif
+
+struct HTTPClient {
+    int epfd;
+    HTTPClientOptions options;
+    HTTPTask* pendingHead;    // queued tasks in submission order
+    HTTPTask* pendingTail;
+    HTTPTask* active;         // connecting, sending or receiving tasks
+    HTTPTask* finishedHead;   // tasks whose callback is still to be called
+    HTTPTask* finishedTail;
+    HTTPTask* completedHead;  // completion queue for tasks without a callback
+    HTTPTask* completedTail;
+    int pendingCount;
+    int activeCount;
+    HTTPClientHost* hosts;
+    int hostCount;
+    int hostCapacity;
+    #ifdef HTTP_WITH_URING
+    HTTPUring* uring;         // NULL on the epoll backend
+    #endif
+};
+
+static bool usesUring(const HTTPClient* client) {
+    #ifdef HTTP_WITH_URING
+    return client->uring != NULL;
+    #else
+    (void)client;
+    return false;
+    #endif
+}
+
+HTTPClient* CreateHTTPClient(const HTTPClientOptions* options) {
+    HTTPClient* client = calloc(1, sizeof(HTTPClient));
+    if (!client) return NULL;
+    if (options) client->options = *options;
+    if (client->options.max_in_flight <= 0) client->options.max_in_flight = 256;
+    if (client->options.max_in_flight_per_host <= 0) client->options.max_in_flight_per_host = 8;
+    if (client->options.request_timeout_ms <= 0) client->options.request_timeout_ms = 10000;
+
+    client->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (client->epfd < 0) {
+        free(client);
+        return NULL;
+    }
+    #ifdef HTTP_WITH_URING
+    if (client->options.io_uring) client->uring = createUring();
+    #endif
+    return client;
+}
+
+HTTPClientBackend GetHTTPClientBackend(const HTTPClient* client) {
+    return client && usesUring(client) ? HTTP_BACKEND_IO_URING : HTTP_BACKEND_EPOLL;
+}
+
+static int findClientHost(HTTPClient* client, const HTTPRequestInfo* rq) {
+    struct sockaddr_in addr;
+    if (!requestDestination(rq, &addr)) return -1;
+    for (int i = 0; i < client->hostCount; i++) {
+        if (sameDestination(&client->hosts[i].addr, &addr)) return i;
+    }
+    if (client->hostCount == client->hostCapacity) {
+        int capacity = client->hostCapacity ? client->hostCapacity * 2 : 16;
+        HTTPClientHost* hosts = realloc(client->hosts, capacity * sizeof(HTTPClientHost));
+        if (!hosts) return -1;
+        client->hosts = hosts;
+        client->hostCapacity = capacity;
+    }
+    HTTPClientHost* host = &client->hosts[client->hostCount];
+    host->addr = addr;
+    host->inFlight = 0;
+    return client->hostCount++;
+}
+
+static void appendTask(HTTPTask** head, HTTPTask** tail, HTTPTask* task) {
+    task->next = NULL;
+    if (*tail) (*tail)->next = task;
+    else *head = task;
+    *tail = task;
+}
+
+// The unsent part of the head and the in-memory body, from task->sent on. Returns the iovec count, 0 once sent.
+static int taskSendVector(const HTTPTask* task, struct iovec iov[2]) {
+    const HTTPRequestInfo* rq = task->rq;
+    size_t bodySize = !rq->body && rq->data && rq->data_length >= 0 ? (size_t)rq->data_length : 0;
+    int count = 0;
+    if (task->sent < task->headSize) {
+        iov[count].iov_base = (char*)task->head + task->sent;
+        iov[count++].iov_len = task->headSize - task->sent;
+        if (bodySize) {
+            iov[count].iov_base = rq->data;
+            iov[count++].iov_len = bodySize;
+        }
+    } else if (task->sent < task->headSize + bodySize) {
+        iov[count].iov_base = rq->data + (task->sent - task->headSize);
+        iov[count++].iov_len = task->headSize + bodySize - task->sent;
+    }
+    return count;
+}
+
+#ifdef HTTP_WITH_URING
+// Finishing a task with operations in flight: cancels them all, the task is finished with error once
+// the last completion arrived. Shutting the socket down ends them too, should the queue be stuck.
+static void cancelUringTask(HTTPClient* client, HTTPTask* task, int error) {
+    task->finishing = true;
+    task->finishError = error;
+    task->deadline = LLONG_MAX;
+    if (!reserveUringEntries(client->uring, 1)) {
+        shutdown(task->rq->sd, SHUT_RDWR);
+        return;
+    }
+    struct io_uring_sqe* sqe = nextUringEntry(client->uring, task, URING_CANCEL);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = task->rq->sd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    task->uringOps++;
+}
+
+// Queues a sendmsg() of the head and the in-memory body, linked behind the connect of a new socket.
+static bool queueUringSend(HTTPClient* client, HTTPTask* task) {
+    HTTPUring* ring = client->uring;
+    int sd = task->rq->sd;
+    bool connecting = task->state == TASK_CONNECTING;
+    if (!reserveUringEntries(ring, connecting ? 2 : 1)) return false;
+    if (connecting) {
+        struct io_uring_sqe* sqe = nextUringEntry(ring, task, URING_CONNECT);
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->fd = sd;
+        sqe->addr = (uintptr_t)&task->addr;
+        sqe->off = sizeof(task->addr);
+        sqe->flags = IOSQE_IO_LINK; // the send is cancelled if the connect fails
+        task->uringOps++;
+    }
+    task->message = (struct msghdr){ .msg_iov = task->iov, .msg_iovlen = taskSendVector(task, task->iov) };
+    struct io_uring_sqe* sqe = nextUringEntry(ring, task, URING_SEND);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sd;
+    sqe->addr = (uintptr_t)&task->message;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (task->rq->body ? MSG_MORE : 0);
+    task->uringOps++;
+    return true;
+}
+
+// Queues a receive into a provided buffer, multishot (Linux 6.0) when the kernel takes it.
+static bool queueUringReceive(HTTPClient* client, HTTPTask* task) {
+    HTTPUring* ring = client->uring;
+    if (!reserveUringEntries(ring, 1)) return false;
+    struct io_uring_sqe* sqe = nextUringEntry(ring, task, URING_RECV);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = task->rq->sd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->ioprio = ring->multishot ? IORING_RECV_MULTISHOT : 0;
+    task->uringOps++;
+    return true;
+}
+
+// Queues a wait for room in the send buffer of the socket.
+static bool queueUringPoll(HTTPClient* client, HTTPTask* task) {
+    if (!reserveUringEntries(client->uring, 1)) return false;
+    struct io_uring_sqe* sqe = nextUringEntry(client->uring, task, URING_POLL);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = task->rq->sd;
+    sqe->poll32_events = POLLOUT;
+    task->uringOps++;
+    return true;
+}
+#endif
+
+// Takes the task out of the in-flight list and hands it to its callback or the completion queue.
+// The socket is returned to rq->pool when the response allows it, otherwise closed.
+static void finishTask(HTTPClient* client, HTTPTask* task, int error) {
+    HTTPRequestInfo* rq = task->rq;
+    #ifdef HTTP_WITH_URING
+    if (client->uring && task->uringOps > 0) {
+        // the kernel still refers to the task and its socket
+        if (!task->finishing) cancelUringTask(client, task, error);
+        return;
+    }
+    if (task->finishing) error = task->finishError;
+    #endif
+    if (rq->sd >= 0) {
+        if (!usesUring(client)) epoll_ctl(client->epfd, EPOLL_CTL_DEL, rq->sd, NULL);
+        if (error == 0 && rq->pool && task->msg->l7.keepAlive) {
+            fcntl(rq->sd, F_SETFL, fcntl(rq->sd, F_GETFL) & ~O_NONBLOCK);
+            releasePooledConnection(rq->pool, rq);
+        } else {
+            close(rq->sd);
+            rq->sd = -1;
+        }
+    }
+    task->msg->error = error;
+    recordHTTPMetrics(rq, task->msg);
+    #ifdef DEBUG
+    printf("[finishTask]: %s:%d%s finished with error %d\n", requestHost(rq), rq->port, rq->query, error);
+    #endif
+
+    if (task->prevActive) task->prevActive->nextActive = task->nextActive;
+    else client->active = task->nextActive;
+    if (task->nextActive) task->nextActive->prevActive = task->prevActive;
+    client->activeCount--;
+    client->hosts[task->host].inFlight--;
+
+    task->state = TASK_DONE;
+    if (task->callback) appendTask(&client->finishedHead, &client->finishedTail, task);
+    else appendTask(&client->completedHead, &client->completedTail, task);
+}
+
+// Opens a non-blocking connection for the task (or takes one from rq->pool) and registers it with epoll,
+// or queues its connect and send on io_uring.
+static bool connectTask(HTTPClient* client, HTTPTask* task, bool allowReuse) {
+    HTTPRequestInfo* rq = task->rq;
+    rq->sd = -1;
+    rq->reused = rq->pool && allowReuse && acquirePooledConnection(rq->pool, rq);
+    task->sent = 0;
+    HTTPRequestTiming* timing = &task->msg->timing;
+
+    if (rq->reused) {
+        fcntl(rq->sd, F_SETFL, fcntl(rq->sd, F_GETFL) | O_NONBLOCK);
+        HTTP_MARK(timing, connected);
+        task->state = TASK_SENDING;
+    } else {
+        struct sockaddr_in server_addr;
+        if (!requestDestination(rq, &server_addr)) return false;
+        rq->sd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        HTTP_COUNT(timing, syscalls, 2);
+        HTTP_COUNT(timing, connects, 1);
+        if (rq->sd < 0) return false;
+        // pooled sockets may be reused by the blocking functions later
+        if (!configureSocket(rq->sd, &rq->socket_options, rq->pool != NULL)) {
+            close(rq->sd);
+            rq->sd = -1;
+            return false;
+        }
+        #ifdef HTTP_WITH_URING
+        task->addr = server_addr;
+        #endif
+        // on io_uring the connect is queued together with the send
+        if (!usesUring(client) && connect(rq->sd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == 0) {
+            HTTP_MARK(timing, connected);
+            task->state = TASK_SENDING;
+        } else if (usesUring(client) || errno == EINPROGRESS) {
+            task->state = TASK_CONNECTING;
+            if (rq->socket_options.connect_timeout_ms > 0) {
+                long long connectDeadline = monotonicMs() + rq->socket_options.connect_timeout_ms;
+                if (connectDeadline < task->deadline) task->deadline = connectDeadline;
+            }
+        } else {
+            #ifdef DEBUG
+            printf("[connectTask]: connect error: %s\n", strerror(errno));
+            #endif
+            close(rq->sd);
+            rq->sd = -1;
+            return false;
+        }
+    }
+
+    #ifdef HTTP_WITH_URING
+    if (client->uring) {
+        if (queueUringSend(client, task)) return true;
+        close(rq->sd);
+        rq->sd = -1;
+        return false;
+    }
+    #endif
+    struct epoll_event event = { .events = EPOLLOUT, .data.ptr = task };
+    if (epoll_ctl(client->epfd, EPOLL_CTL_ADD, rq->sd, &event) < 0) {
+        close(rq->sd);
+        rq->sd = -1;
+        return false;
+    }
+    return true;
+}
+
+// Moves queued tasks in flight while the global and per-host caps allow, in submission order.
+static void startPendingTasks(HTTPClient* client) {
+    HTTPTask* prev = NULL;
+    HTTPTask* task = client->pendingHead;
+    while (task && client->activeCount < client->options.max_in_flight) {
+        HTTPTask* next = task->next;
+        if (client->hosts[task->host].inFlight >= client->options.max_in_flight_per_host) {
+            prev = task;
+            task = next;
+            continue;
+        }
+
+        if (prev) prev->next = next;
+        else client->pendingHead = next;
+        if (client->pendingTail == task) client->pendingTail = prev;
+        client->pendingCount--;
+
+        task->prevActive = NULL;
+        task->nextActive = client->active;
+        if (client->active) client->active->prevActive = task;
+        client->active = task;
+        client->activeCount++;
+        client->hosts[task->host].inFlight++;
+        task->requestDeadline = monotonicMs() + client->options.request_timeout_ms;
+        if (task->rq->deadline && task->rq->deadline < task->requestDeadline) task->requestDeadline = task->rq->deadline;
+        task->deadline = task->requestDeadline;
+        if (!connectTask(client, task, true)) finishTask(client, task, -1);
+        task = next;
+    }
+}
+
+int SubmitHTTPRequest(HTTPClient* client, HTTPRequestInfo* rq, HTTPCompletionCallback callback, void* ctx) {
+    if (!client || !rq || rq->tls) return -1;
+    HTTPRequestHead head;
+    if (!beginRequestHead(&head, rq, rq->pool != NULL)) return -1;
+    int host = findClientHost(client, rq);
+    size_t chunkSize = rq->body && rq->body->produce ? HTTP_CHUNK_FRAME + HTTP_BODY_CHUNK_SIZE + 2 : 0;
+    HTTPTask* task = host < 0 ? NULL : calloc(1, sizeof(HTTPTask) + head.length + chunkSize);
+    if (task) task->msg = calloc(1, sizeof(HTTPResponseInfo));
+    if (!task || !task->msg) {
+        free(task);
+        endRequestHead(&head);
+        return -1;
+    }
+    task->msg->l7.content_length = -1;
+    HTTP_MARK(&task->msg->timing, start);
+    // the engine sends from its own copy, flatten the fragments
+    for (int i = 0; i < head.count; i++) {
+        memcpy(task->head + task->headSize, head.iov[i].iov_base, head.iov[i].iov_len);
+        task->headSize += head.iov[i].iov_len;
+    }
+    endRequestHead(&head);
+    if (chunkSize) task->chunk = task->head + task->headSize;
+    task->rq = rq;
+    task->callback = callback;
+    task->ctx = ctx;
+    task->host = host;
+    task->state = TASK_QUEUED;
+    rq->sd = -1;
+    rq->tls_connection = NULL;
+    rq->reused = false;
+    rq->deadline = rq->socket_options.deadline_ms > 0 ? monotonicMs() + rq->socket_options.deadline_ms : 0;
 
-    struct addrinfo hints, *res;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
+    appendTask(&client->pendingHead, &client->pendingTail, task);
+    client->pendingCount++;
+    startPendingTasks(client);
+    return 0;
+}
 
-    int status = getaddrinfo(hostname, "80", &hints, &res);
-    if (status != 0) {
-        #ifdef DEBUG
-        printf("[GetIPv4Address]: %s\n", gai_strerror(status));
+int CancelHTTPRequest(HTTPClient* client, HTTPRequestInfo* rq) {
+    if (!client || !rq) return -1;
+    for (HTTPTask* task = client->active; task; task = task->nextActive) {
+        if (task->rq != rq) continue;
+        #ifdef HTTP_WITH_URING
+        if (task->finishing) return -1;
         #endif
-        free(buffer);
-        return NULL;
+        finishTask(client, task, -8);
+        return 0;
     }
+    for (HTTPTask* prev = NULL, *task = client->pendingHead; task; prev = task, task = task->next) {
+        if (task->rq != rq) continue;
+        if (prev) prev->next = task->next;
+        else client->pendingHead = task->next;
+        if (client->pendingTail == task) client->pendingTail = prev;
+        client->pendingCount--;
+        task->msg->error = -8;
+        task->state = TASK_DONE;
+        if (task->callback) appendTask(&client->finishedHead, &client->finishedTail, task);
+        else appendTask(&client->completedHead, &client->completedTail, task);
+        return 0;
+    }
+    return -1;
+}
 
-    struct sockaddr_in *ipv4 = (struct sockaddr_in *)res->ai_addr;
-    inet_ntop(res->ai_family, &(ipv4->sin_addr), buffer, INET_ADDRSTRLEN);
-    freeaddrinfo(res);
-    #ifdef DEBUG
-    printf("[GetIPv4Address]: resolved %s\n", buffer);
+// A reused socket the server closed or reset before the response started: resend once on a new connection.
+static bool retryTask(HTTPClient* client, HTTPTask* task) {
+    HTTPRequestInfo* rq = task->rq;
+    if (!reusedConnectionDropped(rq, task->msg)) return false;
+    #ifdef HTTP_WITH_URING
+    if (task->uringOps > 0 || task->finishing) return false;
     #endif
-    return buffer;
+    if (!usesUring(client)) epoll_ctl(client->epfd, EPOLL_CTL_DEL, rq->sd, NULL);
+    close(rq->sd);
+    releaseBuffer(task->msg->l4.buffer);
+    task->msg->l4.buffer = NULL;
+    recordPoolRetry(rq->pool);
+    return connectTask(client, task, false);
 }
 
-// Creates a TCP socket, configures its timeouts, and connects it to the given IP address and port.
-// Stores the socket descriptor in the HTTPRequestInfo struct.
-static bool createTCPSocket(HTTPRequestInfo *rq) {
-	if (!rq || !rq->ipaddr || !rq->port ) return false;
-    int sd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sd < 0) return false;
+// Sends as much of the head and body as the socket takes, one sendmsg() covering both,
+// then a streamed body with sendfile() or chunk by chunk.
+// Returns 1 once everything is sent, 0 if the socket is full, -1 on error.
+static int sendTaskData(HTTPTask* task) {
+    HTTPRequestInfo* rq = task->rq;
+    const HTTPRequestBody* body = rq->body;
+    size_t bodySize = !body && rq->data && rq->data_length >= 0 ? (size_t)rq->data_length : 0;
 
-    struct timeval timeout = { .tv_sec = 10, .tv_usec = 0 };
-    setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-    setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    while (task->sent < task->headSize + bodySize) {
+        struct iovec iov[2];
+        struct msghdr message = { .msg_iov = iov, .msg_iovlen = taskSendVector(task, iov) };
+        ssize_t bytes = sendmsg(rq->sd, &message, MSG_NOSIGNAL | (body ? MSG_MORE : 0));
+        HTTP_COUNT(&task->msg->timing, syscalls, 1);
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS) return 0; // EINPROGRESS: fast open handshake
+            return -1;
+        }
+        HTTP_COUNT(&task->msg->timing, bytes_sent, bytes);
+        task->sent += bytes;
+    }
+    if (!body) return 1;
 
-    struct sockaddr_in server_addr = {0};
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(rq->port);
-    if (inet_pton(AF_INET, rq->ipaddr, &server_addr.sin_addr) <= 0 || connect(sd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        #ifdef DEBUG
-        printf("[createTCPSocket]: connect error: %s\n", strerror(errno));
-        #endif
-        close(sd);
-        return false;
+    while (!body->produce && task->sent < task->headSize + (size_t)body->length) {
+        ssize_t bytes = sendFileData(rq->sd, NULL, body, task->sent - task->headSize, 0, &task->msg->timing);
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        if (bytes == 0) return -1; // the file is shorter than body->length
+        task->sent += bytes;
     }
-    
-    rq->sd = sd;
-    #ifdef DEBUG
-    printf("[createTCPSocket]: created fd %d\n", sd);
-    #endif
-    return true;
+    while (body->produce) {
+        if (task->chunkStart == task->chunkEnd) {
+            if (task->bodyDone) break;
+            size_t start, size;
+            if (!produceBodyChunk(body, task->chunk, &start, &size, &task->bodyDone)) return -1;
+            task->chunkStart = start;
+            task->chunkEnd = start + size;
+        }
+        ssize_t bytes = send(rq->sd, task->chunk + task->chunkStart, task->chunkEnd - task->chunkStart, MSG_NOSIGNAL | (task->bodyDone ? 0 : MSG_MORE));
+        HTTP_COUNT(&task->msg->timing, syscalls, 1);
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        HTTP_COUNT(&task->msg->timing, bytes_sent, bytes);
+        task->chunkStart += bytes;
+        task->sent += bytes;
+    }
+    return 1;
 }
 
-// Sends raw data (like GET / HTTP/1.1) through the provided socket.
-// Uses MSG_NOSIGNAL to prevent the process from being killed by SIGPIPE if the connection is closed on the other side.
-static bool sendTCPRawData(int sd, const char* data, size_t length) {
-    if (data == NULL || length == 0) return false;
+// Receives everything the socket has for the task. Returns 1 once the response is complete,
+// 0 if more data is needed, or the (negative) error code.
+static int receiveTaskData(HTTPTask* task) {
+    HTTPResponseInfo* msg = task->msg;
+    for (;;) {
+        bool waitAll;
+        size_t readSize = reserveResponseBuffer(msg, &task->receive, &waitAll);
+        if (readSize == 0) return -1;
+        ssize_t bytesRead = recv(task->rq->sd, msg->l4.buffer + msg->l4.totalSize, readSize, 0);
+        HTTP_COUNT(&msg->timing, syscalls, 1);
+        if (bytesRead < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        bool done;
+        int error = receivedResponseData(msg, &task->receive, bytesRead, &done);
+        if (error != 0) return error;
+        if (done) return 1;
+    }
+}
 
-    size_t remaining = length;
-    while (remaining > 0) {
-        ssize_t bytes = send(sd, data, remaining, MSG_NOSIGNAL);
-        if (bytes < 0) {
+// Advances a task after epoll reported its socket ready.
+static void handleTaskEvent(HTTPClient* client, HTTPTask* task, uint32_t events) {
+    HTTPRequestInfo* rq = task->rq;
+
+    if (task->state == TASK_CONNECTING) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(rq->sd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
             #ifdef DEBUG
-            printf("[sendTCPRawData]: error when sending data: %d\n", errno);
+            printf("[handleTaskEvent]: connect error: %s\n", strerror(error));
             #endif
-            if (errno == EINTR) {
-                continue;
-            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                // wait when the buffer is full
-                struct timeval tv;
-                tv.tv_sec  = 1;  
-                tv.tv_usec = 0;
-                fd_set writefds;
-                FD_ZERO(&writefds);
-                FD_SET(sd, &writefds);
-
-                // wait sd
-                int ret = select(sd + 1, NULL, &writefds, NULL, &tv);
-                if (ret > 0) {
-                    // check if writable
-                    if (FD_ISSET(sd, &writefds)) {
-                        continue;
-                    } else {
-                        return false;
-                    }
-                } else if (ret == 0) {
-                    // timeout
-                    return false;
-                } else {
-                    // select error
-                    return false;
-                }
-            } else {
-                // other errors that is unable to handle
-                return false;
-            }
+            finishTask(client, task, -1);
+            return;
+        }
+        HTTP_MARK(&task->msg->timing, connected);
+        task->deadline = task->requestDeadline;
+        task->state = TASK_SENDING;
+    }
 
-        } else if (bytes == 0) {
-            // send() return 0, which means the server closed the connection
-            return false;
+    if (task->state == TASK_SENDING) {
+        int result = sendTaskData(task);
+        if (result < 0) {
+            if (!retryTask(client, task)) finishTask(client, task, -1);
+            return;
+        }
+        if (result == 0) return;
+        HTTP_MARK(&task->msg->timing, sent);
 
-        } else {
-            // successfully sent bytes
-            data      += bytes;
-            remaining -= bytes;
+        if (!beginResponseBuffer(task->msg, &task->receive, rq)) {
+            finishTask(client, task, -1);
+            return;
         }
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = task };
+        epoll_ctl(client->epfd, EPOLL_CTL_MOD, rq->sd, &event);
+        task->state = TASK_RECEIVING;
+        return;
     }
 
-    #ifdef DEBUG
-    printf("[sendTCPRawData]: sent %zu bytes, remain %zu bytes\n", length, remaining);
-    #endif
-    return true;
+    if (task->state == TASK_RECEIVING && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        int result = receiveTaskData(task);
+        if (result == 1) {
+            finishTask(client, task, 0);
+        } else if (result < 0 && !retryTask(client, task)) {
+            finishTask(client, task, result);
+        }
+    }
 }
 
-// Reads data from the socket and stores it in the HTTPResponseInfo structure.
-// Expands the buffer if necessary, and handles errors such as EINTR and EAGAIN gracefully.
-// If Content-Length is available in the response, checks that the received content matches this length.
-static bool readTCPRawData(int sd, HTTPResponseInfo* msg) {
-	size_t bufferExpandThreshold = 512; // when leftspace is under this value, realloc
-	size_t initBufferSize = 4096; // initial buffer size
-	size_t maxBufferSize = 1024 * 1024 * 64; // max buffer size
-	size_t readSize = 256; // how many bytes to read() once
-	
-    if (!msg || sd < 0) return false;
-    msg->l4.buffer = (char*)calloc(1, initBufferSize);
-    if (!msg->l4.buffer) return false;
-    msg->l4.bufferSize = initBufferSize;
-    msg->l4.totalSize = 0;
+#ifdef HTTP_WITH_URING
+// Copies size bytes of a receive buffer into the response, size 0 = the server closed the connection.
+// Returns 1 once the response is complete, 0 if more data is needed, or the (negative) error code.
+static int receiveUringData(HTTPTask* task, const char* data, size_t size) {
+    HTTPResponseInfo* msg = task->msg;
+    bool done = false;
+    if (size == 0) {
+        int error = receivedResponseData(msg, &task->receive, 0, &done);
+        return error != 0 ? error : 1;
+    }
+    while (size > 0 && !done) {
+        bool waitAll;
+        size_t readSize = reserveResponseBuffer(msg, &task->receive, &waitAll);
+        if (readSize == 0) return -1;
+        if (readSize > size) readSize = size;
+        memcpy(msg->l4.buffer + msg->l4.totalSize, data, readSize);
+        int error = receivedResponseData(msg, &task->receive, readSize, &done);
+        if (error != 0) return error;
+        data += readSize;
+        size -= readSize;
+    }
+    // data behind the response, the connection is out of step
+    if (size > 0) msg->l7.keepAlive = false;
+    return done;
+}
 
-    for (;;) {
-        // calculate left space
-        int remainingSpace = msg->l4.bufferSize - msg->l4.totalSize;
-
-        // if the leftspace is not enough, then relloac to expand buffer size
-        if (remainingSpace < bufferExpandThreshold) {
-            int oldBufferSize = msg->l4.bufferSize;
-        	msg->l4.bufferSize *= 2;
-            if (msg->l4.bufferSize > maxBufferSize) {
-            	#ifdef DEBUG
-                printf("[readTCPRawData] Buffer size exceeded maximum allowed size %d\n", msg->l4.bufferSize);
-                #endif
-                return false;
-            }
+// The request is sent: receive the response.
+static void startUringReceive(HTTPClient* client, HTTPTask* task) {
+    HTTP_MARK(&task->msg->timing, sent);
+    task->state = TASK_RECEIVING;
+    if (!beginResponseBuffer(task->msg, &task->receive, task->rq) || !queueUringReceive(client, task)) finishTask(client, task, -1);
+}
 
-            char *newBuffer = (char*)realloc(msg->l4.buffer, msg->l4.bufferSize);
-            if (!newBuffer) return false; // no need free here, it will be freed finally, avoid double free
-            memset(newBuffer + oldBufferSize, 0, msg->l4.bufferSize - oldBufferSize);
-            msg->l4.buffer = newBuffer;
-        }
+// Sends the rest of a streamed body with the syscalls of the epoll backend, polling through the ring
+// whenever the socket is full.
+static void sendUringBody(HTTPClient* client, HTTPTask* task) {
+    int result = sendTaskData(task);
+    if (result < 0 || (result == 0 && !queueUringPoll(client, task))) {
+        finishTask(client, task, -1);
+        return;
+    }
+    if (result == 1) startUringReceive(client, task);
+}
 
-        ssize_t bytesRead = read(sd, msg->l4.buffer + msg->l4.totalSize, readSize);
+// Advances a task with the completion of one of its operations. data is the receive buffer, if any.
+static void advanceUringTask(HTTPClient* client, HTTPTask* task, HTTPUringOp op, const struct io_uring_cqe* cqe, const char* data) {
+    HTTPRequestInfo* rq = task->rq;
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+    if (!more) task->uringOps--;
+    if (task->finishing) {
+        // a late read or the end of the connection, the socket can't go back to the pool
+        if (op == URING_RECV && cqe->res >= 0) task->msg->l7.keepAlive = false;
+        if (task->uringOps == 0) finishTask(client, task, task->finishError);
+        return;
+    }
 
-        if (bytesRead < 0) {
-            if (errno == EINTR) continue; 
+    switch (op) {
+    case URING_CONNECT:
+        if (cqe->res < 0) {
             #ifdef DEBUG
-            printf("[readTCPRawData]: Read %d bytes from fd %d\n", (int)bytesRead, sd);
-            perror("[readTCPRawData]: Read failed");
+            printf("[advanceUringTask]: connect error: %s\n", strerror(-cqe->res));
             #endif
-            return false;
-        } else if (bytesRead == 0) {
-            break;
+            finishTask(client, task, -1);
+            return;
+        }
+        HTTP_MARK(&task->msg->timing, connected);
+        task->deadline = task->requestDeadline;
+        task->state = TASK_SENDING;
+        return;
+    case URING_SEND:
+        if (cqe->res < 0) {
+            if (!retryTask(client, task)) finishTask(client, task, -1);
+            return;
+        }
+        HTTP_COUNT(&task->msg->timing, bytes_sent, cqe->res);
+        task->sent += cqe->res;
+        struct iovec iov[2];
+        if (taskSendVector(task, iov) > 0) {
+            if (!queueUringSend(client, task)) finishTask(client, task, -1);
+        } else if (rq->body) {
+            // the socket stays non-blocking for the syscalls
+            sendUringBody(client, task);
+        } else {
+            startUringReceive(client, task);
+        }
+        return;
+    case URING_POLL:
+        if (cqe->res < 0) finishTask(client, task, -1);
+        else sendUringBody(client, task);
+        return;
+    case URING_RECV:
+        if (cqe->res == -ENOBUFS || (cqe->res == -EINVAL && client->uring->multishot)) {
+            // out of buffers until the ones reaped with this completion are back, or no multishot receive
+            if (cqe->res == -EINVAL) client->uring->multishot = false;
+            if (!more && !queueUringReceive(client, task)) finishTask(client, task, -1);
+            return;
         }
+        int result = cqe->res < 0 ? -1 : receiveUringData(task, data, cqe->res);
+        if (result == 1) finishTask(client, task, 0);
+        else if (result < 0 && !retryTask(client, task)) finishTask(client, task, result);
+        else if (result == 0 && !more && !queueUringReceive(client, task)) finishTask(client, task, -1);
+        return;
+    default:
+        return;
+    }
+}
 
-        msg->l4.totalSize += bytesRead;
+// Handles every completion in the queue. A receive buffer goes back to the kernel once its data is copied.
+static void reapUringCompletions(HTTPClient* client) {
+    HTTPUring* ring = client->uring;
+    unsigned head = *ring->cqHead;
+    while (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe cqe = ring->cqes[head & ring->cqMask];
+        __atomic_store_n(ring->cqHead, ++head, __ATOMIC_RELEASE);
+        HTTPTask* task = (HTTPTask*)(uintptr_t)(cqe.user_data & ~(uint64_t)URING_OP_MASK);
+        bool buffered = cqe.flags & IORING_CQE_F_BUFFER;
+        unsigned short bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        const char* data = buffered ? ring->bufferData + (size_t)bid * HTTP_URING_BUFFER_SIZE : NULL;
+        advanceUringTask(client, task, (HTTPUringOp)(cqe.user_data & URING_OP_MASK), &cqe, data);
+        if (buffered) recycleUringBuffer(ring, bid);
     }
+}
+#endif
 
-    #ifdef DEBUG
-    printf("[readTCPRawData]: read result: \n--------Begin of content--------\n%s--------End of content--------\n", msg->l4.buffer);
-    printf("[readTCPRawData]: allocated buffer size: %d\n", msg->l4.bufferSize);
+// Waits up to wait ms (-1 = no limit) for socket events or io_uring completions and advances the tasks.
+static bool pollClientEvents(HTTPClient* client, int wait) {
+    #ifdef HTTP_WITH_URING
+    if (client->uring) {
+        if (!enterUring(client->uring, wait)) return false;
+        reapUringCompletions(client);
+        return true;
+    }
     #endif
+    struct epoll_event events[64];
+    int count = epoll_wait(client->epfd, events, sizeof(events) / sizeof(events[0]), wait);
+    if (count < 0 && errno != EINTR) return false;
+    for (int i = 0; i < count; i++) handleTaskEvent(client, events[i].data.ptr, events[i].events);
     return true;
 }
 
-// Parses the status line of the HTTP response (e.g., HTTP/1.x 200 OK).
-// Validates the HTTP version and extracts the status code.
-static bool parseHTTPStatusLine(HTTPResponseInfo* msg, const char* line) {
-    if (!msg || !line) return false;
-
-    // Check if the content starts with "HTTP/1.x"
-    if (strncmp(line, "HTTP/1.", 7) != 0) return false;
-
-    // Find the first ' '
-    char* statusStart = strchr(line, ' ');
-    if (!statusStart) return false;
-    statusStart++;
-    if (!isdigit(*statusStart)) return false;
-    int result = atoi(statusStart); // " OK" will be ignored by atoi()
-    if (result >= 100 && result <= 999) {
-    	#ifdef DEBUG
-    	printf("[parseHTTPStatusLine]: parsed http status_code: %d\n", result);
-    	#endif
-        msg->l7.status_code = result;
-    	return true;
+// Calls the callbacks of finished tasks and frees them, callbacks may submit new requests.
+static void deliverFinishedTasks(HTTPClient* client) {
+    while (client->finishedHead) {
+        HTTPTask* task = client->finishedHead;
+        client->finishedHead = task->next;
+        if (!client->finishedHead) client->finishedTail = NULL;
+        task->callback(task->rq, task->msg, task->ctx);
+        free(task);
     }
-    return false;
 }
 
-// Parses headers in the HTTP response.
-// Splits the header line into field name and value (e.g., Content-Length: 123).
-// Specific handling for Content-Length, Set-Cookie, and Transfer-Encoding headers.
-static bool parseHTTPHeader(HTTPResponseInfo* msg, const char* line) {
-    if (!msg || !line) return false;
+int RunHTTPClient(HTTPClient* client, int timeout_ms) {
+    if (!client) return -1;
+    long long end = timeout_ms >= 0 ? monotonicMs() + timeout_ms : -1;
 
-    // split header and value by ":"
-    const char* colon = strchr(line, ':');
-    if (!colon) return false;
+    for (;;) {
+        startPendingTasks(client);
+        deliverFinishedTasks(client);
+        if (client->activeCount == 0 && client->pendingCount == 0) break;
 
-    // Extract the field name and value, strncpy the field name into fieldName
-    // and take the following content as the field value:
-    size_t fieldNameLen = colon - line;
-    char fieldName[64];
-    if (fieldNameLen >= sizeof(fieldName)) return false;
-    strncpy(fieldName, line, fieldNameLen);
-    fieldName[fieldNameLen] = '\0';
-    const char* fieldValue = colon + 1;
-    while (*fieldValue == ' ') fieldValue++; // if multi space exists
+        // sleep until the nearest task deadline, or the end of the run
+        long long now = monotonicMs();
+        if (end >= 0 && now >= end) break;
+        long long wakeup = end;
+        for (HTTPTask* task = client->active; task; task = task->nextActive) {
+            if (wakeup < 0 || task->deadline < wakeup) wakeup = task->deadline;
+        }
+        // tasks waiting for cancelled io_uring operations have no deadline (LLONG_MAX)
+        int wait = wakeup < 0 || wakeup - now > INT_MAX ? -1 : (wakeup > now ? (int)(wakeup - now) : 0);
+        if (!pollClientEvents(client, wait)) return -1;
 
-    // handle the specified headers if you need, generally the followed are needed to handle
-    if (strcasecmp(fieldName, "Content-Length") == 0) msg->l7.content_length = atoi(fieldValue);
-    if (strcasecmp(fieldName, "Set-Cookie") == 0) msg->l7.cookie = (char*)fieldValue;
-    if (strcasecmp(fieldName, "Transfer-Encoding") == 0 && strcmp(fieldValue, "chunked") == 0) msg->l7.chunkedTransfer = true;
+        now = monotonicMs();
+        for (HTTPTask* task = client->active; task; ) {
+            HTTPTask* next = task->nextActive;
+            if (task->deadline <= now) finishTask(client, task, -5);
+            task = next;
+        }
+    }
+    return client->activeCount + client->pendingCount;
+}
 
+bool NextHTTPCompletion(HTTPClient* client, HTTPRequestInfo** rq, HTTPResponseInfo** msg, void** ctx) {
+    if (!client || !client->completedHead) return false;
+    HTTPTask* task = client->completedHead;
+    client->completedHead = task->next;
+    if (!client->completedHead) client->completedTail = NULL;
+    if (rq) *rq = task->rq;
+    if (msg) *msg = task->msg;
+    else FreeHTTPResponseResource(task->msg);
+    if (ctx) *ctx = task->ctx;
+    free(task);
     return true;
 }
 
-// Parses the entire HTTP message (status line, headers, and body).
-// First, parses the status line, then the headers, and finally extracts the message body.
-// If chunked transfer encoding is used, the body is handled separately.
-static bool parseHTTPMessage(HTTPResponseInfo* msg) {
-    if (!msg || !msg->l4.buffer || msg->l4.totalSize <= 5) return false;
+static void freeTaskList(HTTPTask* task) {
+    while (task) {
+        HTTPTask* next = task->next;
+        FreeHTTPResponseResource(task->msg);
+        free(task);
+        task = next;
+    }
+}
 
-    char* cursor = msg->l4.buffer; // current position
-    char* end = msg->l4.buffer + msg->l4.totalSize; // end of the buffer
+void DestroyHTTPClient(HTTPClient* client) {
+    if (!client) return;
+    #ifdef HTTP_WITH_URING
+    destroyUring(client->uring);
+    #endif
+    while (client->active) {
+        HTTPTask* task = client->active;
+        client->active = task->nextActive;
+        if (task->rq->sd >= 0) close(task->rq->sd);
+        task->rq->sd = -1;
+        FreeHTTPResponseResource(task->msg);
+        free(task);
+    }
+    freeTaskList(client->pendingHead);
+    freeTaskList(client->finishedHead);
+    freeTaskList(client->completedHead);
+    close(client->epfd);
+    free(client->hosts);
+    free(client);
+}
 
-    // 1. parse status line
-    char* lineEnd = strstr(cursor, "\r\n");
-    if (!lineEnd) return false;
-    *lineEnd = '\0'; // replace crlf with 0x00
-    if (!parseHTTPStatusLine(msg, cursor)) return false;
-    cursor = lineEnd + 2; // move to next line
+// Edge selection: a fixed set of candidate addresses drawn from the configured ranges, each scored with
+// an EWMA of its latency and of its failure rate. Candidates failing in a row are ejected and, once the
+// ejection is over, replaced by a fresh address.
+typedef struct {
+    struct sockaddr_in addr;
+    double latencyMs;        // EWMA of successful samples
+    double failureRate;      // EWMA of 0 (success) and 1 (failure)
+    unsigned long samples;
+    unsigned long selected;
+    int consecutiveFailures;
+    long long ejectedUntil;  // monotonicMs(), 0 = active
+} HTTPEdgeCandidate;
 
-    // 2. parse headers
-    while (cursor < end) {
-        lineEnd = strstr(cursor, "\r\n");
-        if (!lineEnd) return false; // invalid header
-        *lineEnd = '\0';
+typedef struct {
+    uint32_t first; // host byte order
+    uint32_t size;  // addresses in the range
+} HTTPEdgeRange;
 
-        if (cursor == lineEnd) {
-            cursor += 2; // eat line
-            break;
+struct HTTPEdgeSelector {
+    pthread_mutex_t lock;
+    HTTPEdgeSelectorOptions options;
+    char* probeHost;
+    char* probePath;
+    HTTPEdgeRange* ranges;
+    int rangeCount;
+    unsigned long long rangeTotal;
+    HTTPEdgeCandidate* candidates;
+    int count;
+};
+
+// Parses "a.b.c.d/bits" (a single address without /bits).
+static bool parseEdgeRange(const char* text, HTTPEdgeRange* range) {
+    char address[INET_ADDRSTRLEN];
+    const char* slash = strchr(text, '/');
+    size_t length = slash ? (size_t)(slash - text) : strlen(text);
+    int bits = slash ? atoi(slash + 1) : 32;
+    struct in_addr parsed;
+    if (length >= sizeof(address) || bits < 1 || bits > 32) return false;
+    memcpy(address, text, length);
+    address[length] = '\0';
+    if (inet_pton(AF_INET, address, &parsed) != 1) return false;
+
+    uint32_t mask = bits == 32 ? 0xFFFFFFFFu : ~(0xFFFFFFFFu >> bits);
+    range->first = ntohl(parsed.s_addr) & mask;
+    range->size = bits == 32 ? 1 : (uint32_t)(~mask + 1);
+    return true;
+}
+
+// Draws a random address from the ranges that is not a candidate yet, skipping .0 and .255 in ranges
+// large enough to have them. After a few random tries it walks on from a random index, so a free address of
+// a small range is found too. Gives up on uniqueness after HTTP_EDGE_SCAN_LIMIT addresses.
+static struct sockaddr_in drawEdgeAddress(HTTPEdgeSelector* selector) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(selector->options.port) };
+    unsigned long long walk = nextRandom() % selector->rangeTotal;
+    unsigned long long walkLength = selector->rangeTotal < HTTP_EDGE_SCAN_LIMIT ? selector->rangeTotal : HTTP_EDGE_SCAN_LIMIT;
+    for (unsigned long long attempt = 0; attempt < 16 + walkLength; attempt++) {
+        unsigned long long index = attempt < 16 ? nextRandom() % selector->rangeTotal : (walk + attempt - 16) % selector->rangeTotal;
+        const HTTPEdgeRange* range = selector->ranges;
+        while (index >= range->size) {
+            index -= range->size;
+            range++;
         }
+        uint32_t host = range->first + (uint32_t)index;
+        if (range->size >= 256 && ((host & 0xFF) == 0 || (host & 0xFF) == 255)) continue;
+        addr.sin_addr.s_addr = htonl(host);
 
-        if (!parseHTTPHeader(msg, cursor)) return false;
-        cursor = lineEnd + 2;
+        bool taken = false;
+        for (int i = 0; i < selector->count && !taken; i++) taken = selector->candidates[i].addr.sin_addr.s_addr == addr.sin_addr.s_addr;
+        if (!taken) break;
+    }
+    return addr;
+}
+
+HTTPEdgeSelector* CreateHTTPEdgeSelector(const HTTPEdgeSelectorOptions* options) {
+    static const char* defaultRanges[] = { "104.16.0.0/16" };
+    HTTPEdgeSelector* selector = calloc(1, sizeof(HTTPEdgeSelector));
+    if (!selector) return NULL;
+    if (options) selector->options = *options;
+    HTTPEdgeSelectorOptions* o = &selector->options;
+    if (!o->ranges || o->range_count <= 0) {
+        o->ranges = defaultRanges;
+        o->range_count = 1;
+    }
+    if (o->candidates <= 0) o->candidates = 16;
+    if (o->port <= 0) o->port = 80;
+    if (o->probe_timeout_ms <= 0) o->probe_timeout_ms = 1000;
+    if (o->explore_percent == 0) o->explore_percent = 10;
+    if (o->explore_percent < 0) o->explore_percent = 0; // never explore
+    if (o->ewma_weight_percent <= 0 || o->ewma_weight_percent > 100) o->ewma_weight_percent = 20;
+    if (o->eject_after_failures <= 0) o->eject_after_failures = 3;
+    if (o->eject_ms <= 0) o->eject_ms = 30000;
+
+    selector->ranges = calloc(o->range_count, sizeof(HTTPEdgeRange));
+    selector->candidates = calloc(o->candidates, sizeof(HTTPEdgeCandidate));
+    selector->probeHost = o->probe_host ? strdup(o->probe_host) : NULL;
+    selector->probePath = strdup(o->probe_path ? o->probe_path : "/");
+    bool valid = selector->ranges && selector->candidates && selector->probePath && (selector->probeHost || !o->probe_host);
+    for (int i = 0; valid && i < o->range_count; i++) {
+        valid = o->ranges[i] && parseEdgeRange(o->ranges[i], &selector->ranges[i]);
+        selector->rangeTotal += selector->ranges[i].size;
+    }
+    // the strings are copied or parsed, none of them is kept
+    o->ranges = NULL;
+    o->probe_host = NULL;
+    o->probe_path = NULL;
+    selector->rangeCount = o->range_count;
+    if (!valid || pthread_mutex_init(&selector->lock, NULL) != 0) {
+        free(selector->ranges);
+        free(selector->candidates);
+        free(selector->probeHost);
+        free(selector->probePath);
+        free(selector);
+        return NULL;
+    }
+
+    for (int i = 0; i < o->candidates; i++) {
+        selector->candidates[i].addr = drawEdgeAddress(selector);
+        selector->count++;
     }
+    return selector;
+}
 
-    // 3. parse message
-    if (cursor < end) {
-        msg->l7.content = cursor;
+void DestroyHTTPEdgeSelector(HTTPEdgeSelector* selector) {
+    if (!selector) return;
+    pthread_mutex_destroy(&selector->lock);
+    free(selector->ranges);
+    free(selector->candidates);
+    free(selector->probeHost);
+    free(selector->probePath);
+    free(selector);
+}
+
+// Expected cost of a candidate: its latency plus a probe timeout for the share of attempts that fail.
+static double edgeScore(const HTTPEdgeSelector* selector, const HTTPEdgeCandidate* candidate) {
+    return candidate->latencyMs + candidate->failureRate * selector->options.probe_timeout_ms;
+}
 
-        int diffSize = (int)(end - cursor);
+// Replaces candidates whose ejection is over. Called with the lock held.
+static void replaceEjectedEdges(HTTPEdgeSelector* selector, long long now) {
+    for (int i = 0; i < selector->count; i++) {
+        HTTPEdgeCandidate* candidate = &selector->candidates[i];
+        if (!candidate->ejectedUntil || candidate->ejectedUntil > now) continue;
         #ifdef DEBUG
-        printf("[parseHTTPMessage]: content-length=%d real length=%d\n", msg->l7.content_length, diffSize);
-        printf("[SendHTTPRequest]: http content body:\n--------Begin of content--------\n%s--------End of content--------\n", msg->l7.content);
+        char address[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &candidate->addr.sin_addr, address, sizeof(address));
+        printf("[replaceEjectedEdges]: replacing %s\n", address);
         #endif
-        // Calculate the actual length and compare it. If they are not the same, it indicates a problem in the transmission.
-        // Based on the order of the code, the Content-Length header will be parsed first. So before entering this part of the code,
-        // l7.content_length should contain the Content-Length value sent by the server. If the server does not send it, it is initialized to -1 (this is set during initialization).
-        // Then, by comparing the pointers, we check if there is any data. If the two pointer positions are not the same, it means there is data.
-        // If the server did not send a Content-Length header, the value will be less than 0 (-1 < 0), so we use the difference between the pointers as the content length.
-        // If the server sent the Content-Length, the value should be greater than or equal to 0. Therefore, we perform a comparison, and if they don't match, it indicates an issue with the transmission.
-        if (msg->l7.content_length >= 0) {
-            if (msg->l7.content_length != diffSize) return false;
+        memset(candidate, 0, sizeof(*candidate));
+        candidate->addr = drawEdgeAddress(selector);
+    }
+}
+
+// Whether a candidate can be picked: not ejected and not the excluded address (may be NULL).
+static bool edgeSelectable(const HTTPEdgeCandidate* candidate, const struct sockaddr_in* exclude) {
+    return !candidate->ejectedUntil && (!exclude || candidate->addr.sin_addr.s_addr != exclude->sin_addr.s_addr);
+}
+
+// SelectHTTPEdge() that never picks exclude, e.g. for a second address to send a duplicate to.
+static bool selectHTTPEdge(HTTPEdgeSelector* selector, const struct sockaddr_in* exclude, struct sockaddr_in* addr) {
+    pthread_mutex_lock(&selector->lock);
+    long long now = monotonicMs();
+    replaceEjectedEdges(selector, now);
+
+    // best scored active candidate, or a random active one to explore (or while nothing is scored yet)
+    HTTPEdgeCandidate* chosen = NULL;
+    int active = 0;
+    for (int i = 0; i < selector->count; i++) {
+        HTTPEdgeCandidate* candidate = &selector->candidates[i];
+        if (!edgeSelectable(candidate, exclude)) continue;
+        active++;
+        if (candidate->samples && (!chosen || edgeScore(selector, candidate) < edgeScore(selector, chosen))) chosen = candidate;
+    }
+    if (active > 0 && (!chosen || (int)(nextRandom() % 100) < selector->options.explore_percent)) {
+        int pick = (int)(nextRandom() % active);
+        for (int i = 0; i < selector->count; i++) {
+            if (!edgeSelectable(&selector->candidates[i], exclude)) continue;
+            if (pick-- == 0) {
+                chosen = &selector->candidates[i];
+                break;
+            }
+        }
+    }
+    // everything is ejected: the one that comes back first
+    for (int i = 0; !chosen && active == 0 && i < selector->count; i++) {
+        if (exclude && selector->candidates[i].addr.sin_addr.s_addr == exclude->sin_addr.s_addr) continue;
+        if (!chosen || selector->candidates[i].ejectedUntil < chosen->ejectedUntil) chosen = &selector->candidates[i];
+    }
+    if (chosen) {
+        chosen->selected++;
+        *addr = chosen->addr;
+    }
+    pthread_mutex_unlock(&selector->lock);
+    return chosen != NULL;
+}
+
+bool SelectHTTPEdge(HTTPEdgeSelector* selector, struct sockaddr_in* addr) {
+    if (!selector || !addr) return false;
+    return selectHTTPEdge(selector, NULL, addr);
+}
+
+void ReportHTTPEdge(HTTPEdgeSelector* selector, const struct sockaddr_in* addr, bool success, double latency_ms) {
+    if (!selector || !addr) return;
+    pthread_mutex_lock(&selector->lock);
+    double weight = selector->options.ewma_weight_percent / 100.0;
+    for (int i = 0; i < selector->count; i++) {
+        HTTPEdgeCandidate* candidate = &selector->candidates[i];
+        if (candidate->addr.sin_addr.s_addr != addr->sin_addr.s_addr) continue;
+        if (success) {
+            bool first = candidate->latencyMs == 0; // no successful sample yet
+            candidate->latencyMs = first ? latency_ms : candidate->latencyMs + weight * (latency_ms - candidate->latencyMs);
+            candidate->failureRate -= weight * candidate->failureRate;
+            candidate->consecutiveFailures = 0;
         } else {
-            msg->l7.content_length = diffSize;
-            return true;
+            candidate->failureRate += weight * (1 - candidate->failureRate);
+            if (++candidate->consecutiveFailures >= selector->options.eject_after_failures && !candidate->ejectedUntil) {
+                candidate->ejectedUntil = monotonicMs() + selector->options.eject_ms;
+            }
         }
+        candidate->samples++;
+        break;
     }
-    if (cursor == end) {
-        msg->l7.content = NULL;
-        msg->l7.content_length = 0;
-        return true;
+    pthread_mutex_unlock(&selector->lock);
+}
+
+// Connect probe: all connects are started at once and waited for together. latencies[i] is the connect
+// time in milliseconds, or -1 if it failed or timed out.
+static void probeEdgesByConnect(const struct sockaddr_in* addrs, int count, int timeoutMs, double* latencies) {
+    struct pollfd* fds = calloc(count, sizeof(struct pollfd));
+    if (!fds) {
+        for (int i = 0; i < count; i++) latencies[i] = -1;
+        return;
     }
-    return false;
+    long long start = monotonicNs();
+    int pending = 0;
+    for (int i = 0; i < count; i++) {
+        latencies[i] = -1;
+        fds[i].fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        fds[i].events = POLLOUT;
+        if (fds[i].fd < 0) continue;
+        int result = connect(fds[i].fd, (const struct sockaddr*)&addrs[i], sizeof(addrs[i]));
+        if (result == 0) latencies[i] = (monotonicNs() - start) / 1e6;
+        if (result == 0 || errno != EINPROGRESS) {
+            close(fds[i].fd);
+            fds[i].fd = -1; // poll() skips negative descriptors
+            continue;
+        }
+        pending++;
+    }
+
+    long long deadline = monotonicMs() + timeoutMs;
+    while (pending > 0) {
+        long long left = deadline - monotonicMs();
+        if (left <= 0) break;
+        int ready = poll(fds, count, (int)left);
+        if (ready < 0 && errno != EINTR) break;
+        for (int i = 0; i < count && ready > 0; i++) {
+            if (fds[i].fd < 0 || !fds[i].revents) continue;
+            int error = 0;
+            socklen_t length = sizeof(error);
+            if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0) latencies[i] = (monotonicNs() - start) / 1e6;
+            close(fds[i].fd);
+            fds[i].fd = -1;
+            pending--;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (fds[i].fd >= 0) close(fds[i].fd);
+    }
+    free(fds);
 }
 
-// Handles chunked transfer encoding in HTTP responses (used when the Transfer-Encoding: chunked header is present).
-// Reads the chunk sizes and copies the body data into the response buffer.
-static bool parseChunkedBody(HTTPResponseInfo* msg) {
-    // Create a new `parseBuffer` to hold the response headers and copy them over, then clear the original buffer.
-    // The reason for copying the entire `l4.bufferSize` is to ensure the buffer is large enough.
-    char* parseBuffer = (char*)malloc(msg->l4.bufferSize);
-    memcpy(parseBuffer, msg->l7.content, msg->l7.content_length);
-    memset(msg->l4.buffer, 0, msg->l4.bufferSize);
-    msg->l7.content_length = 0;
+typedef struct {
+    long long start;  // monotonicNs() when the probes were submitted
+    double* latency;  // where the result of this probe goes
+} HTTPEdgeProbe;
 
-    // The original pointer needs to be preserved since it will be used later during the free operation. 
-    // parsePtr and parsedSize are used to move forward and keep track of the offset.
+static void finishEdgeProbe(HTTPRequestInfo* rq, HTTPResponseInfo* msg, void* ctx) {
+    (void)rq;
+    HTTPEdgeProbe* probe = ctx;
+    bool success = msg->error == 0 && msg->l7.status_code > 0 && msg->l7.status_code < 500;
+    *probe->latency = success ? (monotonicNs() - probe->start) / 1e6 : -1;
+    FreeHTTPResponseResource(msg);
+}
 
-    char* parsePtr = parseBuffer;
-    
-    while (1) {
-        // find '\r\n' and move ptr
-        char* crlf = strstr(parsePtr, "\r\n");
-        if (!crlf) goto error;
+// Request probe: a GET of the probe path with the probe Host to every address at once, through the event loop client.
+static void probeEdgesByRequest(HTTPEdgeSelector* selector, const struct sockaddr_in* addrs, int count, double* latencies) {
+    HTTPClientOptions clientOptions = { .max_in_flight = count, .max_in_flight_per_host = 1, .request_timeout_ms = selector->options.probe_timeout_ms };
+    HTTPClient* client = CreateHTTPClient(&clientOptions);
+    HTTPRequestInfo* requests = calloc(count, sizeof(HTTPRequestInfo));
+    HTTPEdgeProbe* probes = calloc(count, sizeof(HTTPEdgeProbe));
+    long long start = monotonicNs();
+    for (int i = 0; i < count; i++) {
+        latencies[i] = -1;
+        if (!client || !requests || !probes) continue;
+        requests[i] = (HTTPRequestInfo){
+            .host = selector->probeHost, .port = selector->options.port, .sd = -1, .method = HTTP_GET,
+            .query = selector->probePath, .cookie = "", .data_length = -1, .addr = &addrs[i],
+        };
+        probes[i] = (HTTPEdgeProbe){ start, &latencies[i] };
+        SubmitHTTPRequest(client, &requests[i], finishEdgeProbe, &probes[i]);
+    }
+    if (client) RunHTTPClient(client, -1);
+    DestroyHTTPClient(client);
+    free(requests);
+    free(probes);
+}
 
-        // The length is determined by the difference between the starting pointer and the pointer before the "\r\n". 
-        // It needs to be converted to decimal for further calculations. If the length is 0, it indicates the end.
-        char hex_size[32] = {0};
-        size_t hex_len = crlf - parsePtr;
-        if (hex_len >= sizeof(hex_size)) goto error;
-        memcpy(hex_size, parsePtr, hex_len);
-        char* endptr;
-        long chunkSize = strtol(hex_size, &endptr, 16);
-        if (*endptr != '\0' || chunkSize < 0) goto error;
-        if (chunkSize == 0) break;
+int ProbeHTTPEdges(HTTPEdgeSelector* selector) {
+    if (!selector) return -1;
+    pthread_mutex_lock(&selector->lock);
+    replaceEjectedEdges(selector, monotonicMs());
+    int count = 0;
+    struct sockaddr_in* addrs = calloc(selector->count, sizeof(struct sockaddr_in));
+    for (int i = 0; addrs && i < selector->count; i++) {
+        if (!selector->candidates[i].ejectedUntil) addrs[count++] = selector->candidates[i].addr;
+    }
+    pthread_mutex_unlock(&selector->lock);
+    double* latencies = calloc(count ? count : 1, sizeof(double));
+    if (!addrs || !latencies) {
+        free(addrs);
+        free(latencies);
+        return -1;
+    }
 
-        // Move parsePtr to the position after the "\r\n", which is the start of the data chunk.
-        // Copy the data in chunks back into the buffer of the structure.
-        parsePtr = crlf + 2;
-        memcpy(msg->l7.content + msg->l7.content_length, parsePtr, chunkSize);
-        msg->l7.content_length += chunkSize;
+    // probe without the lock so that SelectHTTPEdge() keeps working meanwhile
+    if (selector->probeHost) probeEdgesByRequest(selector, addrs, count, latencies);
+    else probeEdgesByConnect(addrs, count, selector->options.probe_timeout_ms, latencies);
+    int reachable = 0;
+    for (int i = 0; i < count; i++) {
+        #ifdef DEBUG
+        char address[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addrs[i].sin_addr, address, sizeof(address));
+        printf("[ProbeHTTPEdges]: %s %.3f ms\n", address, latencies[i]);
+        #endif
+        ReportHTTPEdge(selector, &addrs[i], latencies[i] >= 0, latencies[i]);
+        if (latencies[i] >= 0) reachable++;
+    }
+    free(addrs);
+    free(latencies);
+    return reachable;
+}
 
-        // move to the next chunk until the size = 0
-        parsePtr += chunkSize + 2;
+int GetHTTPEdgeStats(HTTPEdgeSelector* selector, HTTPEdgeStats* out, int max) {
+    if (!selector) return -1;
+    pthread_mutex_lock(&selector->lock);
+    for (int i = 0; out && i < selector->count && i < max; i++) {
+        const HTTPEdgeCandidate* candidate = &selector->candidates[i];
+        out[i] = (HTTPEdgeStats){
+            .addr = candidate->addr,
+            .latency_ms = candidate->latencyMs,
+            .failure_rate = candidate->failureRate,
+            .score = edgeScore(selector, candidate),
+            .samples = candidate->samples,
+            .selected = candidate->selected,
+            .ejected = candidate->ejectedUntil != 0,
+        };
     }
+    int count = selector->count;
+    pthread_mutex_unlock(&selector->lock);
+    return count;
+}
 
+#define HTTP_HEDGE_SAMPLES 128    // recent latencies the p95 delay is taken from
+#define HTTP_HEDGE_MIN_SAMPLES 20 // before that initial_delay_ms is used
+#define HTTP_HEDGE_MAX_TOKENS 10  // duplicates the budget can save up for a burst of slow requests
 
-    free(parseBuffer);
-    return true;
+struct HTTPHedgePolicy {
+    pthread_mutex_t lock;
+    HTTPHedgeOptions options;
+    struct sockaddr_in* alternates;
+    int nextAlternate;
+    double tokens;                        // duplicates that may be sent, each request adds budget_percent / 100
+    long long samples[HTTP_HEDGE_SAMPLES]; // latencies in microseconds, a ring
+    int sampleCount;
+    int nextSample;
+    HTTPHedgeStats stats;
+};
 
-error:
-    free(parseBuffer);
-    return false;
+// The two requests of one FetchHTTPHedged() call racing on a client of their own.
+typedef struct {
+    HTTPClient* client;
+    HTTPRequestInfo* requests[2]; // the request and its duplicate
+    int outstanding;
+    HTTPResponseInfo* winner;     // first success, or the last failure
+    int winnerIndex;
+    HTTPResponseInfo* failed;     // a failure while the other request could still succeed
+    int failedIndex;
+    bool cancelled;
+    long long started[2];         // monotonicNs() when each request was submitted
+    long long finished[2];        // and when it completed, 0 while it has not
+} HTTPHedgeRace;
+
+static int compareLatencies(const void* a, const void* b) {
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return (x > y) - (x < y);
 }
 
-// Sends an HTTP request with the specified method (GET, POST, etc.) and headers.
-// Includes optional body data if present.
-// Sends the request in raw TCP format.
-int SendHTTPRequest(HTTPRequestInfo* rq) {
-    if (!createTCPSocket(rq)) return -1; // no manually creating socket needed
-
-    if (rq->method < 0 || rq->method >= HTTP_METHOD_MAX) return -1;
-    if (rq->content_type < 0 || rq->content_type >= CONTENT_TYPE_MAX) return -1;
-    if (!rq->cookie) rq->cookie = "";
-
-    bool sendBody = false;
-    int offset = 0;
-    if (rq->data_length >= 0 && rq->data) sendBody = true;
-    char buffer[4096];
-    offset += snprintf(buffer, sizeof(buffer),
-        "%s %s HTTP/1.1\r\n"
-        "Host: %s\r\n"
-        "Accept: */*\r\n"
-        "Accept-Language: en-US\r\n"
-        "Connection: close\r\n"
-        "User-Agent: "HTTP_USER_AGENT"\r\n"
-        "Content-Type: %s\r\n"
-        "Cookie: %s\r\n",
-        HTTPMethodString[rq->method],
-        rq->query, 
-        rq->host,
-        HTTPContentTypeString[rq->content_type],
-        rq->cookie
-    );
-
-    // offset is the displacement used to move the pointer and calculate the remaining space. 
-    // Since snprintf is used and the HTTP header content is relatively short, there won't be any overflow issues.
-    if (sendBody) offset += snprintf(buffer + offset, sizeof(buffer) - offset, "Content-Length: %d\r\n", rq->data_length);
-    offset += snprintf(buffer + offset, sizeof(buffer) - offset, "\r\n");
-    if (offset >= sizeof(buffer)) return -1;
-    #ifdef DEBUG
-    printf("[SendHTTPRequest]: about to send http request:\n--------Begin of content--------\n%s--------End of content--------\n", buffer);
-    #endif
-    // all of which are printable, so use strlen
-    if (!sendTCPRawData(rq->sd, buffer, strlen(buffer))) return -1;
-    if (sendBody && !sendTCPRawData(rq->sd, rq->data, rq->data_length)) return -1;
-    return 0;
+// Delay of the next request: delay_ms, or the p95 of the recent latencies. Called with the lock held.
+static int hedgeDelay(HTTPHedgePolicy* policy) {
+    if (policy->options.delay_ms > 0) return policy->options.delay_ms;
+    if (policy->sampleCount < HTTP_HEDGE_MIN_SAMPLES) return policy->options.initial_delay_ms;
+    long long sorted[HTTP_HEDGE_SAMPLES];
+    memcpy(sorted, policy->samples, policy->sampleCount * sizeof(long long));
+    qsort(sorted, policy->sampleCount, sizeof(long long), compareLatencies);
+    int delay = (int)((sorted[policy->sampleCount * 95 / 100] + 999) / 1000);
+    return delay > policy->options.min_delay_ms ? delay : policy->options.min_delay_ms;
 }
 
-// Reads and parses the HTTP response after sending an HTTP request.
-// Handles both normal and chunked transfer responses.
-HTTPResponseInfo* FetchHTTPResponse(HTTPRequestInfo* rq) {
-    HTTPResponseInfo* msg = calloc(1, sizeof(HTTPResponseInfo));
-    if (!msg) return NULL;
-    msg->error = 0;
-    msg->l7.chunkedTransfer = false;
-    msg->l7.content_length = -1;
-    if (!readTCPRawData(rq->sd, msg)) {
-        msg->error = -1;
-        goto exit;
+HTTPHedgePolicy* CreateHTTPHedgePolicy(const HTTPHedgeOptions* options) {
+    HTTPHedgePolicy* policy = calloc(1, sizeof(HTTPHedgePolicy));
+    if (!policy) return NULL;
+    if (options) policy->options = *options;
+    if (policy->options.initial_delay_ms <= 0) policy->options.initial_delay_ms = 100;
+    if (policy->options.min_delay_ms <= 0) policy->options.min_delay_ms = 5;
+    if (policy->options.budget_percent <= 0) policy->options.budget_percent = 10;
+    if (policy->options.budget_percent > 100) policy->options.budget_percent = 100;
+    if (!policy->options.alternates || policy->options.alternate_count < 0) policy->options.alternate_count = 0;
+
+    if (policy->options.alternate_count > 0) {
+        policy->alternates = malloc(policy->options.alternate_count * sizeof(struct sockaddr_in));
+        if (policy->alternates) memcpy(policy->alternates, policy->options.alternates, policy->options.alternate_count * sizeof(struct sockaddr_in));
     }
-    if (!parseHTTPMessage(msg)) {
-        msg->error = -2;
-        goto exit;
+    policy->options.alternates = policy->alternates;
+    if ((policy->options.alternate_count > 0 && !policy->alternates) || pthread_mutex_init(&policy->lock, NULL) != 0) {
+        free(policy->alternates);
+        free(policy);
+        return NULL;
     }
-    if (msg->l7.chunkedTransfer && !parseChunkedBody(msg)) {
-        msg->error = -3;
-        goto exit;
+    policy->tokens = 1;
+    policy->stats.delay_ms = hedgeDelay(policy);
+    return policy;
+}
+
+void DestroyHTTPHedgePolicy(HTTPHedgePolicy* policy) {
+    if (!policy) return;
+    pthread_mutex_destroy(&policy->lock);
+    free(policy->alternates);
+    free(policy);
+}
+
+void GetHTTPHedgeStats(HTTPHedgePolicy* policy, HTTPHedgeStats* stats) {
+    if (!policy || !stats) return;
+    pthread_mutex_lock(&policy->lock);
+    *stats = policy->stats;
+    pthread_mutex_unlock(&policy->lock);
+}
+
+// A second address for a duplicate of a request to primary: the best other candidate of the selector, or the
+// next alternate that differs from primary.
+static bool pickHedgeAddress(HTTPHedgePolicy* policy, const struct sockaddr_in* primary, int port, struct sockaddr_in* out) {
+    if (policy->options.selector) return selectHTTPEdge(policy->options.selector, primary, out);
+    bool found = false;
+    pthread_mutex_lock(&policy->lock);
+    for (int i = 0; !found && i < policy->options.alternate_count; i++) {
+        int index = (policy->nextAlternate + i) % policy->options.alternate_count;
+        if (policy->alternates[index].sin_addr.s_addr == primary->sin_addr.s_addr) continue;
+        *out = policy->alternates[index];
+        out->sin_family = AF_INET;
+        out->sin_port = htons(port);
+        policy->nextAlternate = index + 1;
+        found = true;
     }
+    pthread_mutex_unlock(&policy->lock);
+    return found;
+}
 
-exit:
-    close(rq->sd);
-    return msg;
+// Keeps the first success and cancels the other request, failures wait for the other request to finish.
+static void completeHedgedRequest(HTTPRequestInfo* rq, HTTPResponseInfo* msg, void* ctx) {
+    HTTPHedgeRace* race = ctx;
+    int index = rq == race->requests[0] ? 0 : 1;
+    race->finished[index] = monotonicNs();
+    race->outstanding--;
+    if (race->winner || (msg->error != 0 && race->outstanding > 0)) {
+        if (!race->winner && !race->failed) {
+            race->failed = msg;
+            race->failedIndex = index;
+        } else {
+            FreeHTTPResponseResource(msg);
+        }
+        return;
+    }
+    race->winner = msg;
+    race->winnerIndex = index;
+    if (race->outstanding > 0 && CancelHTTPRequest(race->client, race->requests[1 - index]) == 0) race->cancelled = true;
 }
 
-void FreeHTTPResponseResource(HTTPResponseInfo* msg) {
-    if (!msg) return;
-    if (msg->l4.buffer) free(msg->l4.buffer);
-    free(msg);
-}
\ No newline at end of file
+HTTPResponseInfo* FetchHTTPHedged(HTTPHedgePolicy* policy, HTTPRequestInfo* rq) {
+    if (!policy || !rq) return NULL;
+    HTTPClientOptions clientOptions = { .max_in_flight = 2, .max_in_flight_per_host = 2 };
+    HTTPClient* client = CreateHTTPClient(&clientOptions);
+    if (!client) return NULL;
+    HTTPRequestInfo duplicate;
+    HTTPHedgeRace race = { .client = client, .requests = { rq, &duplicate } };
+    struct sockaddr_in addrs[2];
+    bool hedgeable = rq->method == HTTP_GET && !rq->body && !(rq->data && rq->data_length > 0) && requestDestination(rq, &addrs[0]);
+
+    pthread_mutex_lock(&policy->lock);
+    policy->stats.requests++;
+    policy->tokens += policy->options.budget_percent / 100.0;
+    if (policy->tokens > HTTP_HEDGE_MAX_TOKENS) policy->tokens = HTTP_HEDGE_MAX_TOKENS;
+    int delay = hedgeDelay(policy);
+    pthread_mutex_unlock(&policy->lock);
+
+    race.started[0] = monotonicNs();
+    if (SubmitHTTPRequest(client, rq, completeHedgedRequest, &race) < 0) {
+        DestroyHTTPClient(client);
+        return NULL;
+    }
+    race.outstanding = 1;
+    bool hedged = false;
+    if (hedgeable && RunHTTPClient(client, delay) > 0 && !race.winner) {
+        pthread_mutex_lock(&policy->lock);
+        bool allowed = policy->tokens >= 1;
+        if (allowed) policy->tokens -= 1;
+        else policy->stats.budget_denied++;
+        pthread_mutex_unlock(&policy->lock);
+
+        if (allowed && pickHedgeAddress(policy, &addrs[0], rq->port, &addrs[1])) {
+            duplicate = *rq;
+            duplicate.addr = &addrs[1];
+            race.started[1] = monotonicNs();
+            hedged = SubmitHTTPRequest(client, &duplicate, completeHedgedRequest, &race) == 0;
+            if (hedged) race.outstanding++;
+        } else if (allowed) {
+            pthread_mutex_lock(&policy->lock);
+            policy->tokens += 1;
+            pthread_mutex_unlock(&policy->lock);
+        }
+        #ifdef DEBUG
+        printf("[FetchHTTPHedged]: no response after %d ms, %s\n", delay, hedged ? "hedged" : "not hedged");
+        #endif
+    }
+    RunHTTPClient(client, -1);
+    DestroyHTTPClient(client);
+    long long done = monotonicNs();
+    for (int i = 0; i < 2; i++) {
+        if (!race.finished[i]) race.finished[i] = done;
+    }
+
+    if (!race.winner) {
+        race.winner = race.failed;
+        race.winnerIndex = race.failedIndex;
+        race.failed = NULL;
+    }
+    // each address is scored by its own request, a duplicate did not wait for the hedge delay
+    if (policy->options.selector && hedged) {
+        int w = race.winnerIndex, f = race.failedIndex;
+        if (race.winner) ReportHTTPEdge(policy->options.selector, &addrs[w], race.winner->error == 0, (race.finished[w] - race.started[w]) / 1e6);
+        if (race.failed) ReportHTTPEdge(policy->options.selector, &addrs[f], false, (race.finished[f] - race.started[f]) / 1e6);
+    }
+    FreeHTTPResponseResource(race.failed);
+
+    pthread_mutex_lock(&policy->lock);
+    if (hedged) policy->stats.hedged++;
+    if (hedged && race.winner && race.winnerIndex == 1) policy->stats.hedge_wins++;
+    if (race.cancelled) policy->stats.cancelled++;
+    if (race.winner && race.winner->error == 0) {
+        // the latency of the primary request, when a duplicate won at least as long as it had been waiting by then,
+        // a faster duplicate does not pull the p95 below the delay it was sent after
+        policy->samples[policy->nextSample] = (race.finished[0] - race.started[0]) / 1000;
+        policy->nextSample = (policy->nextSample + 1) % HTTP_HEDGE_SAMPLES;
+        if (policy->sampleCount < HTTP_HEDGE_SAMPLES) policy->sampleCount++;
+    }
+    policy->stats.delay_ms = hedgeDelay(policy);
+    pthread_mutex_unlock(&policy->lock);
+
+    if (!race.winner) return NULL;
+    race.winner->hedge.sent = hedged;
+    race.winner->hedge.won = hedged && race.winnerIndex == 1;
+    return race.winner;
+}
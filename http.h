@@ -1,6 +1,8 @@
 #ifndef HTTP_H
 #define HTTP_H
 #include <stdbool.h>
+#include <stddef.h>
+#include <netinet/in.h>
 
 typedef enum {
     HTTP_GET,
@@ -22,6 +24,75 @@ typedef enum {
 extern const char* HTTPMethodString[];
 extern const char* HTTPContentTypeString[];
 
+// Opaque keep-alive connection pool, see CreateHTTPConnectionPool().
+typedef struct HTTPConnectionPool HTTPConnectionPool;
+
+// Opaque event loop client running many requests at once, see CreateHTTPClient().
+typedef struct HTTPClient HTTPClient;
+
+// Sizing of the buffer a response is received into, zero fields take the defaults.
+typedef struct {
+    size_t initial_size; // First allocation, default 4096 (HTTP_RECV_INITIAL_SIZE)
+    size_t max_size;     // Largest buffer (headers + body + 1), default 64 MB (HTTP_RECV_MAX_SIZE)
+    int growth_factor;   // Multiplier applied when the buffer is full, default 2 (HTTP_RECV_GROWTH_FACTOR)
+} HTTPBufferOptions;
+
+// An additional request header, name and value must not contain CR or LF.
+typedef struct {
+    const char* name;
+    const char* value;
+} HTTPHeader;
+
+// Opaque request head serialized once, see PrepareHTTPRequest().
+typedef struct HTTPPreparedRequest HTTPPreparedRequest;
+
+// Opaque TLS state of a connection, see HTTPRequestInfo.tls.
+typedef struct HTTPTLSConnection HTTPTLSConnection;
+
+// Socket tuning and deadlines of a request, zero fields keep the previous behavior. The socket options
+// apply when a connection is opened, a pooled connection keeps those of the request that opened it.
+typedef struct {
+    int connect_timeout_ms; // Give up connecting after this long (0 = the kernel's timeout, or the deadline)
+    int deadline_ms;        // Whole exchange from SendHTTPRequest() to the end of the response, error -5 when exceeded
+    int io_timeout_ms;      // SO_RCVTIMEO/SO_SNDTIMEO of each call without a deadline, default 10 s (HTTP_IO_TIMEOUT_MS)
+    bool no_delay;          // TCP_NODELAY
+    bool quick_ack;         // TCP_QUICKACK, re-armed after every read
+    int recv_buffer_size;   // SO_RCVBUF (0 = kernel default)
+    int send_buffer_size;   // SO_SNDBUF (0 = kernel default)
+    bool fast_open;         // TCP_FASTOPEN_CONNECT, the request goes out with the SYN once the server gave a cookie
+    const char* bind_address;   // Source IPv4 address (NULL = any)
+    const char* bind_interface; // Interface name for SO_BINDTODEVICE (NULL = any), may need CAP_NET_RAW
+} HTTPSocketOptions;
+
+// Phase timestamps of one request in CLOCK_MONOTONIC nanoseconds (0 = not reached) and what it cost.
+// Left at zero when the library is built with HTTP_NO_METRICS.
+typedef struct {
+    long long start;      // SendHTTPRequest() or SubmitHTTPRequest() was called
+    long long connected;  // Connection established or taken from the pool
+    long long sent;       // Whole request written
+    long long first_byte; // First response byte received
+    long long headers;    // Status line and headers received
+    long long done;       // Response complete or failed
+    unsigned long bytes_sent;
+    unsigned long bytes_received;
+    unsigned int connects; // Connections opened, 2 if a reused one had to be replaced
+    unsigned int syscalls; // socket, connect, send, recv and wait calls
+    unsigned int reallocs; // Response buffer reallocations
+} HTTPRequestTiming;
+
+// Produces the next part of a request body of unknown length into buffer (at most size bytes).
+// Returns the number of bytes written, 0 at the end of the body or -1 to abort the request.
+typedef long long (*HTTPBodyProducer)(char* buffer, size_t size, void* ctx);
+
+// Request body streamed from a file descriptor or a producer instead of HTTPRequestInfo.data.
+typedef struct {
+    int fd;                   // Source of length bytes, sent with sendfile() (splice() for pipes), -1 = none
+    long long offset;         // Start in the file, the file position is neither used nor changed (ignored for pipes)
+    long long length;         // Bytes to send, announced with Content-Length
+    HTTPBodyProducer produce; // Used instead of fd when set, the body is sent with Transfer-Encoding: chunked
+    void* ctx;                // Passed to produce
+} HTTPRequestBody;
+
 // Information required to initiate a request. The IP address and host are separated to allow custom hosts.
 typedef struct {
     char* ipaddr; // IP address
@@ -29,13 +100,37 @@ typedef struct {
     int port;     // Port
     int sd;       // Socket descriptor
     HTTPMethod method;
-    char* query;  // Query string
+    char* query;  // Query string, without spaces or control characters
     HTTPContentType content_type;
-    char* cookie; // Cookie, if none, an empty string ""
+    char* cookie; // Cookie without CR or LF, if none, an empty string "" (or NULL)
     char* data;   // Data to be sent (can be NULL)
-    int data_length; // Length of data to be sent (data_length >= 0 && data)
+    long long data_length; // Length of data to be sent (data_length >= 0 && data)
+    HTTPConnectionPool* pool; // Keep-alive pool to take the connection from (NULL = new connection, Connection: close)
+    bool reused;  // Set by SendHTTPRequest() when sd was taken from the pool (auto-managed)
+    HTTPBufferOptions recv_buffer; // Response buffer sizing for FetchHTTPResponse()
+    const struct sockaddr_in* addr; // Resolved address used instead of ipaddr (can be NULL), e.g. from ResolveHTTPHost()
+    const HTTPHeader* headers; // Additional headers (can be NULL)
+    int header_count;          // Number of additional headers
+    HTTPPreparedRequest* prepared; // Serialized method, host, content type and headers to send instead (can be NULL)
+    HTTPRequestTiming timing;      // Connect and send phases, filled by SendHTTPRequest() (auto-managed)
+    HTTPSocketOptions socket_options; // Timeouts, deadline and socket tuning
+    long long deadline;            // Set by SendHTTPRequest() from socket_options.deadline_ms (auto-managed)
+    bool decompress;               // Send Accept-Encoding: gzip, deflate and inflate the body (needs HTTP_WITH_ZLIB)
+    size_t max_decompressed_size;  // Limit of the inflated body, error -7 beyond it (0 = recv_buffer.max_size or its default)
+    const HTTPRequestBody* body;   // Body streamed from a file or a producer, replaces data (can be NULL)
+    long long range_from;          // First byte to ask for with a Range header
+    long long range_length;        // Bytes to ask for from range_from (0 = no Range header, -1 = to the end)
+    bool tls;                      // Connect with TLS (needs HTTP_WITH_OPENSSL), host is the SNI name and the name verified
+    HTTPTLSConnection* tls_connection; // TLS state of sd, set with it by SendHTTPRequest() (auto-managed)
 } HTTPRequestInfo;
 
+// A response header in the index, offsets of the NUL terminated name and value in l4.buffer.
+typedef struct {
+    unsigned int name;
+    unsigned int value;
+    int known;          // internal id of a well-known name, -1 otherwise
+} HTTPHeaderSpan;
+
 // Response information
 typedef struct {
     struct {
@@ -45,27 +140,495 @@ typedef struct {
     } l4;
     struct {
         int status_code;  // HTTP status code
-        int content_length; // Actual length of the response body
-        char* cookie;     // Cookie (pointer within the buffer)
+        long long content_length; // Actual length of the response body, -1 while unknown
+        char* cookie;     // Last Set-Cookie value (pointer within the buffer), see GetHTTPHeaderValues() for all
         char* content;    // Response content (pointer within the buffer)
         bool chunkedTransfer; // Whether chunked transfer is used
+        bool keepAlive;   // Whether the server allows the connection to be reused
     } l7;
     int error; // Error code
+    struct {
+        HTTPHeaderSpan* spans; // Every header in order, use GetHTTPHeader() and friends
+        int count;
+        int capacity;
+    } headers;
+    HTTPRequestTiming timing; // All phases of the request that produced this response
+    struct {
+        bool decoded;                // The body was gzip or deflate encoded and has been inflated
+        long long compressed_bytes;  // Body size as received (after chunked decoding)
+        long long decompressed_bytes; // Body size after inflating, in content_length too
+    } encoding;
+    struct {
+        long long offset;  // File offset the body was written to, the start of Content-Range for a 206
+        long long written; // Body bytes written to the file
+        long long size;    // Size of the complete file from Content-Range or Content-Length, -1 if unknown
+    } download;            // Set by DownloadHTTPFile()
+    struct {
+        bool hit;          // Served by FetchHTTPCached() from a cached copy
+        bool revalidated;  // The copy was stale and the server confirmed it with 304 Not Modified
+    } cache;
+    struct {
+        bool sent;         // FetchHTTPHedged() sent a duplicate of the request to a second address
+        bool won;          // This response came from the duplicate
+    } hedge;
 } HTTPResponseInfo;
 
-// Generate a random Cloudflare edge IP. Note that the memory must be freed after use.
-char* GenerateRandomCloudflareIP(void);
+// Generate a random Cloudflare edge IP into a buffer of at least INET_ADDRSTRLEN bytes. Returns buffer, or NULL if it is too small.
+char* GenerateRandomCloudflareIPInto(char* buffer, size_t size);
+
+// Parse an IPv4 address from a hostname through the resolver cache into a buffer of at least INET_ADDRSTRLEN bytes.
+// Returns buffer, or NULL if the name does not resolve or the buffer is too small.
+char* GetIPv4AddressInto(const char* hostname, char* buffer, size_t size);
 
-// Parse an IPv4 address from a hostname. The returned memory must be freed.
+// The same, returning heap memory that must be freed after use. Not available with HTTP_STATIC, which has no heap
+// to return, use the Into() variants there.
+#ifndef HTTP_STATIC
+char* GenerateRandomCloudflareIP(void);
 char* GetIPv4Address(const char* hostname);
+#endif
+
+// Options of the process-wide resolver cache, zero fields take the defaults.
+typedef struct {
+    const char* nameserver; // IPv4 address of a DNS server queried directly over UDP, NULL = getaddrinfo()
+    int nameserver_port;    // Default 53
+    int max_entries;        // Cached names, default 256
+    int default_ttl_s;      // Lifetime of getaddrinfo() results, which carry no TTL, default 60
+    int negative_ttl_s;     // Lifetime of "no such name" results, default 10
+    int timeout_ms;         // Time a UDP query waits for its answer, default 2000
+} HTTPResolverOptions;
+
+// Resolver counters.
+typedef struct {
+    unsigned long hits;          // Lookups answered from the cache
+    unsigned long negative_hits; // Lookups answered from a cached failure
+    unsigned long misses;        // Lookups that went to getaddrinfo() or the nameserver
+    unsigned long expired;       // Entries dropped because their TTL ran out
+    unsigned long evicted;       // Entries replaced because the cache was full
+} HTTPResolverStats;
+
+// Replace the resolver options (options may be NULL for the defaults), the cache and the counters are cleared.
+// Returns 0, or -1 if the nameserver is not an IPv4 address.
+int ConfigureHTTPResolver(const HTTPResolverOptions* options);
+
+// Resolve a hostname (or IPv4 literal) into addr with the given port, through the cache. Thread-safe.
+// Returns 0, or -1 if the name cannot be resolved.
+int ResolveHTTPHost(const char* hostname, int port, struct sockaddr_in* addr);
+
+// Copy the resolver counters into stats.
+void GetHTTPResolverStats(HTTPResolverStats* stats);
+
+// Opaque asynchronous lookup, see StartHTTPResolve().
+typedef struct HTTPResolveQuery HTTPResolveQuery;
+
+// Start resolving a hostname without blocking: cached names are answered at once, otherwise the
+// nameserver is queried over UDP, or getaddrinfo() runs on a worker thread. Returns NULL on allocation failure.
+HTTPResolveQuery* StartHTTPResolve(const char* hostname, int port);
+
+// Descriptor that becomes readable when the query may have its answer, for poll() or epoll.
+// Returns -1 if the answer was already known when the query started.
+int GetHTTPResolveFD(const HTTPResolveQuery* query);
+
+// Wait up to timeout_ms (0 = only check, -1 = until answered) for the query. Returns 1 if still pending,
+// else the query is freed and 0 (addr is set) or -1 (failed or timed out) is returned.
+int FinishHTTPResolve(HTTPResolveQuery* query, struct sockaddr_in* addr, int timeout_ms);
+
+// Drop a query that is still pending.
+void CancelHTTPResolve(HTTPResolveQuery* query);
 
 // Send an HTTP request, requires an HTTPRequestInfo structure.
 int SendHTTPRequest(HTTPRequestInfo* rq);
 
+// Serialize the method, host, content type and additional headers of rq once. Set HTTPRequestInfo.prepared
+// to send it, then only query, cookie and data (with Content-Length) are taken from each request.
+// Returns NULL if rq is invalid or on allocation failure, free with FreeHTTPPreparedRequest().
+HTTPPreparedRequest* PrepareHTTPRequest(const HTTPRequestInfo* rq);
+
+// Free a prepared request, no request using it may be in flight.
+void FreeHTTPPreparedRequest(HTTPPreparedRequest* prepared);
+
 // Fetch an HTTP response, also requires an HTTPRequestInfo structure.
 HTTPResponseInfo* FetchHTTPResponse(HTTPRequestInfo* rq);
 
+// What FetchHTTPResponseInto() does when a response does not fit into the buffer of the context.
+typedef enum {
+    HTTP_OVERFLOW_GROW, // Move to a larger heap buffer (up to recv_buffer.max_size), kept for the next responses
+    HTTP_OVERFLOW_FAIL  // Fail with error -6 and close the connection, nothing is allocated
+} HTTPOverflowPolicy;
+
+// A caller-owned response reused across requests. Its buffer and header index are kept between responses,
+// so once they have grown to size repeated requests allocate nothing. Zero initialize it, optionally with
+// caller memory as the buffer, e.g. HTTPResponseContext ctx = { .storage = buf, .storage_size = sizeof(buf) };
+typedef struct {
+    HTTPResponseInfo response;   // Last response, valid until the next fetch into the context
+    char* storage;               // Caller memory used as the buffer (NULL = heap buffer of recv_buffer.initial_size)
+    size_t storage_size;
+    HTTPOverflowPolicy overflow;
+} HTTPResponseContext;
+
+// Fetch an HTTP response into ctx->response, reusing the memory of the previous one. Returns ctx->response.error.
+int FetchHTTPResponseInto(HTTPRequestInfo* rq, HTTPResponseContext* ctx);
+
+// Free the heap memory held by ctx (never the storage), the context can be used again afterwards.
+void ReleaseHTTPResponseContext(HTTPResponseContext* ctx);
+
+// Callbacks of FetchHTTPResponseStream(), either may be NULL. Returning false aborts the transfer (error -4).
+typedef struct {
+    bool (*on_headers)(const HTTPResponseInfo* msg, void* ctx);   // Status line and headers are parsed, l7.content is NULL
+    bool (*on_body)(const char* data, size_t length, void* ctx); // Next fragment of the body, chunked encoding already removed
+    void* ctx;    // Passed to both callbacks
+} HTTPStreamCallbacks;
+
+// Fetch an HTTP response and hand the body to callbacks instead of buffering it.
+// Memory stays at a fixed window (HTTP_STREAM_WINDOW_SIZE, 16 KB) that also has to hold the headers.
+// On success l7.content is NULL and l7.content_length is the number of body bytes delivered.
+// Returns NULL if callbacks is NULL or on allocation failure, the result must be freed with FreeHTTPResponseResource().
+HTTPResponseInfo* FetchHTTPResponseStream(HTTPRequestInfo* rq, const HTTPStreamCallbacks* callbacks);
+
+// When DownloadHTTPFile() syncs the file to disk.
+typedef enum {
+    HTTP_FSYNC_NONE,     // Leave it to the kernel
+    HTTP_FSYNC_END,      // fdatasync() once the body is complete
+    HTTP_FSYNC_PERIODIC  // fdatasync() every fsync_bytes and at the end
+} HTTPFsyncPolicy;
+
+// Destination of DownloadHTTPFile().
+typedef struct {
+    int fd;                  // File to write the body to, must not be opened with O_APPEND (a pipe works without resume)
+    bool resume;             // Ask for the rest of a partial file with Range: bytes=<size of fd>-
+    HTTPFsyncPolicy fsync;
+    long long fsync_bytes;   // Bytes between syncs with HTTP_FSYNC_PERIODIC (0 = 8 MB)
+    bool (*on_progress)(long long received, long long total, void* ctx); // Bytes in the file and its full size (-1 = unknown), false aborts (error -4)
+    void* ctx;               // Passed to on_progress
+} HTTPDownloadOptions;
+
+// Send rq and write the response body into options->fd. With a Content-Length the body moves from the socket
+// to the file with splice() and never enters user space, chunked or compressed bodies go through the 16 KB
+// window of FetchHTTPResponseStream(). A 206 response is written at the start of its Content-Range, a 200 from
+// offset 0 (the file is truncated to the body), other statuses leave the file alone and only the headers are kept.
+// With options->resume, rq->range_from and rq->range_length are set to ask for the missing part.
+// Returns NULL on allocation failure, the result must be freed with FreeHTTPResponseResource().
+HTTPResponseInfo* DownloadHTTPFile(HTTPRequestInfo* rq, const HTTPDownloadOptions* options);
+
+// Destination and tuning of DownloadHTTPSegmented(), zero fields take the defaults.
+typedef struct {
+    int fd;                  // Seekable file the segments are written into at their offsets, or -1
+    char* buffer;            // With fd < 0: memory the segments are copied into at their offsets
+    size_t buffer_size;      // Size of buffer, a larger resource fails with error -6
+    long long segment_size;  // Bytes asked for per Range request, default 4 MB
+    int connections;         // Segments fetched at the same time, each on its own connection, default 4
+    int retries;             // Extra attempts of a failed segment, default 2 (-1 = none)
+    bool (*on_progress)(long long received, long long total, void* ctx); // Bytes in place and the full size, called from one download thread at a time, false aborts (error -4)
+    void* ctx;               // Passed to on_progress
+} HTTPSegmentedDownloadOptions;
+
+// Download the resource of rq in byte ranges over parallel connections. The first request asks for the first
+// segment. If it is answered with 206 and the size in Content-Range, the file is extended to that size and the
+// other segments are fetched by options->connections threads, each body written straight to its offset (spliced
+// into the file, copied into the buffer). A segment that fails is asked for again up to options->retries times.
+// A server without Range support answers the first request with the whole body, which is then the download.
+// The result has the headers of the first response, download.size and download.written for the whole resource
+// and l7.content NULL. rq->range_from, range_length and decompress are not used (rq is not modified).
+// Returns NULL on allocation failure, the result must be freed with FreeHTTPResponseResource().
+HTTPResponseInfo* DownloadHTTPSegmented(HTTPRequestInfo* rq, const HTTPSegmentedDownloadOptions* options);
+
+// Send count requests back to back on one connection (HTTP/1.1 pipelining) and read the responses in order.
+// All requests must share the address and port, the connection is taken from rqs[0].pool when set. If the server
+// closes the connection early, the remaining requests are sent one by one on new connections. A POST (or a body
+// from a producer) already written to the closed connection may have been processed, it fails with error -1 instead.
+// responses[i] receives the response to rqs[i], or NULL if it was not attempted or no response could be
+// allocated (the connection is closed then, without the fallback), each must be freed
+// with FreeHTTPResponseResource(). Returns the number of requests completed before the first failure,
+// or -1 if the arguments are invalid.
+int FetchHTTPPipeline(HTTPRequestInfo* rqs, int count, HTTPResponseInfo** responses);
+
+// Value of the first response header called name (case-insensitive), or NULL. Points into l4.buffer.
+const char* GetHTTPHeader(const HTTPResponseInfo* msg, const char* name);
+
+// Store up to max values of the headers called name (e.g. every Set-Cookie) in values, in order.
+// Returns how many there are, which can be more than max. values may be NULL to only count.
+int GetHTTPHeaderValues(const HTTPResponseInfo* msg, const char* name, const char** values, int max);
+
+// Number of response headers, the status line not included.
+int GetHTTPHeaderCount(const HTTPResponseInfo* msg);
+
+// Name and value of the header at index (0 to GetHTTPHeaderCount() - 1). Returns false if out of range.
+bool GetHTTPHeaderAt(const HTTPResponseInfo* msg, int index, const char** name, const char** value);
+
 // Free resources associated with the HTTPResponseInfo structure.
 void FreeHTTPResponseResource(HTTPResponseInfo* msg);
 
+// Latency histograms have one bucket per power of two microseconds: bucket i counts [2^i, 2^(i+1)) us,
+// bucket 0 also counts everything below 1 us and the last one everything above.
+#define HTTP_METRICS_BUCKETS 24
+
+// Process-wide counters of every completed request (blocking, pipelined and engine) and every
+// lookup that was not answered from the resolver cache.
+typedef struct {
+    unsigned long requests;
+    unsigned long failures;  // Responses with error != 0
+    unsigned long timeouts;  // Responses with error -5
+    unsigned long connects;
+    unsigned long reused;    // Requests sent on a pooled connection
+    unsigned long bytes_sent;
+    unsigned long bytes_received;
+    unsigned long syscalls;
+    unsigned long reallocs;
+    unsigned long resolves;  // getaddrinfo() calls and nameserver queries
+    unsigned long resolve_failures;
+    unsigned long latency_us[HTTP_METRICS_BUCKETS]; // start to done
+    unsigned long resolve_us[HTTP_METRICS_BUCKETS];
+} HTTPMetrics;
+
+// Counters of one destination address.
+typedef struct {
+    struct sockaddr_in addr;
+    unsigned long requests;
+    unsigned long failures;
+    unsigned long bytes_sent;
+    unsigned long bytes_received;
+    unsigned long latency_us[HTTP_METRICS_BUCKETS];
+} HTTPHostMetrics;
+
+// Called once per completed request, from the thread that completed it, e.g. to export msg->timing.
+typedef void (*HTTPMetricsHook)(const HTTPRequestInfo* rq, const HTTPResponseInfo* msg, void* ctx);
+
+// Copy the process-wide counters. All zero when built with HTTP_NO_METRICS.
+void GetHTTPMetrics(HTTPMetrics* out);
+
+// Copy the counters of up to max destinations (the first HTTP_METRICS_MAX_HOSTS seen, default 64) into out.
+// Returns how many destinations there are, which can be more than max. out may be NULL to only count.
+int GetHTTPHostMetrics(HTTPHostMetrics* out, int max);
+
+// Install (or remove with NULL) the function called after every request, ctx is passed through.
+void SetHTTPMetricsHook(HTTPMetricsHook hook, void* ctx);
+
+// Options for a keep-alive connection pool, zero fields take the defaults.
+typedef struct {
+    int max_idle_per_host; // Idle sockets kept per (address, port, host), default 4
+    int max_idle_total;    // Idle sockets kept in the whole pool, default 64
+    int idle_timeout_ms;   // Idle sockets older than this are closed instead of reused, default 30000
+} HTTPConnectionPoolOptions;
+
+// Pool counters, a hit is a request sent on a reused socket.
+typedef struct {
+    unsigned long hits;    // Requests sent on an idle pooled socket
+    unsigned long misses;  // Requests that had to open a new socket
+    unsigned long stale;   // Idle sockets dropped because they expired or the server closed them
+    unsigned long retries; // Requests sent again on a new socket because the server closed or reset a reused one before answering
+    unsigned long evicted; // Sockets closed on release because the pool was full
+} HTTPConnectionPoolStats;
+
+// Create a keep-alive connection pool. options may be NULL. Set HTTPRequestInfo.pool to use it.
+// The pool is thread-safe, a single request must still be sent and fetched by one thread.
+HTTPConnectionPool* CreateHTTPConnectionPool(const HTTPConnectionPoolOptions* options);
+
+// Close all idle sockets and free the pool.
+void DestroyHTTPConnectionPool(HTTPConnectionPool* pool);
+
+// Copy the pool counters into stats.
+void GetHTTPConnectionPoolStats(HTTPConnectionPool* pool, HTTPConnectionPoolStats* stats);
+
+// Process-wide TLS settings, see InitHTTPTLS(). Zero fields take the defaults.
+typedef struct {
+    const char* ca_file;    // PEM file of the certificates to trust (NULL and no ca_path = the system store)
+    const char* ca_path;    // Directory of hashed certificates to trust
+    bool insecure;          // Do not verify the server certificate, for testing only
+    int session_cache_size; // Hosts whose latest session is kept to resume the next handshake, default 64 (-1 = none)
+} HTTPTLSOptions;
+
+// TLS counters.
+typedef struct {
+    unsigned long handshakes; // Completed handshakes
+    unsigned long resumed;    // Of those, abbreviated ones that resumed a cached session
+    unsigned long failures;   // Failed handshakes, failed certificate checks included
+    unsigned long sessions;   // Sessions cached now
+} HTTPTLSStats;
+
+// Set up TLS for requests with HTTPRequestInfo.tls, options may be NULL. Optional, the first TLS connection
+// sets it up with the defaults otherwise. The library must be built with HTTP_WITH_OPENSSL (link -lssl -lcrypto).
+// Returns 0, or -1 without TLS support, when TLS is already set up, or if the certificates cannot be loaded.
+int InitHTTPTLS(const HTTPTLSOptions* options);
+
+// Copy the TLS counters into stats, resumed / handshakes is the resumption rate.
+void GetHTTPTLSStats(HTTPTLSStats* stats);
+
+// Opaque in-memory response cache, see CreateHTTPCache().
+typedef struct HTTPCache HTTPCache;
+
+// Options of a response cache, zero fields take the defaults.
+typedef struct {
+    size_t max_bytes;       // Memory of all cached responses, least recently used ones are evicted, default 16 MB
+    int max_entries;        // Cached responses, default 256
+    size_t max_entry_bytes; // Larger responses are not cached, default max_bytes / 8
+    int default_ttl_s;      // Freshness of responses without Cache-Control: max-age (0 = revalidate every time)
+} HTTPCacheOptions;
+
+// Cache counters.
+typedef struct {
+    unsigned long hits;          // Answered from a fresh entry without a request
+    unsigned long misses;        // No usable entry, fetched from the server
+    unsigned long revalidations; // Stale entries checked with If-None-Match / If-Modified-Since
+    unsigned long not_modified;  // Revalidations answered with 304, served from the entry
+    unsigned long stores;        // Responses added or replaced
+    unsigned long evicted;       // Entries dropped to stay within max_bytes and max_entries
+    unsigned long entries;       // Entries held now
+    unsigned long bytes;         // Memory held now
+} HTTPCacheStats;
+
+// Create a response cache, options may be NULL. The cache is thread-safe.
+HTTPCache* CreateHTTPCache(const HTTPCacheOptions* options);
+
+// Free the cache and every cached response.
+void DestroyHTTPCache(HTTPCache* cache);
+
+// Copy the cache counters into stats.
+void GetHTTPCacheStats(HTTPCache* cache, HTTPCacheStats* stats);
+
+// Send rq and fetch the response through the cache, which is keyed by Host, port and query. A fresh entry is
+// returned without a request. A stale one with an ETag or Last-Modified is revalidated with If-None-Match or
+// If-Modified-Since (unless rq->prepared is set) and returned on 304 Not Modified. 200 responses are stored for
+// Cache-Control: max-age (minus Age) or default_ttl_s, no-cache ones only to be revalidated, no-store and private
+// ones never. Only GET requests without a body, Range, cookie or Authorization header are cached, others are sent
+// as they are.
+// Returns NULL on allocation failure, the result must be freed with FreeHTTPResponseResource().
+HTTPResponseInfo* FetchHTTPCached(HTTPCache* cache, HTTPRequestInfo* rq);
+
+// Called from RunHTTPClient() when a submitted request is finished. msg holds the response or the
+// error (-5 = timed out), it belongs to the callback and must be freed with FreeHTTPResponseResource().
+typedef void (*HTTPCompletionCallback)(HTTPRequestInfo* rq, HTTPResponseInfo* msg, void* ctx);
+
+// Options for an event loop client, zero fields take the defaults.
+typedef struct {
+    int max_in_flight;          // Requests connecting, sending or receiving at the same time, default 256
+    int max_in_flight_per_host; // The same per address and port, default 8
+    int request_timeout_ms;     // Time from connect to the end of the response, default 10000
+    bool io_uring;              // Drive the sockets through io_uring, needs HTTP_WITH_URING and Linux 6.0, see GetHTTPClientBackend()
+} HTTPClientOptions;
+
+// How an event loop client does its I/O.
+typedef enum {
+    HTTP_BACKEND_EPOLL,    // non-blocking syscalls on sockets epoll reports ready
+    HTTP_BACKEND_IO_URING  // batched io_uring submissions, multishot receives into provided buffers
+} HTTPClientBackend;
+
+// Create an event loop client, options may be NULL. A client must only be used by one thread.
+HTTPClient* CreateHTTPClient(const HTTPClientOptions* options);
+
+// Queue a request, it is started as soon as the in-flight caps allow. rq (and its strings and data) must stay
+// valid until the request completes. With callback NULL the result goes to the completion queue instead,
+// see NextHTTPCompletion(). rq->pool is honoured. Returns 0, or -1 if the request is invalid (TLS is not supported).
+int SubmitHTTPRequest(HTTPClient* client, HTTPRequestInfo* rq, HTTPCompletionCallback callback, void* ctx);
+
+// Cancel a request that is queued or in flight: its connection is closed and it completes with error -8,
+// through its callback or the completion queue like any other. May be called from a completion callback.
+// Returns 0, or -1 if rq is not queued or in flight on the client.
+int CancelHTTPRequest(HTTPClient* client, HTTPRequestInfo* rq);
+
+// Drive all submitted requests with non-blocking connect, send and receive on one epoll set (or one io_uring),
+// calling the completion callbacks. Returns once nothing is in flight or queued, or after timeout_ms (-1 = no limit).
+// Returns the number of requests not completed yet, or -1 on error.
+int RunHTTPClient(HTTPClient* client, int timeout_ms);
+
+// Pop a completed request that was submitted without a callback. Returns false if the queue is empty.
+// The response belongs to the caller and must be freed with FreeHTTPResponseResource().
+bool NextHTTPCompletion(HTTPClient* client, HTTPRequestInfo** rq, HTTPResponseInfo** msg, void** ctx);
+
+// The backend the client runs on. HTTPClientOptions.io_uring falls back to epoll when the library is built
+// without HTTP_WITH_URING or the kernel lacks an io_uring feature it uses.
+HTTPClientBackend GetHTTPClientBackend(const HTTPClient* client);
+
+// Abort everything still in flight (without calling callbacks), drop uncollected completions and free the client.
+void DestroyHTTPClient(HTTPClient* client);
+
+// Options of an edge selector, zero fields take the defaults.
+typedef struct {
+    const char* const* ranges; // IPv4 ranges candidates are drawn from, "a.b.c.d/bits" (default 104.16.0.0/16)
+    int range_count;
+    int candidates;            // Addresses scored at a time, default 16
+    int port;                  // Port probed and returned in the addresses, default 80
+    const char* probe_host;    // Probe with a GET of probe_path with this Host (NULL = a TCP connect is the probe)
+    const char* probe_path;    // Default "/"
+    int probe_timeout_ms;      // Default 1000, also the penalty of a failure in the score
+    int explore_percent;       // Selections that go to a random candidate instead of the best, default 10 (-1 = none)
+    int ewma_weight_percent;   // Weight of a new sample in the latency and failure averages, default 20
+    int eject_after_failures;  // Consecutive failures that eject a candidate, default 3
+    int eject_ms;              // Ejected candidates are replaced by a new address after this long, default 30000
+} HTTPEdgeSelectorOptions;
+
+// Opaque set of candidate edge addresses with latency and failure scores, see CreateHTTPEdgeSelector().
+typedef struct HTTPEdgeSelector HTTPEdgeSelector;
+
+// State of one candidate, see GetHTTPEdgeStats().
+typedef struct {
+    struct sockaddr_in addr;
+    double latency_ms;     // EWMA of successful probes and reports
+    double failure_rate;   // EWMA of failures, 0 to 1
+    double score;          // latency_ms + failure_rate * probe_timeout_ms, lower is better
+    unsigned long samples;
+    unsigned long selected;
+    bool ejected;
+} HTTPEdgeStats;
+
+// Create an edge selector with options.candidates random addresses from the ranges, options may be NULL.
+// The strings in options are copied. Returns NULL if a range is invalid or on allocation failure.
+// A selector may be shared between threads.
+HTTPEdgeSelector* CreateHTTPEdgeSelector(const HTTPEdgeSelectorOptions* options);
+
+// Free the selector, no other call on it may be in progress.
+void DestroyHTTPEdgeSelector(HTTPEdgeSelector* selector);
+
+// Probe every active candidate at once and wait up to probe_timeout_ms. Returns how many answered, or -1.
+int ProbeHTTPEdges(HTTPEdgeSelector* selector);
+
+// Store the candidate with the lowest score in addr (port included), or now and then a random one to keep the
+// scores fresh. Unprobed candidates are picked at random. Returns false only if there is no candidate.
+bool SelectHTTPEdge(HTTPEdgeSelector* selector, struct sockaddr_in* addr);
+
+// Feed the outcome of a request to addr into its scores, e.g. after a request sent to a selected edge.
+void ReportHTTPEdge(HTTPEdgeSelector* selector, const struct sockaddr_in* addr, bool success, double latency_ms);
+
+// Copy the state of up to max candidates into out. Returns the number of candidates, or -1.
+int GetHTTPEdgeStats(HTTPEdgeSelector* selector, HTTPEdgeStats* out, int max);
+
+// Options of a hedging policy, zero fields take the defaults.
+typedef struct {
+    int delay_ms;              // Send the duplicate after this long without a response (0 = p95 of recent latencies)
+    int initial_delay_ms;      // Delay until enough latencies are known for the p95, default 100
+    int min_delay_ms;          // Lower bound of the p95 delay, default 5
+    int budget_percent;        // Duplicates are sent for at most this share of the requests, default 10
+    HTTPEdgeSelector* selector; // Picks the second address, the best candidate other than the first one
+    const struct sockaddr_in* alternates; // Or second addresses taken in turn (copied), the port is rq->port
+    int alternate_count;
+} HTTPHedgeOptions;
+
+// Opaque hedging policy with its latency window, budget and counters, see CreateHTTPHedgePolicy().
+typedef struct HTTPHedgePolicy HTTPHedgePolicy;
+
+// Hedging counters.
+typedef struct {
+    unsigned long requests;      // FetchHTTPHedged() calls
+    unsigned long hedged;        // Requests a duplicate was sent for
+    unsigned long hedge_wins;    // Hedged requests answered first by the duplicate
+    unsigned long budget_denied; // Requests slow enough to hedge while the budget was used up
+    unsigned long cancelled;     // Losing requests cancelled in flight
+    int delay_ms;                // Delay the next request is hedged after
+} HTTPHedgeStats;
+
+// Create a hedging policy, options may be NULL but then there is no second address and nothing is hedged.
+// Returns NULL on allocation failure. A policy may be shared between threads.
+HTTPHedgePolicy* CreateHTTPHedgePolicy(const HTTPHedgeOptions* options);
+
+// Free the policy, no other call on it may be in progress. The selector is not freed.
+void DestroyHTTPHedgePolicy(HTTPHedgePolicy* policy);
+
+// Copy the policy counters into stats.
+void GetHTTPHedgeStats(HTTPHedgePolicy* policy, HTTPHedgeStats* stats);
+
+// Send rq and fetch the response. If none arrived after the hedge delay and the budget allows, the same request
+// is sent to a second address and the response that completes first is returned, the other request is cancelled.
+// Only GET requests without a body are hedged. Outcomes are reported to the selector, if any. Both requests run
+// on an event loop client, which has no TLS. Returns NULL on allocation failure or for a TLS request, the result
+// must be freed with FreeHTTPResponseResource().
+HTTPResponseInfo* FetchHTTPHedged(HTTPHedgePolicy* policy, HTTPRequestInfo* rq);
+
 #endif
\ No newline at end of file
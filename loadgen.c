@@ -0,0 +1,529 @@
+// Load generator built on the event loop client, for sizing a server with the same client that talks to it.
+//
+//   gcc -O2 loadgen.c http.c -o loadgen -lpthread -lm
+//   gcc -O2 -DHTTP_WITH_URING loadgen.c http.c -o loadgen -lpthread -lm    for --io-uring
+//   ./loadgen [options] http://host[:port]/path
+//
+// Every thread runs one HTTPClient that keeps its share of the connections busy. Without --rate each connection
+// sends its next request as soon as the last one completes (closed loop). With --rate requests are scheduled at
+// a constant throughput, and latency is measured from the time a request was due rather than the time it was
+// sent, so a stalled server shows up in the latency of every request that queued behind it (coordinated omission).
+#include "http.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <arpa/inet.h>
+
+#define LOADGEN_MAX_HEADERS 64
+#define LOADGEN_ERROR_CODES 9        // HTTPResponseInfo.error from 0 down to -8
+#define LOADGEN_SUB_BUCKET_BITS 7    // 64 linear sub-buckets per power of two (2^(bits-1)), values are kept within 1/64 (1.6%)
+#define LOADGEN_VALUE_BITS 36        // largest latency tracked: 2^36 us, about 19 hours
+#define LOADGEN_HALF_BUCKETS (1 << (LOADGEN_SUB_BUCKET_BITS - 1))
+#define LOADGEN_BUCKETS ((LOADGEN_VALUE_BITS - LOADGEN_SUB_BUCKET_BITS + 2) * LOADGEN_HALF_BUCKETS)
+
+static const char* errorNames[LOADGEN_ERROR_CODES] = {
+    "ok", "io", "parse", "chunk", "aborted", "timeout", "too_large", "decompress", "cancelled"
+};
+
+static long long nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleepUntil(long long ns) {
+    struct timespec ts = { .tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000 };
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// Latency histogram
+
+// HDR-style histogram of microseconds: exact below 128, then 64 linear sub-buckets per power of two.
+typedef struct {
+    unsigned long long counts[LOADGEN_BUCKETS];
+    unsigned long long total;
+    long long min;
+    long long max;
+    double sum;
+    double sumSquares;
+} LatencyHistogram;
+
+static int bucketIndex(long long us) {
+    if (us < 0) us = 0;
+    if (us >= 1LL << LOADGEN_VALUE_BITS) us = (1LL << LOADGEN_VALUE_BITS) - 1;
+    if (us < 2 * LOADGEN_HALF_BUCKETS) return (int)us;
+    int shift = 63 - __builtin_clzll((unsigned long long)us) - (LOADGEN_SUB_BUCKET_BITS - 1);
+    return shift * LOADGEN_HALF_BUCKETS + (int)(us >> shift);
+}
+
+// Highest value that lands in the bucket.
+static long long bucketValue(int index) {
+    if (index < 2 * LOADGEN_HALF_BUCKETS) return index;
+    int shift = index / LOADGEN_HALF_BUCKETS - 1;
+    long long sub = index - shift * LOADGEN_HALF_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+static void recordLatency(LatencyHistogram* histogram, long long us) {
+    histogram->counts[bucketIndex(us)]++;
+    if (histogram->total == 0 || us < histogram->min) histogram->min = us;
+    if (us > histogram->max) histogram->max = us;
+    histogram->total++;
+    histogram->sum += us;
+    histogram->sumSquares += (double)us * us;
+}
+
+static void mergeHistogram(LatencyHistogram* into, const LatencyHistogram* from) {
+    if (from->total == 0) return;
+    for (int i = 0; i < LOADGEN_BUCKETS; i++) into->counts[i] += from->counts[i];
+    if (into->total == 0 || from->min < into->min) into->min = from->min;
+    if (from->max > into->max) into->max = from->max;
+    into->total += from->total;
+    into->sum += from->sum;
+    into->sumSquares += from->sumSquares;
+}
+
+// Value at percentile p (0-100), never above the largest recorded value.
+static long long latencyAt(const LatencyHistogram* histogram, double p) {
+    if (histogram->total == 0) return 0;
+    unsigned long long rank = (unsigned long long)(p / 100 * histogram->total + 0.5);
+    if (rank < 1) rank = 1;
+    unsigned long long seen = 0;
+    for (int i = 0; i < LOADGEN_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) return bucketValue(i) < histogram->max ? bucketValue(i) : histogram->max;
+    }
+    return histogram->max;
+}
+
+static double latencyMean(const LatencyHistogram* histogram) {
+    return histogram->total ? histogram->sum / histogram->total : 0;
+}
+
+static double latencyStdev(const LatencyHistogram* histogram) {
+    if (histogram->total < 2) return 0;
+    double mean = latencyMean(histogram);
+    double variance = histogram->sumSquares / histogram->total - mean * mean;
+    return variance > 0 ? sqrt(variance) : 0;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// Load
+
+typedef struct {
+    struct sockaddr_in addr;
+    char* host;             // Host header: the authority of the URL
+    char* path;
+    HTTPMethod method;
+    HTTPContentType contentType;
+    char* body;
+    long long bodyLength;   // -1 = no body
+    HTTPHeader headers[LOADGEN_MAX_HEADERS];
+    int headerCount;
+    int threads;
+    int connections;
+    double rate;            // requests per second over all threads, 0 = closed loop
+    int durationMs;
+    int warmupMs;
+    int timeoutMs;
+    bool keepAlive;
+    bool ioUring;
+} LoadOptions;
+
+typedef struct LoadThread LoadThread;
+
+// A connection's worth of requests: one request in flight at a time.
+typedef struct {
+    LoadThread* thread;
+    HTTPRequestInfo rq;
+    long long due;          // when the request was scheduled (sent, without a rate)
+    bool busy;
+} LoadSlot;
+
+struct LoadThread {
+    const LoadOptions* options;
+    HTTPClient* client;
+    HTTPConnectionPool* pool;
+    LoadSlot* slots;
+    int slotCount;
+    long long interval;     // ns between the requests of this thread, 0 = closed loop
+    long long nextDue;
+    long long warmupEnd;    // requests due before this are not counted
+    long long end;          // no request is started from here on
+    bool failed;            // SubmitHTTPRequest() refused a request, stop retrying until the next completion
+    // results, requests due in [warmupEnd, end)
+    LatencyHistogram latency;
+    unsigned long long errors[LOADGEN_ERROR_CODES + 1]; // by -error, the last one counts unknown codes
+    unsigned long long statusClasses[6];                // 1xx to 5xx, [0] = anything else
+    unsigned long long bytes;
+    unsigned long long unsent; // due before the end but never started, the server fell too far behind
+    long long lastDone;
+    const char* backend;
+};
+
+static void startDueRequests(LoadThread* thread);
+
+static void requestDone(HTTPRequestInfo* rq, HTTPResponseInfo* msg, void* ctx) {
+    (void)rq;
+    LoadSlot* slot = ctx;
+    LoadThread* thread = slot->thread;
+    long long done = nowNs();
+    if (slot->due >= thread->warmupEnd && slot->due < thread->end) {
+        recordLatency(&thread->latency, (done - slot->due) / 1000);
+        int code = -msg->error;
+        thread->errors[code >= 0 && code < LOADGEN_ERROR_CODES ? code : LOADGEN_ERROR_CODES]++;
+        if (msg->error == 0) {
+            int statusClass = msg->l7.status_code / 100;
+            thread->statusClasses[statusClass >= 1 && statusClass <= 5 ? statusClass : 0]++;
+        }
+        thread->bytes += msg->l4.totalSize;
+        thread->lastDone = done;
+    }
+    FreeHTTPResponseResource(msg);
+    slot->busy = false;
+    thread->failed = false;
+    startDueRequests(thread);
+}
+
+// Puts idle slots to work: right away without a rate, otherwise for every request whose time has come.
+// A request that is due while every slot is busy waits for one, its latency still counts from nextDue.
+static void startDueRequests(LoadThread* thread) {
+    const LoadOptions* options = thread->options;
+    long long now = nowNs();
+    for (int i = 0; i < thread->slotCount && !thread->failed; i++) {
+        LoadSlot* slot = &thread->slots[i];
+        if (slot->busy) continue;
+        long long due = thread->interval ? thread->nextDue : now;
+        if (due > now || due >= thread->end) return;
+        if (thread->interval) thread->nextDue += thread->interval;
+
+        slot->rq = (HTTPRequestInfo){ .host = options->host, .port = ntohs(options->addr.sin_port), .sd = -1, .method = options->method,
+            .query = options->path, .content_type = options->contentType, .cookie = "", .data = options->body,
+            .data_length = options->bodyLength, .pool = thread->pool, .addr = &options->addr, .headers = options->headers,
+            .header_count = options->headerCount };
+        slot->due = due;
+        slot->busy = true;
+        if (SubmitHTTPRequest(thread->client, &slot->rq, requestDone, slot) < 0) {
+            slot->busy = false;
+            thread->failed = true;
+            if (due >= thread->warmupEnd) thread->errors[LOADGEN_ERROR_CODES]++;
+        }
+    }
+}
+
+static void* runLoadThread(void* arg) {
+    LoadThread* thread = arg;
+    const LoadOptions* options = thread->options;
+    for (;;) {
+        startDueRequests(thread);
+        long long now = nowNs();
+        if (now >= thread->end) break;
+        long long wakeup = thread->interval && thread->nextDue < thread->end ? thread->nextDue : thread->end;
+        // RunHTTPClient() only polls with a timeout of 1 ms or more, so a request can start up to 1 ms late while
+        // others are in flight (the delay counts in its latency). Late requests start from the completion callbacks.
+        int waitMs = wakeup > now ? (int)((wakeup - now + 999999) / 1000000) : 1;
+        if (RunHTTPClient(thread->client, waitMs) == 0 && nowNs() < wakeup) sleepUntil(wakeup);
+        if (thread->failed) {
+            thread->failed = false;
+            if (!thread->interval) sleepUntil(nowNs() + 1000000); // nothing in flight to wait for, back off instead of spinning
+        }
+    }
+    // the requests still in flight finish, they are counted if they were due before the end
+    RunHTTPClient(thread->client, options->timeoutMs + 1000);
+    if (thread->interval && thread->nextDue < thread->end) thread->unsent = (thread->end - thread->nextDue + thread->interval - 1) / thread->interval;
+    return NULL;
+}
+
+static const char* methodName(HTTPMethod method) {
+    return HTTPMethodString[method];
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// Report
+
+typedef struct {
+    LatencyHistogram latency;
+    unsigned long long errors[LOADGEN_ERROR_CODES + 1];
+    unsigned long long statusClasses[6];
+    unsigned long long bytes;
+    unsigned long long unsent;
+    double seconds;
+    const char* backend;
+} LoadResult;
+
+static const double reportPercentiles[] = { 50, 75, 90, 99, 99.9, 99.99, 99.999, 100 };
+
+static void printText(const LoadOptions* options, const char* url, const LoadResult* result) {
+    const LatencyHistogram* latency = &result->latency;
+    printf("%s %s: %d threads, %d connections, %s, %.1fs", methodName(options->method), url, options->threads,
+        options->connections, options->keepAlive ? "keep-alive" : "new connection per request", options->durationMs / 1e3);
+    if (options->warmupMs) printf(" after %.1fs warmup", options->warmupMs / 1e3);
+    if (options->rate > 0) printf(", %.0f requests/s target", options->rate);
+    printf(" (%s)\n\n", result->backend);
+
+    printf("  Requests    %llu in %.2fs, %.2f MB read\n", latency->total, result->seconds, result->bytes / 1048576.0);
+    printf("  Throughput  %.1f requests/s, %.2f MB/s\n", latency->total / result->seconds, result->bytes / 1048576.0 / result->seconds);
+    printf("  Latency     mean %.3fms, stdev %.3fms, min %.3fms, max %.3fms%s\n", latencyMean(latency) / 1e3, latencyStdev(latency) / 1e3,
+        latency->min / 1e3, latency->max / 1e3, options->rate > 0 ? " (from the scheduled send time)" : "");
+    printf("  Percentiles");
+    for (size_t i = 0; i < sizeof(reportPercentiles) / sizeof(reportPercentiles[0]); i++) {
+        printf("  p%g %.3fms", reportPercentiles[i], latencyAt(latency, reportPercentiles[i]) / 1e3);
+    }
+    printf("\n  Status      1xx %llu, 2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu, other %llu\n", result->statusClasses[1],
+        result->statusClasses[2], result->statusClasses[3], result->statusClasses[4], result->statusClasses[5], result->statusClasses[0]);
+    printf("  Errors     ");
+    unsigned long long failed = 0;
+    for (int i = 1; i <= LOADGEN_ERROR_CODES; i++) {
+        if (!result->errors[i]) continue;
+        printf(" %d (%s) %llu", i < LOADGEN_ERROR_CODES ? -i : 0, i < LOADGEN_ERROR_CODES ? errorNames[i] : "other", result->errors[i]);
+        failed += result->errors[i];
+    }
+    printf("%s\n", failed ? "" : " none");
+    if (result->unsent) printf("  Not sent    %llu requests were still waiting for a connection at the end\n", result->unsent);
+
+    // the percentile spectrum as HdrHistogram prints it: 5 steps per halving of the distance to 100%
+    printf("\n  Latency distribution\n  %12s  %12s  %12s  %16s\n", "Value (ms)", "Percentile", "TotalCount", "1/(1-Percentile)");
+    if (latency->total == 0) return;
+    unsigned long long seen = 0;
+    double reported = -1;
+    for (int i = 0; i < LOADGEN_BUCKETS && seen < latency->total; i++) {
+        if (!latency->counts[i]) continue;
+        seen += latency->counts[i];
+        double percentile = (double)seen / latency->total;
+        double halvings = percentile < 1 ? -log2(1 - percentile) : 64;
+        double tick = floor(halvings * 5) / 5;
+        if (tick <= reported && seen < latency->total) continue;
+        reported = tick;
+        long long value = bucketValue(i) < latency->max ? bucketValue(i) : latency->max;
+        if (percentile < 1) printf("  %12.3f  %12.6f  %12llu  %16.2f\n", value / 1e3, percentile, seen, 1 / (1 - percentile));
+        else printf("  %12.3f  %12.6f  %12llu  %16s\n", value / 1e3, percentile, seen, "inf");
+    }
+}
+
+static void printJSON(const LoadOptions* options, const char* url, const LoadResult* result) {
+    const LatencyHistogram* latency = &result->latency;
+    printf("{\n  \"url\": \"%s\",\n", url);
+    printf("  \"config\": {\"method\": \"%s\", \"threads\": %d, \"connections\": %d, \"keep_alive\": %s, \"rate\": %.1f, "
+        "\"duration_s\": %.3f, \"warmup_s\": %.3f, \"timeout_ms\": %d, \"client\": \"%s\"},\n",
+        methodName(options->method), options->threads, options->connections, options->keepAlive ? "true" : "false", options->rate,
+        options->durationMs / 1e3, options->warmupMs / 1e3, options->timeoutMs, result->backend);
+    printf("  \"requests\": %llu,\n  \"not_sent\": %llu,\n  \"seconds\": %.3f,\n  \"requests_per_second\": %.1f,\n  \"bytes_received\": %llu,\n",
+        latency->total, result->unsent, result->seconds, latency->total / result->seconds, result->bytes);
+    printf("  \"latency_corrected\": %s,\n", options->rate > 0 ? "true" : "false");
+    printf("  \"latency_us\": {\"min\": %lld, \"mean\": %.1f, \"stdev\": %.1f, \"max\": %lld", latency->min, latencyMean(latency),
+        latencyStdev(latency), latency->max);
+    for (size_t i = 0; i < sizeof(reportPercentiles) / sizeof(reportPercentiles[0]); i++) {
+        printf(", \"p%g\": %lld", reportPercentiles[i], latencyAt(latency, reportPercentiles[i]));
+    }
+    printf("},\n  \"histogram\": [");
+    bool first = true;
+    for (int i = 0; i < LOADGEN_BUCKETS; i++) {
+        if (!latency->counts[i]) continue;
+        long long value = bucketValue(i) < latency->max ? bucketValue(i) : latency->max;
+        printf("%s{\"value_us\": %lld, \"count\": %llu}", first ? "" : ", ", value, latency->counts[i]);
+        first = false;
+    }
+    printf("],\n  \"status\": {\"1xx\": %llu, \"2xx\": %llu, \"3xx\": %llu, \"4xx\": %llu, \"5xx\": %llu, \"other\": %llu},\n",
+        result->statusClasses[1], result->statusClasses[2], result->statusClasses[3], result->statusClasses[4],
+        result->statusClasses[5], result->statusClasses[0]);
+    printf("  \"errors\": {");
+    for (int i = 0; i <= LOADGEN_ERROR_CODES; i++) {
+        if (i < LOADGEN_ERROR_CODES) printf("%s\"%d\": {\"name\": \"%s\", \"count\": %llu}", i ? ", " : "", -i, errorNames[i], result->errors[i]);
+        else printf(", \"other\": {\"name\": \"other\", \"count\": %llu}", result->errors[i]);
+    }
+    printf("}\n}\n");
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+static void usage(void) {
+    fprintf(stderr,
+        "usage: loadgen [options] http://host[:port]/path\n"
+        "  -c, --connections N     requests in flight, each on its own connection (default 10)\n"
+        "  -t, --threads N         threads sharing the connections, one event loop each (default 2)\n"
+        "  -d, --duration S        measured seconds (default 10)\n"
+        "  -w, --warmup S          seconds of load before measuring (default 0)\n"
+        "  -R, --rate N            requests per second at a constant pace, latency from the scheduled time (default: closed loop)\n"
+        "  -X, --method M          GET, POST, PUT, DELETE or OPTIONS (default GET)\n"
+        "  -H, --header 'N: V'     additional request header, repeatable\n"
+        "  -b, --body TEXT         request body, --body-file PATH reads it from a file\n"
+        "  -T, --content-type T    text, octet, form or json (default text)\n"
+        "      --timeout MS        per-request timeout (default 10000)\n"
+        "      --no-keep-alive     a new connection for every request\n"
+        "      --io-uring          run the event loops on io_uring (built with HTTP_WITH_URING)\n"
+        "      --format text|json  output format (default text)\n");
+    exit(64);
+}
+
+static char* readFile(const char* path, long long* length) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return NULL;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* data = size >= 0 ? malloc(size + 1) : NULL;
+    if (data && fread(data, 1, size, file) != (size_t)size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    *length = size;
+    return data;
+}
+
+// Splits http://host[:port]/path into options, resolving host. Returns false on a malformed URL or a failed lookup.
+static bool parseURL(const char* url, LoadOptions* options) {
+    if (strncasecmp(url, "http://", 7) != 0) return false;
+    const char* authority = url + 7;
+    const char* slash = strchr(authority, '/');
+    size_t authorityLength = slash ? (size_t)(slash - authority) : strlen(authority);
+    if (authorityLength == 0) return false;
+    options->host = strndup(authority, authorityLength);
+    options->path = strdup(slash ? slash : "/");
+
+    char* name = strndup(authority, authorityLength);
+    char* colon = strrchr(name, ':');
+    int port = 80;
+    if (colon) {
+        *colon = '\0';
+        port = atoi(colon + 1);
+    }
+    bool resolved = port > 0 && port < 65536 && ResolveHTTPHost(name, port, &options->addr) == 0;
+    free(name);
+    return resolved;
+}
+
+int main(int argc, char** argv) {
+    signal(SIGPIPE, SIG_IGN);
+    LoadOptions options = { .method = HTTP_GET, .bodyLength = -1, .threads = 2, .connections = 10, .durationMs = 10000,
+        .timeoutMs = 10000, .keepAlive = true };
+    const char* url = NULL;
+    bool json = false;
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (arg[0] != '-') {
+            if (url) usage();
+            url = arg;
+            continue;
+        }
+        if (strcmp(arg, "--no-keep-alive") == 0) {
+            options.keepAlive = false;
+            continue;
+        }
+        if (strcmp(arg, "--io-uring") == 0) {
+            options.ioUring = true;
+            continue;
+        }
+        if (!value) usage();
+        i++;
+        if (strcmp(arg, "-c") == 0 || strcmp(arg, "--connections") == 0) options.connections = atoi(value);
+        else if (strcmp(arg, "-t") == 0 || strcmp(arg, "--threads") == 0) options.threads = atoi(value);
+        else if (strcmp(arg, "-d") == 0 || strcmp(arg, "--duration") == 0) options.durationMs = (int)(atof(value) * 1000);
+        else if (strcmp(arg, "-w") == 0 || strcmp(arg, "--warmup") == 0) options.warmupMs = (int)(atof(value) * 1000);
+        else if (strcmp(arg, "-R") == 0 || strcmp(arg, "--rate") == 0) options.rate = atof(value);
+        else if (strcmp(arg, "--timeout") == 0) options.timeoutMs = atoi(value);
+        else if (strcmp(arg, "-b") == 0 || strcmp(arg, "--body") == 0) {
+            options.body = (char*)value;
+            options.bodyLength = (long long)strlen(value);
+        } else if (strcmp(arg, "--body-file") == 0) {
+            options.body = readFile(value, &options.bodyLength);
+            if (!options.body) {
+                perror(value);
+                return 1;
+            }
+        } else if (strcmp(arg, "-X") == 0 || strcmp(arg, "--method") == 0) {
+            int method = 0;
+            while (method < HTTP_METHOD_MAX && strcasecmp(value, HTTPMethodString[method]) != 0) method++;
+            if (method == HTTP_METHOD_MAX) usage();
+            options.method = (HTTPMethod)method;
+        } else if (strcmp(arg, "-T") == 0 || strcmp(arg, "--content-type") == 0) {
+            if (strcmp(value, "text") == 0) options.contentType = CONTENT_TYPE_TEXT_PLAIN;
+            else if (strcmp(value, "octet") == 0) options.contentType = CONTENT_TYPE_OCTET_STREAM;
+            else if (strcmp(value, "form") == 0) options.contentType = CONTENT_TYPE_FORM_URLENCODED;
+            else if (strcmp(value, "json") == 0) options.contentType = CONTENT_TYPE_APPLICATION_JSON;
+            else usage();
+        } else if (strcmp(arg, "-H") == 0 || strcmp(arg, "--header") == 0) {
+            const char* colon = strchr(value, ':');
+            if (!colon || colon == value || options.headerCount == LOADGEN_MAX_HEADERS) usage();
+            const char* headerValue = colon + 1;
+            while (*headerValue == ' ' || *headerValue == '\t') headerValue++;
+            options.headers[options.headerCount++] = (HTTPHeader){ strndup(value, colon - value), headerValue };
+        } else if (strcmp(arg, "--format") == 0) {
+            if (strcmp(value, "json") == 0) json = true;
+            else if (strcmp(value, "text") != 0) usage();
+        } else usage();
+    }
+    if (!url || options.threads < 1 || options.connections < 1 || options.durationMs <= 0 || options.warmupMs < 0 || options.rate < 0) usage();
+    if (options.timeoutMs <= 0) options.timeoutMs = 10000;
+    if (options.threads > options.connections) options.threads = options.connections;
+    if (!parseURL(url, &options)) {
+        fprintf(stderr, "cannot resolve %s (only http:// URLs are supported)\n", url);
+        return 1;
+    }
+
+    LoadThread* threads = calloc(options.threads, sizeof(LoadThread));
+    LoadSlot* slots = calloc(options.connections, sizeof(LoadSlot));
+    pthread_t* ids = calloc(options.threads, sizeof(pthread_t));
+    if (!threads || !slots || !ids) return 1;
+
+    // every thread takes an equal share of the connections and of the rate, offset so that their schedules interleave
+    long long start = nowNs() + 10000000;
+    long long interval = options.rate > 0 ? (long long)(1e9 * options.threads / options.rate) : 0;
+    int assigned = 0;
+    for (int i = 0; i < options.threads; i++) {
+        LoadThread* thread = &threads[i];
+        int count = options.connections / options.threads + (i < options.connections % options.threads);
+        HTTPClientOptions clientOptions = { .max_in_flight = count, .max_in_flight_per_host = count, .request_timeout_ms = options.timeoutMs,
+            .io_uring = options.ioUring };
+        thread->options = &options;
+        thread->client = CreateHTTPClient(&clientOptions);
+        thread->pool = options.keepAlive ? CreateHTTPConnectionPool(&(HTTPConnectionPoolOptions){ .max_idle_per_host = count, .max_idle_total = count }) : NULL;
+        if (!thread->client || (options.keepAlive && !thread->pool)) return 1;
+        thread->backend = GetHTTPClientBackend(thread->client) == HTTP_BACKEND_IO_URING ? "io_uring" : "epoll";
+        thread->slots = slots + assigned;
+        thread->slotCount = count;
+        for (int j = 0; j < count; j++) thread->slots[j].thread = thread;
+        assigned += count;
+        thread->interval = interval;
+        thread->nextDue = start + (interval ? interval * i / options.threads : 0);
+        thread->warmupEnd = start + options.warmupMs * 1000000LL;
+        thread->end = thread->warmupEnd + options.durationMs * 1000000LL;
+    }
+    sleepUntil(start);
+    for (int i = 0; i < options.threads; i++) pthread_create(&ids[i], NULL, runLoadThread, &threads[i]);
+
+    // throughput is taken over the measured period, or until the last counted response if that came later
+    LoadResult result = { .seconds = options.durationMs / 1e3, .backend = threads[0].backend };
+    for (int i = 0; i < options.threads; i++) {
+        pthread_join(ids[i], NULL);
+        double seconds = (threads[i].lastDone - threads[i].warmupEnd) / 1e9;
+        if (seconds > result.seconds) result.seconds = seconds;
+        result.unsent += threads[i].unsent;
+        mergeHistogram(&result.latency, &threads[i].latency);
+        for (int j = 0; j <= LOADGEN_ERROR_CODES; j++) result.errors[j] += threads[i].errors[j];
+        for (int j = 0; j < 6; j++) result.statusClasses[j] += threads[i].statusClasses[j];
+        result.bytes += threads[i].bytes;
+        DestroyHTTPClient(threads[i].client);
+        DestroyHTTPConnectionPool(threads[i].pool);
+    }
+
+    if (json) printJSON(&options, url, &result);
+    else printText(&options, url, &result);
+    unsigned long long failed = 0;
+    for (int i = 1; i <= LOADGEN_ERROR_CODES; i++) failed += result.errors[i];
+    free(threads);
+    free(slots);
+    free(ids);
+    free(options.host);
+    free(options.path);
+    for (int i = 0; i < options.headerCount; i++) free((char*)options.headers[i].name);
+    return failed ? 2 : 0;
+}
@@ -28,16 +28,16 @@ int main(void) {
     
     // Step 2: Setup the HTTP request structure
     HTTPRequestInfo test = {
-        ipaddr,                          // IP address to connect to
-        "test.com",                      // HTTP Host header value
-        80,                              // Port number (80 for HTTP, 443 for HTTPS)
-        -1,                              // Socket file descriptor (auto-managed, random value is accepted)
-        HTTP_GET,                        // HTTP method (GET, POST, PUT, DELETE, OPTIONS)
-        "/cdn-cgi/trace?page=1",         // Request URL path and query string
-        CONTENT_TYPE_TEXT_PLAIN,         // Content-Type header
-        NULL,                            // Cookie header (NULL sends empty cookie)
-        NULL,                            // POST data (NULL for none)
-        -1                               // POST data length (-1 means no data to send)
+        .ipaddr = ipaddr,                         // IP address to connect to
+        .host = "test.com",                       // HTTP Host header value
+        .port = 80,                               // Port number (80 for HTTP, 443 for HTTPS with test.tls = true)
+        .sd = -1,                                 // Socket file descriptor (auto-managed, random value is accepted)
+        .method = HTTP_GET,                       // HTTP method (GET, POST, PUT, DELETE, OPTIONS)
+        .query = "/cdn-cgi/trace?page=1",         // Request URL path and query string
+        .content_type = CONTENT_TYPE_TEXT_PLAIN,  // Content-Type header
+        .cookie = NULL,                           // Cookie header (NULL sends empty cookie)
+        .data = NULL,                             // POST data (NULL for none)
+        .data_length = -1                         // POST data length (-1 means no data to send)
     };
     
     // Step 3: Send the HTTP request
@@ -47,7 +47,7 @@ int main(void) {
     HTTPResponseInfo *b = FetchHTTPResponse(&test);
     
     // Step 5: Check if both request and response were successful
-    if (a == 0 && b->error == 0) {
+    if (a == 0 && b && b->error == 0) {
         printf("[main]: fetch result: \n--------Begin of content--------\n%s--------End of content--------\n", b->l7.content);
         
         // IMPORTANT: If you need to use any response data later, copy it NOW!
@@ -73,7 +73,9 @@ int main(void) {
         if (a != 0) {
             printf("[main]: Failed to send HTTP request, error code: %d\n", a);
         }
-        if (b->error != 0) {
+        if (!b) {
+            printf("[main]: No response could be allocated\n");
+        } else if (b->error != 0) {
             printf("[main]: Failed to parse HTTP response, error code: %d\n", b->error);
         }
     }
@@ -97,14 +99,142 @@ int main(void) {
  * - Set test.data_length to the length of your POST data
  * - Choose appropriate content_type (e.g., CONTENT_TYPE_APPLICATION_JSON for JSON data)
  * 
+ * FOR LARGE UPLOADS:
+ * - HTTPRequestBody file = { .fd = fd, .offset = 0, .length = size }; test.body = &file; sends the file with sendfile()
+ * - A pipe works as well (splice(), offset ignored), length is still needed for Content-Length
+ * - For a body of unknown length set .fd = -1 and .produce = callback, it is sent with Transfer-Encoding: chunked;
+ *   produce fills up to size bytes and returns the count, 0 at the end or -1 to abort
+ * - The fd or producer must stay valid until the response is fetched, a produced body is never sent twice
+ * 
  * FOR COOKIE HANDLING:
  * - Set test.cookie to send cookies with request: "sessionid=abc123; token=xyz789"
  * - Access received cookies via b->l7.cookie after FetchHTTPResponse()
  * - Remember to copy cookie data before calling FreeHTTPResponseResource()
  * 
+ * FOR BUFFER SIZING:
+ * - test.recv_buffer.initial_size, .max_size and .growth_factor tune the response buffer (0 = default)
+ * - With Content-Length the buffer is allocated once at the exact size, responses above max_size fail with -1
+ * 
+ * FOR REPEATED REQUESTS WITHOUT ALLOCATIONS:
+ * - HTTPResponseContext ctx = {0}; (or { .storage = buf, .storage_size = sizeof(buf) } to use your own memory)
+ * - After each SendHTTPRequest(): if (FetchHTTPResponseInto(&test, &ctx) == 0) use ctx.response like any response
+ * - ctx.response is overwritten by the next fetch, call ReleaseHTTPResponseContext(&ctx) once at the end instead
+ *   of FreeHTTPResponseResource(); with .overflow = HTTP_OVERFLOW_FAIL a response that does not fit is error -6
+ * 
+ * FOR COMPRESSED RESPONSES:
+ * - Build with -DHTTP_WITH_ZLIB and link with -lz, then set test.decompress = true
+ * - gzip and deflate bodies are inflated in FetchHTTPResponse(), FetchHTTPResponseStream(), the client and pipelines,
+ *   b->encoding.decoded tells whether it happened and holds the compressed and decompressed sizes
+ * - test.max_decompressed_size bounds the inflated body (default: recv_buffer.max_size), beyond it is error -7
+ * 
+ * FOR LARGE DOWNLOADS:
+ * - Use FetchHTTPResponseStream(&test, &callbacks) instead of FetchHTTPResponse()
+ * - callbacks.on_headers sees the status and headers, callbacks.on_body gets each decoded body fragment
+ * - Memory stays at a fixed 16 KB window, return false from a callback to abort
+ * 
+ * FOR DOWNLOADING TO A FILE:
+ * - HTTPDownloadOptions dl = { .fd = fd }; then HTTPResponseInfo* b = DownloadHTTPFile(&test, &dl); (sends the request too)
+ * - The body is spliced from the socket into the file, memory use does not depend on its size
+ * - .resume = true continues a partial file with a Range request, .fsync = HTTP_FSYNC_END or HTTP_FSYNC_PERIODIC
+ *   syncs it to disk, .on_progress reports the bytes so far and the full size
+ * - b->download.offset, .written and .size tell where the body went, test.range_from / .range_length ask for any range
+ * 
+ * FOR LARGE FILES OVER FAST LINKS:
+ * - HTTPSegmentedDownloadOptions sd = { .fd = fd, .connections = 8 }; (or .fd = -1, .buffer and .buffer_size)
+ * - HTTPResponseInfo* b = DownloadHTTPSegmented(&test, &sd); fetches .segment_size ranges over parallel connections,
+ *   each written at its offset, failed segments are asked for again (.retries)
+ * - A server that ignores Range sends the whole body to the first request, b->l7.status_code is then 200
+ * 
+ * FOR MANY CONCURRENT REQUESTS:
+ * - HTTPClient* client = CreateHTTPClient(NULL); then SubmitHTTPRequest(client, &rq, callback, ctx) for each request
+ * - RunHTTPClient(client, -1) drives them all from one thread with non-blocking sockets and calls the callbacks
+ * - Submit with a NULL callback and collect results with NextHTTPCompletion() to use it as a completion queue
+ * - Keep every HTTPRequestInfo alive until its request completed, then call DestroyHTTPClient()
+ * - Build with -DHTTP_WITH_URING and set HTTPClientOptions.io_uring = true to run the client on io_uring,
+ *   GetHTTPClientBackend(client) tells whether the kernel allowed it or the client stayed on epoll
+ * 
+ * FOR BURSTS OF SMALL REQUESTS TO ONE SERVER:
+ * - Fill an array of HTTPRequestInfo (same ipaddr and port) and call FetchHTTPPipeline(rqs, count, responses)
+ * - All requests are written on one connection, responses come back in order with one framing per response
+ * - The return value is how many requests completed before the first failure, free every non-NULL response
+ * - If the server closes early the rest is sent one by one, but a POST it may have received already fails (-1)
+ * 
+ * FOR RESPONSE HEADERS:
+ * - const char* type = GetHTTPHeader(response, "Content-Type"); NULL if absent, the name is case-insensitive
+ * - const char* cookies[8]; int n = GetHTTPHeaderValues(response, "Set-Cookie", cookies, 8); for every value
+ * - GetHTTPHeaderCount() and GetHTTPHeaderAt() walk all headers in order, strings live until the response is freed
+ * 
+ * FOR EXTRA HEADERS:
+ * - HTTPHeader headers[] = {{"Authorization", "Bearer token"}}; test.headers = headers; test.header_count = 1;
+ * - For many requests of the same kind: HTTPPreparedRequest* p = PrepareHTTPRequest(&test), then set
+ *   prepared = p on each request, only query, cookie and data are read from it; FreeHTTPPreparedRequest(p) at the end
+ * 
+ * FOR HOSTNAMES:
+ * - struct sockaddr_in addr; ResolveHTTPHost("example.com", 80, &addr) == 0, then set test.addr = &addr (ipaddr may be NULL)
+ * - Results are cached with their TTL, ConfigureHTTPResolver() sets the cache size or a nameserver queried over UDP
+ * - Without blocking: HTTPResolveQuery* q = StartHTTPResolve("example.com", 80), watch GetHTTPResolveFD(q),
+ *   then FinishHTTPResolve(q, &addr, 0) returns 1 while pending, 0 when resolved or -1 on failure
+ * 
+ * FOR TIMING AND METRICS:
+ * - response->timing holds CLOCK_MONOTONIC nanoseconds per phase, e.g. timing.first_byte - timing.start is the time to first byte
+ * - HTTPMetrics m; GetHTTPMetrics(&m); has totals and latency_us[i], the number of requests that took 2^i to 2^(i+1) us
+ * - SetHTTPMetricsHook(hook, ctx) calls hook(rq, response, ctx) after every request, e.g. to log or export
+ * 
+ * FOR TIMEOUTS AND SOCKET TUNING:
+ * - test.socket_options.deadline_ms = 300; bounds SendHTTPRequest() plus FetchHTTPResponse() together, error -5 when exceeded
+ * - connect_timeout_ms bounds only the connect, io_timeout_ms replaces the 10 s per-call timeout when there is no deadline
+ * - no_delay, quick_ack, recv_buffer_size, send_buffer_size, fast_open, bind_address and bind_interface tune new sockets
+ * 
+ * FOR PICKING A FAST EDGE IP:
+ * - HTTPEdgeSelector* edges = CreateHTTPEdgeSelector(NULL); (or set ranges, port and probe_host in HTTPEdgeSelectorOptions)
+ * - ProbeHTTPEdges(edges) now and then, then struct sockaddr_in addr; SelectHTTPEdge(edges, &addr); test.addr = &addr;
+ * - ReportHTTPEdge(edges, &addr, response->error == 0, latency_ms) keeps the scores current between probes
+ * 
+ * FOR CUTTING TAIL LATENCY ACROSS EDGE IPS:
+ * - HTTPHedgeOptions o = {.selector = edges}; (or .alternates / .alternate_count) HTTPHedgePolicy* h = CreateHTTPHedgePolicy(&o);
+ * - HTTPResponseInfo* r = FetchHTTPHedged(h, &test); sends a duplicate to a second address when no response came
+ *   within the p95 of recent latencies (or o.delay_ms), the first response wins and the other request is cancelled
+ * - o.budget_percent caps how many requests get a duplicate, r->hedge.won and GetHTTPHedgeStats() tell how it went
+ * - CancelHTTPRequest(client, &rq) cancels a request submitted to an HTTPClient, it completes with error -8
+ * 
+ * FOR HTTPS:
+ * - Build with -DHTTP_WITH_OPENSSL and link -lssl -lcrypto, then set test.tls = true; and test.port = 443;
+ * - The Host is sent as SNI and checked against the certificate, InitHTTPTLS(&options) sets a ca_file / ca_path
+ *   instead of the system store (call it once before the first TLS request, or skip it for the defaults)
+ * - The last session of every host is cached, so new connections resume instead of a full handshake and pooled
+ *   connections keep their TLS state, GetHTTPTLSStats() counts handshakes and resumptions
+ * - SubmitHTTPRequest() does not take TLS requests, use the blocking calls (with a pool) for them
+ * 
+ * FOR DEVICES WITHOUT A HEAP:
+ * - Build with -DHTTP_STATIC, responses and their buffers then come from fixed slots sized by the HTTP_STATIC_* macros
+ * - FreeHTTPResponseResource() hands the slot back, FetchHTTPResponse() returns NULL while all HTTP_STATIC_RESPONSES are in use
+ * - A response larger than HTTP_STATIC_BUFFER_SIZE fails with -6, use FetchHTTPResponseStream() or DownloadHTTPFile() for those,
+ *   one with more than HTTP_STATIC_HEADERS headers with -2
+ * - DownloadHTTPSegmented() takes a buffer and a response slot per connection, so it runs fewer connections than asked
+ *   when the slots are short
+ * - GenerateRandomCloudflareIP() and GetIPv4Address() are not available, pass your own buffer to the Into() variants:
+ *   char ipaddr[INET_ADDRSTRLEN]; GenerateRandomCloudflareIPInto(ipaddr, sizeof(ipaddr));
+ * 
+ * FOR KEEP-ALIVE CONNECTIONS:
+ * - Create a pool once: HTTPConnectionPool* pool = CreateHTTPConnectionPool(NULL);
+ * - Set test.pool = pool before SendHTTPRequest(), the socket is returned to the pool by FetchHTTPResponse()
+ * - GetHTTPConnectionPoolStats() reports hits, misses, stale sockets and retries
+ * - Call DestroyHTTPConnectionPool() when done
+ * 
+ * FOR RESOURCES FETCHED OVER AND OVER:
+ * - Create a cache once: HTTPCache* cache = CreateHTTPCache(NULL);
+ * - HTTPResponseInfo* r = FetchHTTPCached(cache, &test); replaces SendHTTPRequest() + FetchHTTPResponse()
+ * - Fresh copies come back without a request, stale ones are revalidated with their ETag / Last-Modified,
+ *   r->cache.hit and r->cache.revalidated tell which, GetHTTPCacheStats() counts them
+ * 
  * ERROR HANDLING:
  * - SendHTTPRequest() returns 0 on success, negative values on error
- * - FetchHTTPResponse() always returns a valid HTTPResponseInfo pointer
- * - Check b->error: 0 = success, -1 = read error, -2 = parse error, -3 = chunked encoding error
+ * - FetchHTTPResponse() returns NULL when no response can be allocated (or no HTTP_STATIC slot is free), check it
+ *   before reading the fields
+ * - Check b->error: 0 = success, -1 = read error, -2 = parse error, -3 = chunked encoding error,
+ *   -4 = aborted by a FetchHTTPResponseStream() callback, -5 = timed out,
+ *   -6 = did not fit into the buffer of an HTTPResponseContext with HTTP_OVERFLOW_FAIL,
+ *   -7 = compressed body corrupt or larger than max_decompressed_size when inflated,
+ *   -8 = cancelled with CancelHTTPRequest()
  * - Always call FreeHTTPResponseResource() even if there were errors
  */
\ No newline at end of file
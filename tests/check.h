@@ -0,0 +1,35 @@
+// Shared by the test programs in this directory. Each one is a standalone program against the public API of
+// http.h that starts its own local servers, prints what failed and exits with 1 if anything did:
+//
+//   gcc -I. tests/resolver.c http.c -o resolver_test -lpthread && ./resolver_test
+#ifndef HTTP_TESTS_CHECK_H
+#define HTTP_TESTS_CHECK_H
+#include <stdio.h>
+#include <time.h>
+
+static int checkFailures;
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        checkFailures++; \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+    } \
+} while (0)
+
+// Prints the result line of a test program and returns its exit status.
+static inline int checkResult(const char* name) {
+    printf("%s: %s\n", name, checkFailures ? "FAILED" : "ok");
+    return checkFailures ? 1 : 0;
+}
+
+static inline long long checkNowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline void checkSleepMs(int ms) {
+    struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (long)(ms % 1000) * 1000000 };
+    nanosleep(&ts, NULL);
+}
+#endif
@@ -0,0 +1,218 @@
+// Edge selector scoring, ejection and replacement against listeners on several loopback addresses.
+//
+//   gcc -I. tests/edge_selector.c http.c -o edge_selector_test -lpthread && ./edge_selector_test
+#include "http.h"
+#include "check.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+// ---------------------------------------------------------------------------------------------------------
+// Loopback edges
+
+#define EDGE_COUNT 4
+
+// An edge at 127.0.0.2 + index that answers every request after delayMs, or refuses connections.
+typedef struct {
+    const char* address;
+    int delayMs; // -1 = nothing listens
+    int sd;
+} LoopbackEdge;
+
+static LoopbackEdge edges[EDGE_COUNT] = {
+    { "127.0.0.2", 120, -1 },
+    { "127.0.0.3", 10, -1 },
+    { "127.0.0.4", 60, -1 },
+    { "127.0.0.5", -1, -1 },
+};
+
+static void* runEdge(void* arg) {
+    LoopbackEdge* edge = arg;
+    static const char response[] = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\nConnection: close\r\n\r\nok";
+    for (;;) {
+        int client = accept(edge->sd, NULL, NULL);
+        if (client < 0) continue;
+        char request[2048];
+        size_t received = 0;
+        while (received < sizeof(request) - 1) {
+            ssize_t n = recv(client, request + received, sizeof(request) - 1 - received, 0);
+            if (n <= 0) break;
+            received += n;
+            request[received] = '\0';
+            if (strstr(request, "\r\n\r\n")) break;
+        }
+        checkSleepMs(edge->delayMs);
+        if (send(client, response, sizeof(response) - 1, MSG_NOSIGNAL) < 0) {}
+        close(client);
+    }
+    return NULL;
+}
+
+// Starts the listening edges on one port. Returns the port, or 0.
+static int startEdges(void) {
+    int port = 0;
+    for (int i = 0; i < EDGE_COUNT; i++) {
+        if (edges[i].delayMs < 0) continue;
+        int one = 1;
+        struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+        socklen_t length = sizeof(addr);
+        inet_pton(AF_INET, edges[i].address, &addr.sin_addr);
+        edges[i].sd = socket(AF_INET, SOCK_STREAM, 0);
+        setsockopt(edges[i].sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(edges[i].sd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(edges[i].sd, 16) < 0 ||
+            getsockname(edges[i].sd, (struct sockaddr*)&addr, &length) < 0) {
+            perror(edges[i].address);
+            return 0;
+        }
+        port = ntohs(addr.sin_port);
+        pthread_t thread;
+        pthread_create(&thread, NULL, runEdge, &edges[i]);
+        pthread_detach(thread);
+    }
+    return port;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// Tests
+
+// Index of the edge at addr, or -1.
+static int edgeIndex(const struct sockaddr_in* addr) {
+    char text[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr->sin_addr, text, sizeof(text));
+    for (int i = 0; i < EDGE_COUNT; i++) {
+        if (strcmp(text, edges[i].address) == 0) return i;
+    }
+    return -1;
+}
+
+// Stats of every candidate by edge index. Returns false unless each edge is exactly one candidate.
+static bool edgeStats(HTTPEdgeSelector* selector, HTTPEdgeStats* byEdge) {
+    HTTPEdgeStats stats[EDGE_COUNT];
+    bool seen[EDGE_COUNT] = { false };
+    if (GetHTTPEdgeStats(selector, stats, EDGE_COUNT) != EDGE_COUNT) return false;
+    for (int i = 0; i < EDGE_COUNT; i++) {
+        int index = edgeIndex(&stats[i].addr);
+        if (index < 0 || seen[index]) return false;
+        seen[index] = true;
+        byEdge[index] = stats[i];
+    }
+    return true;
+}
+
+// The edge SelectHTTPEdge() returns every time out of count selections, or -1 if it varies.
+static int selectedEdge(HTTPEdgeSelector* selector, int count) {
+    int edge = -2;
+    for (int i = 0; i < count; i++) {
+        struct sockaddr_in addr;
+        if (!SelectHTTPEdge(selector, &addr)) return -1;
+        int index = edgeIndex(&addr);
+        if (edge != -2 && index != edge) return -1;
+        edge = index;
+    }
+    return edge;
+}
+
+int main(void) {
+    int port = startEdges();
+    if (!port) return 1;
+    const char* ranges[] = { "127.0.0.2/31", "127.0.0.4/31" };
+    HTTPEdgeSelectorOptions options = {
+        .ranges = ranges,
+        .range_count = 2,
+        .candidates = EDGE_COUNT,
+        .port = port,
+        .probe_host = "edge.test",
+        .probe_path = "/probe",
+        .probe_timeout_ms = 500,
+        .explore_percent = -1,
+        .ewma_weight_percent = 50,
+        .eject_after_failures = 2,
+        .eject_ms = 300,
+    };
+    HTTPEdgeStats stats[EDGE_COUNT];
+
+    // Candidates come from the configured ranges with the configured port
+    HTTPEdgeSelector* selector = CreateHTTPEdgeSelector(&options);
+    CHECK(selector != NULL);
+    if (!selector) return checkResult("edge_selector");
+    CHECK(edgeStats(selector, stats)); // four candidates from four addresses, each one once
+    for (int i = 0; i < EDGE_COUNT; i++) CHECK(ntohs(stats[i].addr.sin_port) == port && stats[i].samples == 0);
+    CHECK(selectedEdge(selector, 1) >= 0); // unprobed, picked at random
+
+    // Probes score the edges by latency and failures
+    CHECK(ProbeHTTPEdges(selector) == 3);
+    CHECK(edgeStats(selector, stats));
+    CHECK(stats[1].latency_ms < stats[2].latency_ms && stats[2].latency_ms < stats[0].latency_ms);
+    CHECK(stats[0].latency_ms >= 100 && stats[2].latency_ms >= 50);
+    CHECK(stats[3].failure_rate == 0.5 && stats[3].score == 250);
+    CHECK(!stats[3].ejected);
+    CHECK(selectedEdge(selector, 50) == 1);
+
+    // Failing edges are ejected after eject_after_failures in a row and no longer selected
+    CHECK(ProbeHTTPEdges(selector) == 3);
+    CHECK(edgeStats(selector, stats));
+    CHECK(stats[3].ejected && stats[3].samples == 2);
+    ReportHTTPEdge(selector, &stats[1].addr, false, 0);
+    CHECK(edgeStats(selector, stats));
+    CHECK(!stats[1].ejected && stats[1].failure_rate == 0.5);
+    CHECK(selectedEdge(selector, 50) == 2); // half the probe timeout is added to the 10 ms, 60 ms is better now
+    ReportHTTPEdge(selector, &stats[1].addr, false, 0);
+    CHECK(edgeStats(selector, stats));
+    CHECK(stats[1].ejected);
+    for (int i = 0; i < 4; i++) ReportHTTPEdge(selector, &stats[1].addr, true, 1);
+    CHECK(edgeStats(selector, stats));
+    CHECK(stats[1].ejected && stats[1].score < stats[2].score); // the best score, but ejected
+    CHECK(selectedEdge(selector, 50) == 2);
+    CHECK(ProbeHTTPEdges(selector) == 2); // ejected edges are not probed
+    CHECK(edgeStats(selector, stats));
+    CHECK(stats[1].samples == 8 && stats[3].samples == 2);
+
+    // Once eject_ms is over, ejected candidates are replaced by an address drawn afresh, without a score
+    checkSleepMs(350);
+    CHECK(selectedEdge(selector, 1) == 2);
+    CHECK(edgeStats(selector, stats));
+    CHECK(!stats[1].ejected && !stats[3].ejected);
+    CHECK(stats[1].samples == 0 && stats[3].samples == 0 && stats[1].score == 0);
+    CHECK(stats[0].samples == 3 && stats[2].samples == 3);
+    CHECK(ProbeHTTPEdges(selector) == 3);
+    CHECK(selectedEdge(selector, 50) == 1);
+
+    // Reports for addresses that are not candidates are ignored
+    struct sockaddr_in other = { .sin_family = AF_INET, .sin_port = htons(port) };
+    inet_pton(AF_INET, "127.0.0.9", &other.sin_addr);
+    ReportHTTPEdge(selector, &other, false, 0);
+    CHECK(GetHTTPEdgeStats(selector, NULL, 0) == EDGE_COUNT);
+    DestroyHTTPEdgeSelector(selector);
+
+    // Without a probe host a TCP connect is the probe
+    options.probe_host = NULL;
+    selector = CreateHTTPEdgeSelector(&options);
+    CHECK(selector != NULL);
+    if (selector) {
+        CHECK(ProbeHTTPEdges(selector) == 3);
+        CHECK(edgeStats(selector, stats));
+        CHECK(stats[3].failure_rate == 0.5);
+        CHECK(stats[0].latency_ms < 50 && stats[1].latency_ms < 50 && stats[2].latency_ms < 50);
+        DestroyHTTPEdgeSelector(selector);
+    }
+
+    // Exploration sends some selections to other candidates
+    options.probe_host = "edge.test";
+    options.explore_percent = 50;
+    selector = CreateHTTPEdgeSelector(&options);
+    CHECK(selector != NULL);
+    if (selector) {
+        CHECK(ProbeHTTPEdges(selector) == 3);
+        CHECK(selectedEdge(selector, 50) == -1);
+        DestroyHTTPEdgeSelector(selector);
+    }
+
+    const char* invalid[] = { "300.1.2.3/8" };
+    options.ranges = invalid;
+    options.range_count = 1;
+    CHECK(CreateHTTPEdgeSelector(&options) == NULL);
+    return checkResult("edge_selector");
+}
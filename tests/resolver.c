@@ -0,0 +1,265 @@
+// Resolver cache and UDP lookups against a stub DNS server on a loopback port.
+//
+//   gcc -I. tests/resolver.c http.c -o resolver_test -lpthread && ./resolver_test
+#include "http.h"
+#include "check.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+// ---------------------------------------------------------------------------------------------------------
+// Stub DNS server
+
+// How the stub answers a name.
+typedef struct {
+    const char* name;
+    const char* address; // A record, NULL = NXDOMAIN
+    unsigned int ttl;
+    const char* alias;   // Answer with a CNAME to alias first, whose A record is address
+    int delayMs;         // Wait before answering
+    bool silent;         // Never answer
+    bool spoof;          // Send a reply with the wrong id first
+    int queries;         // Queries received
+} StubRecord;
+
+static StubRecord records[] = {
+    { .name = "a.test", .address = "10.1.2.3", .ttl = 300 },
+    { .name = "short.test", .address = "10.1.2.4", .ttl = 1 },
+    { .name = "alias.test", .address = "10.1.2.5", .ttl = 30, .alias = "target.alias.test" },
+    { .name = "missing.test" },
+    { .name = "silent.test", .silent = true },
+    { .name = "spoof.test", .address = "10.9.9.9", .ttl = 60, .spoof = true },
+    { .name = "slow.test", .address = "10.1.2.6", .ttl = 60, .delayMs = 150 },
+    { .name = "e1.test", .address = "10.2.0.1", .ttl = 60 }, { .name = "e2.test", .address = "10.2.0.2", .ttl = 60 },
+    { .name = "e3.test", .address = "10.2.0.3", .ttl = 60 }, { .name = "e4.test", .address = "10.2.0.4", .ttl = 60 },
+    { .name = "e5.test", .address = "10.2.0.5", .ttl = 60 }, { .name = "e6.test", .address = "10.2.0.6", .ttl = 60 },
+};
+#define RECORD_COUNT (int)(sizeof(records) / sizeof(records[0]))
+
+static pthread_mutex_t stubLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int queriesFor(const char* name) {
+    pthread_mutex_lock(&stubLock);
+    int count = 0;
+    for (int i = 0; i < RECORD_COUNT; i++) {
+        if (strcasecmp(records[i].name, name) == 0) count = records[i].queries;
+    }
+    pthread_mutex_unlock(&stubLock);
+    return count;
+}
+
+// Appends name in DNS label format. Returns the new offset.
+static int putName(unsigned char* out, int offset, const char* name) {
+    while (*name) {
+        const char* dot = strchr(name, '.');
+        int length = dot ? (int)(dot - name) : (int)strlen(name);
+        out[offset++] = (unsigned char)length;
+        memcpy(out + offset, name, length);
+        offset += length;
+        name += length + (dot ? 1 : 0);
+    }
+    out[offset++] = 0;
+    return offset;
+}
+
+// Appends a resource record whose owner is the name at nameOffset. Returns the new offset.
+static int putRecord(unsigned char* out, int offset, int nameOffset, int type, unsigned int ttl, const unsigned char* data, int length) {
+    unsigned char head[12] = { 0xc0 | (nameOffset >> 8), nameOffset & 0xff, 0, type, 0, 1,
+        ttl >> 24, (ttl >> 16) & 0xff, (ttl >> 8) & 0xff, ttl & 0xff, length >> 8, length & 0xff };
+    memcpy(out + offset, head, sizeof(head));
+    memcpy(out + offset + sizeof(head), data, length);
+    return offset + (int)sizeof(head) + length;
+}
+
+static void* runStubServer(void* arg) {
+    int sd = *(int*)arg;
+    unsigned char query[512], reply[512];
+    for (;;) {
+        struct sockaddr_in from;
+        socklen_t fromLength = sizeof(from);
+        ssize_t n = recvfrom(sd, query, sizeof(query), 0, (struct sockaddr*)&from, &fromLength);
+        if (n < 12 + 5) continue;
+
+        // The question name, decoded into dotted form
+        char name[256] = "";
+        int offset = 12, length = 0;
+        while (offset < n && query[offset] != 0 && length + query[offset] + 1 < (int)sizeof(name)) {
+            int labelLength = query[offset];
+            if (length) name[length++] = '.';
+            memcpy(name + length, query + offset + 1, labelLength);
+            length += labelLength;
+            offset += labelLength + 1;
+        }
+        name[length] = '\0';
+        int questionEnd = offset + 1 + 4;
+        if (questionEnd > n) continue;
+
+        StubRecord* record = NULL;
+        pthread_mutex_lock(&stubLock);
+        for (int i = 0; i < RECORD_COUNT; i++) {
+            if (strcasecmp(records[i].name, name) == 0) {
+                record = &records[i];
+                record->queries++;
+            }
+        }
+        pthread_mutex_unlock(&stubLock);
+        if (!record || record->silent) continue;
+        if (record->delayMs) checkSleepMs(record->delayMs);
+
+        memcpy(reply, query, questionEnd);
+        reply[2] = 0x81; // QR, RD
+        reply[3] = record->address ? 0x80 : 0x83; // RA, NXDOMAIN without an address
+        reply[6] = 0;
+        reply[7] = 0;
+        reply[8] = reply[9] = reply[10] = reply[11] = 0;
+        offset = questionEnd;
+        if (record->address) {
+            int owner = 12;
+            if (record->alias) {
+                unsigned char target[256];
+                int targetLength = putName(target, 0, record->alias);
+                offset = putRecord(reply, offset, owner, 5, 120, target, targetLength);
+                owner = offset - targetLength;
+                reply[7]++;
+            }
+            unsigned char address[4];
+            inet_pton(AF_INET, record->address, address);
+            if (record->spoof) {
+                unsigned char forged[512];
+                memcpy(forged, reply, offset);
+                forged[0] ^= 0x55;
+                forged[7] = 1;
+                unsigned char other[4] = { 10, 6, 6, 6 };
+                int forgedLength = putRecord(forged, offset, owner, 1, 60, other, 4);
+                sendto(sd, forged, forgedLength, 0, (struct sockaddr*)&from, fromLength);
+            }
+            offset = putRecord(reply, offset, owner, 1, record->ttl, address, 4);
+            reply[7]++;
+        }
+        sendto(sd, reply, offset, 0, (struct sockaddr*)&from, fromLength);
+    }
+    return NULL;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// Tests
+
+static bool resolvesTo(const char* name, int port, const char* expected) {
+    struct sockaddr_in addr;
+    if (ResolveHTTPHost(name, port, &addr) != 0) return false;
+    char text[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr.sin_addr, text, sizeof(text));
+    return addr.sin_family == AF_INET && ntohs(addr.sin_port) == port && strcmp(text, expected) == 0;
+}
+
+int main(void) {
+    int sd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in local = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t localLength = sizeof(local);
+    if (sd < 0 || bind(sd, (struct sockaddr*)&local, sizeof(local)) < 0 || getsockname(sd, (struct sockaddr*)&local, &localLength) < 0) {
+        perror("stub server");
+        return 1;
+    }
+    pthread_t server;
+    pthread_create(&server, NULL, runStubServer, &sd);
+    pthread_detach(server);
+
+    HTTPResolverOptions options = {
+        .nameserver = "127.0.0.1",
+        .nameserver_port = ntohs(local.sin_port),
+        .max_entries = 8,
+        .negative_ttl_s = 1,
+        .timeout_ms = 300,
+    };
+    CHECK(ConfigureHTTPResolver(&options) == 0);
+    HTTPResolverStats stats;
+
+    // Answers are cached and names are case-insensitive
+    CHECK(resolvesTo("a.test", 8080, "10.1.2.3"));
+    CHECK(resolvesTo("a.test", 443, "10.1.2.3"));
+    CHECK(resolvesTo("A.Test", 80, "10.1.2.3"));
+    CHECK(queriesFor("a.test") == 1);
+    GetHTTPResolverStats(&stats);
+    CHECK(stats.misses == 1 && stats.hits == 2);
+
+    // IPv4 literals never reach the nameserver or the cache
+    CHECK(resolvesTo("192.0.2.7", 80, "192.0.2.7"));
+    GetHTTPResolverStats(&stats);
+    CHECK(stats.misses == 1);
+
+    // The A record at the end of a CNAME chain, with compressed names
+    CHECK(resolvesTo("alias.test", 80, "10.1.2.5"));
+
+    // NXDOMAIN is cached for negative_ttl_s
+    struct sockaddr_in addr;
+    CHECK(ResolveHTTPHost("missing.test", 80, &addr) == -1);
+    CHECK(ResolveHTTPHost("missing.test", 80, &addr) == -1);
+    CHECK(queriesFor("missing.test") == 1);
+    GetHTTPResolverStats(&stats);
+    CHECK(stats.negative_hits == 1);
+
+    // A nameserver that does not answer fails after timeout_ms, and the failure is not cached
+    long long start = checkNowMs();
+    CHECK(ResolveHTTPHost("silent.test", 80, &addr) == -1);
+    long long waited = checkNowMs() - start;
+    CHECK(waited >= 250 && waited < 1500);
+    CHECK(ResolveHTTPHost("silent.test", 80, &addr) == -1);
+    CHECK(queriesFor("silent.test") == 2);
+
+    // A reply with another id is ignored
+    CHECK(resolvesTo("spoof.test", 80, "10.9.9.9"));
+
+    // Asynchronous lookups return at once and signal their descriptor
+    start = checkNowMs();
+    HTTPResolveQuery* query = StartHTTPResolve("slow.test", 8443);
+    CHECK(query != NULL);
+    CHECK(checkNowMs() - start < 100);
+    CHECK(GetHTTPResolveFD(query) >= 0);
+    CHECK(FinishHTTPResolve(query, &addr, 0) == 1);
+    struct pollfd pfd = { .fd = GetHTTPResolveFD(query), .events = POLLIN };
+    CHECK(poll(&pfd, 1, 2000) == 1);
+    CHECK(FinishHTTPResolve(query, &addr, 0) == 0);
+    CHECK(addr.sin_addr.s_addr == inet_addr("10.1.2.6") && ntohs(addr.sin_port) == 8443);
+    query = StartHTTPResolve("slow.test", 80); // cached now
+    CHECK(query != NULL && GetHTTPResolveFD(query) == -1);
+    CHECK(FinishHTTPResolve(query, &addr, 0) == 0);
+    query = StartHTTPResolve("silent.test", 80);
+    CancelHTTPResolve(query);
+
+    // TTLs expire, positive and negative
+    CHECK(resolvesTo("short.test", 80, "10.1.2.4"));
+    checkSleepMs(1100);
+    CHECK(resolvesTo("short.test", 80, "10.1.2.4"));
+    CHECK(queriesFor("short.test") == 2);
+    CHECK(ResolveHTTPHost("missing.test", 80, &addr) == -1);
+    CHECK(queriesFor("missing.test") == 2);
+    GetHTTPResolverStats(&stats);
+    CHECK(stats.expired == 2);
+
+    // The cache holds max_entries names, the least recently used goes first
+    CHECK(ConfigureHTTPResolver(&options) == 0);
+    const char* names[] = { "e1.test", "e2.test", "e3.test", "e4.test", "e5.test", "e6.test", "a.test", "alias.test" };
+    for (int i = 0; i < 8; i++) {
+        CHECK(ResolveHTTPHost(names[i], 80, &addr) == 0);
+        checkSleepMs(2); // recency is kept in milliseconds
+    }
+    CHECK(resolvesTo("e1.test", 80, "10.2.0.1")); // e1 is now the most recently used
+    checkSleepMs(2);
+    CHECK(resolvesTo("spoof.test", 80, "10.9.9.9"));
+    GetHTTPResolverStats(&stats);
+    CHECK(stats.evicted == 1);
+    CHECK(resolvesTo("e2.test", 80, "10.2.0.2")); // evicted, asked again
+    CHECK(queriesFor("e2.test") == 2);
+    CHECK(queriesFor("e1.test") == 1);
+
+    // Back to getaddrinfo()
+    CHECK(ConfigureHTTPResolver(NULL) == 0);
+    CHECK(resolvesTo("127.0.0.1", 80, "127.0.0.1"));
+    CHECK(ResolveHTTPHost("localhost", 80, &addr) == 0);
+    return checkResult("resolver");
+}
@@ -0,0 +1,225 @@
+// TLS handshakes, session resumption and pooled connection reuse against `openssl s_server` and an in-process
+// keep-alive server, and the deadlines of non-blocking TLS sockets. Needs the openssl command to make a certificate.
+//
+//   gcc -DHTTP_WITH_OPENSSL -I. tests/tls.c http.c -o tls_test -lpthread -lssl -lcrypto && ./tls_test
+#include "http.h"
+#include "check.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <openssl/ssl.h>
+
+static char directory[] = "/tmp/http_tls_XXXXXX";
+static char certFile[64], keyFile[64];
+
+// ---------------------------------------------------------------------------------------------------------
+// Servers
+
+// A loopback listener on a free port. Returns the socket, or -1.
+static int listenLoopback(int* port) {
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t length = sizeof(addr);
+    if (sd < 0 || bind(sd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(sd, 16) < 0 ||
+        getsockname(sd, (struct sockaddr*)&addr, &length) < 0) {
+        perror("listen");
+        if (sd >= 0) close(sd);
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+    return sd;
+}
+
+// Runs `openssl s_server -www` on port, which answers each connection with a status page and closes it.
+static pid_t startSServer(int port) {
+    char accept[16];
+    snprintf(accept, sizeof(accept), "%d", port);
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_RDWR);
+        dup2(null, 0);
+        dup2(null, 1);
+        dup2(null, 2);
+        execlp("openssl", "openssl", "s_server", "-accept", accept, "-cert", certFile, "-key", keyFile, "-www", "-quiet", (char*)NULL);
+        _exit(127);
+    }
+    // ready once it accepts connections
+    for (int i = 0; pid > 0 && i < 100; i++) {
+        int sd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+        bool ready = connect(sd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+        close(sd);
+        if (ready) return pid;
+        checkSleepMs(50);
+    }
+    return -1;
+}
+
+static SSL_CTX* serverContext;
+static int keepAliveAccepted;
+
+// Answers the requests of one connection with "hello" until the client closes it. A request for /stall is never
+// answered.
+static void serveKeepAlive(SSL* ssl) {
+    static const char response[] = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello";
+    char request[4096];
+    size_t received = 0;
+    for (;;) {
+        int n = SSL_read(ssl, request + received, (int)(sizeof(request) - 1 - received));
+        if (n <= 0) return;
+        received += n;
+        request[received] = '\0';
+        char* end;
+        while ((end = strstr(request, "\r\n\r\n"))) {
+            if (strncmp(request, "GET /stall ", 11) == 0) {
+                while (SSL_read(ssl, request, sizeof(request)) > 0) {}
+                return;
+            }
+            if (SSL_write(ssl, response, sizeof(response) - 1) <= 0) return;
+            received -= end + 4 - request;
+            memmove(request, end + 4, received + 1);
+        }
+        if (received == sizeof(request) - 1) return;
+    }
+}
+
+static void* runKeepAliveServer(void* arg) {
+    int sd = *(int*)arg;
+    for (;;) {
+        int client = accept(sd, NULL, NULL);
+        if (client < 0) continue;
+        __atomic_add_fetch(&keepAliveAccepted, 1, __ATOMIC_SEQ_CST);
+        SSL* ssl = SSL_new(serverContext);
+        SSL_set_fd(ssl, client);
+        if (SSL_accept(ssl) == 1) serveKeepAlive(ssl);
+        SSL_free(ssl);
+        close(client);
+    }
+    return NULL;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// Tests
+
+// GET path over TLS. Returns the error of the response, or of the send if that failed.
+static int fetch(int port, const char* host, const char* path, HTTPConnectionPool* pool, const HTTPSocketOptions* options, int* status) {
+    HTTPRequestInfo rq = {
+        .ipaddr = "127.0.0.1", .host = (char*)host, .port = port, .sd = -1, .method = HTTP_GET, .query = (char*)path,
+        .content_type = CONTENT_TYPE_TEXT_PLAIN, .cookie = "", .pool = pool, .tls = true,
+    };
+    if (options) rq.socket_options = *options;
+    *status = 0;
+    int error = SendHTTPRequest(&rq);
+    HTTPResponseInfo* msg = FetchHTTPResponse(&rq);
+    if (!msg) return -1;
+    if (error == 0) error = msg->error;
+    *status = msg->l7.status_code;
+    FreeHTTPResponseResource(msg);
+    return error;
+}
+
+static void cleanUp(void) {
+    unlink(certFile);
+    unlink(keyFile);
+    rmdir(directory);
+}
+
+int main(void) {
+    signal(SIGPIPE, SIG_IGN);
+    if (!mkdtemp(directory)) return 1;
+    snprintf(certFile, sizeof(certFile), "%s/cert.pem", directory);
+    snprintf(keyFile, sizeof(keyFile), "%s/key.pem", directory);
+    char command[512];
+    snprintf(command, sizeof(command), "openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes -days 1 "
+             "-subj /CN=localhost -addext subjectAltName=DNS:localhost,IP:127.0.0.1 -keyout %s -out %s >/dev/null 2>&1", keyFile, certFile);
+    if (system(command) != 0) {
+        cleanUp();
+        printf("tls: skipped, openssl cannot make a certificate\n");
+        return 0;
+    }
+
+    HTTPTLSOptions options = { .ca_file = certFile };
+    CHECK(InitHTTPTLS(&options) == 0);
+    CHECK(InitHTTPTLS(&options) == -1); // already set up
+    HTTPTLSStats stats;
+    int status;
+
+    // A full handshake, then one that resumes the session the server handed out
+    int port;
+    int reserved = listenLoopback(&port);
+    if (reserved >= 0) close(reserved);
+    pid_t server = reserved >= 0 ? startSServer(port) : -1;
+    CHECK(server > 0);
+    if (server > 0) {
+        CHECK(fetch(port, "localhost", "/", NULL, NULL, &status) == 0 && status == 200);
+        GetHTTPTLSStats(&stats);
+        CHECK(stats.handshakes == 1 && stats.resumed == 0 && stats.sessions == 1);
+        CHECK(fetch(port, "localhost", "/", NULL, NULL, &status) == 0 && status == 200);
+        CHECK(fetch(port, "127.0.0.1", "/", NULL, NULL, &status) == 0 && status == 200); // verified as an address
+        GetHTTPTLSStats(&stats);
+        CHECK(stats.handshakes == 3 && stats.resumed == 1 && stats.sessions == 2);
+
+        // A name the certificate is not for fails the handshake
+        CHECK(fetch(port, "other.test", "/", NULL, NULL, &status) == -1 && status == 0);
+        GetHTTPTLSStats(&stats);
+        CHECK(stats.failures == 1 && stats.handshakes == 3);
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+    }
+
+    // Pooled connections carry their TLS state, later requests are sent on the same session
+    serverContext = SSL_CTX_new(TLS_server_method());
+    CHECK(serverContext && SSL_CTX_use_certificate_file(serverContext, certFile, SSL_FILETYPE_PEM) == 1 &&
+          SSL_CTX_use_PrivateKey_file(serverContext, keyFile, SSL_FILETYPE_PEM) == 1);
+    int listener = listenLoopback(&port);
+    CHECK(listener >= 0);
+    if (listener >= 0) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, runKeepAliveServer, &listener);
+        pthread_detach(thread);
+
+        HTTPConnectionPool* pool = CreateHTTPConnectionPool(NULL);
+        for (int i = 0; i < 3; i++) CHECK(fetch(port, "localhost", "/keep", pool, NULL, &status) == 0 && status == 200);
+        HTTPConnectionPoolStats poolStats;
+        GetHTTPConnectionPoolStats(pool, &poolStats);
+        CHECK(poolStats.hits == 2 && poolStats.misses == 1);
+        CHECK(__atomic_load_n(&keepAliveAccepted, __ATOMIC_SEQ_CST) == 1);
+        GetHTTPTLSStats(&stats);
+        CHECK(stats.handshakes == 4);
+        DestroyHTTPConnectionPool(pool);
+
+        // Reads wait for the deadline, or io_timeout_ms without one, instead of blocking in SSL_read()
+        HTTPSocketOptions deadline = { .deadline_ms = 300 };
+        long long start = checkNowMs();
+        CHECK(fetch(port, "localhost", "/stall", NULL, &deadline, &status) == -5);
+        long long waited = checkNowMs() - start;
+        CHECK(waited >= 250 && waited < 1500);
+        HTTPSocketOptions ioTimeout = { .io_timeout_ms = 300 };
+        start = checkNowMs();
+        CHECK(fetch(port, "localhost", "/stall", NULL, &ioTimeout, &status) == -5);
+        waited = checkNowMs() - start;
+        CHECK(waited >= 250 && waited < 1500);
+    }
+
+    // A server that accepts the connection but never answers the handshake
+    int silent = listenLoopback(&port);
+    CHECK(silent >= 0);
+    if (silent >= 0) {
+        HTTPSocketOptions connectTimeout = { .connect_timeout_ms = 300 };
+        long long start = checkNowMs();
+        CHECK(fetch(port, "localhost", "/", NULL, &connectTimeout, &status) == -5);
+        long long waited = checkNowMs() - start;
+        CHECK(waited >= 250 && waited < 1500);
+        GetHTTPTLSStats(&stats);
+        CHECK(stats.failures == 2);
+        close(silent);
+    }
+    cleanUp();
+    return checkResult("tls");
+}